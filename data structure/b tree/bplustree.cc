@@ -3,12 +3,20 @@
 #include <assert.h>
 #include <string.h>
 #include <fcntl.h>
+#include <limits.h>
 
 #define _XOPEN_SOURCE 700
 #include <ctype.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef __linux__
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "bplustree.h"
 
@@ -37,6 +45,27 @@ enum {
 #define data(node) ((bptree_val_t *)(offset_ptr(node) + _max_entries * sizeof(bptree_key_t)))
 /* get the addr of child ptr */
 #define sub(node) ((off_t *)(offset_ptr(node) + (_max_order - 1) * sizeof(bptree_key_t)))
+/* BPLUS_TREE_COUNTED: keys below each child ptr of a non-leaf node, after the ptrs */
+#define cnt(node) ((long *)(offset_ptr(node) + (_max_order - 1) * sizeof(bptree_key_t) + _max_order * sizeof(off_t)))
+/* get the message count and the messages of a buffered non-leaf node */
+#define msg_nr(node) (*(int *)(offset_ptr(node) + _buffer_offset))
+#define msg(node) ((struct bplus_msg *)(offset_ptr(node) + _buffer_offset + sizeof(bptree_val_t)))
+
+/* bloom filter block, one cache line */
+#define BLOOM_BLOCK_BITS 512
+#define BLOOM_BLOCK_WORDS (BLOOM_BLOCK_BITS / 64)
+#define BLOOM_MIN_CAPACITY 4096
+#define BLOOM_MAX_HASHES 16
+
+/* blocks advised at once when a descending scan walks leaves laid out in order */
+#define BPLUS_READAHEAD_BLOCKS 16
+
+/* messages bplus_tree_merge converts and applies at a time */
+#define BPLUS_MERGE_BATCH 256
+
+/* percent of the entries the rightmost node keeps when a key above all of
+ * them splits it, later appends fill the new node */
+#define BPLUS_APPEND_FILL 90
 
 /* size for each IO op (size for each tree node) */
 static int _block_size;
@@ -45,6 +74,89 @@ static int _max_entries;
 /* upperbound of children number for each node (maximum child number = _max_order) 
  *      if #child meet _max_order, split occur. */
 static int _max_order;
+/* size of a node in the caches, two blocks when nodes are packed on disk */
+static int _node_size;
+/* BPLUS_TREE_BUFFERED: where the message buffer of a non-leaf node starts
+ * (after the child ptrs), how many messages it holds and how many it keeps
+ * before a batch is flushed to a child */
+static int _buffer_offset;
+static int _buffer_max;
+static int _buffer_flush;
+
+/* boot file marker of a packed tree, kept above the block size */
+#define BOOT_COMPRESS ((off_t) 1 << 32)
+/* boot file marker of a shadow paged tree */
+#define BOOT_COW ((off_t) 1 << 33)
+/* boot file marker of a tree with buffered non-leaf nodes */
+#define BOOT_BUFFERED ((off_t) 1 << 34)
+/* boot file marker of a tree counting the keys below each child ptr */
+#define BOOT_COUNTED ((off_t) 1 << 35)
+/* block number of INVALID_OFFSET in a packed node */
+#define PACKED_INVALID 0xffffffffu
+
+/* A packed node is what a BPLUS_TREE_COMPRESS tree stores on disk, the caches
+ * keep the plain layout so the node algorithms are unchanged.
+ *      for nonleaf node: packed info + keys + uint32 child block numbers
+ *      for leaf node   : packed leaf info + key deltas + data deltas
+ * Leaf keys are stored as deltas to the first key and data as deltas to the
+ * smallest one, each with the narrowest byte width that holds the range. */
+struct bplus_packed {
+        uint32_t self;
+        uint32_t parent;
+        uint32_t prev;
+        uint32_t next;
+        int type;
+        int children;
+};
+
+struct bplus_packed_leaf {
+        struct bplus_packed info;
+        bptree_key_t key_base;
+        uint8_t key_width;
+        uint8_t data_width;
+        bptree_val_t data_base;
+};
+
+/* key, data and child ranges of a leaf being packed */
+struct pack_range {
+        int n;
+        bptree_key_t key_min, key_max;
+        bptree_val_t data_min, data_max;
+};
+
+/* A BPLUS_TREE_BUFFERED non-leaf node holds puts on their way down, sorted
+ * by key and at most one per key. A message is newer than everything below
+ * its node and older than everything above, two of them for one key fold
+ * into one (see msg_compose).
+ *      for buffered nonleaf node: node info + keys + child ptr + count + messages */
+enum {
+        /* insert unless the key exists, what bplus_tree_put does */
+        BUFFER_INSERT,
+        BUFFER_DELETE,
+        /* insert or replace, a delete followed by an insert */
+        BUFFER_SET,
+};
+
+struct bplus_msg {
+        bptree_key_t key;
+        int op;
+        bptree_val_t data;
+};
+
+struct bplus_buffer {
+        /* non-leaf nodes that may hold more than _buffer_flush messages,
+         * drained as a stack so a child is done before its parent goes on */
+        off_t *pending;
+        long nr_pending;
+        long pending_cap;
+        /* the batch on its way to a child and a merge buffer */
+        struct bplus_msg *batch;
+        struct bplus_msg *merge;
+        /* one node per level of a range scan, the buffers above a leaf are
+         * looked at from there */
+        char *path;
+        int path_levels;
+};
 
 static inline int is_leaf(struct bplus_node *node)
 {
@@ -92,7 +204,7 @@ static inline struct bplus_node *cache_refer(struct bplus_tree *tree)
         for (i = 0; i < MIN_CACHE_NUM; i++) {
                 if (!tree->used[i]) {
                         tree->used[i] = 1;
-                        char *buf = tree->caches + _block_size * i;
+                        char *buf = tree->caches + _node_size * i;
                         return (struct bplus_node *) buf;
                 }
         }
@@ -104,7 +216,7 @@ static inline void cache_defer(struct bplus_tree *tree, struct bplus_node *node)
 {
         /* return the node cache borrowed from */
         char *buf = (char *) node;
-        int i = (buf - tree->caches) / _block_size;
+        int i = (buf - tree->caches) / _node_size;
         tree->used[i] = 0;
 }
 
@@ -125,6 +237,9 @@ static inline struct bplus_node *non_leaf_new(struct bplus_tree *tree)
 {
         struct bplus_node *node = node_new(tree);
         node->type = BPLUS_TREE_NON_LEAF;
+        if (tree->buffer != NULL) {
+                msg_nr(node) = 0;
+        }
         return node;
 }
 
@@ -136,6 +251,588 @@ static inline struct bplus_node *leaf_new(struct bplus_tree *tree)
         return node;
 }
 
+/* find the block cache slot holding offset, -1 if not cached */
+static inline int bcache_lookup(struct bplus_block_cache *bc, off_t offset)
+{
+        int i = bc->buckets[(offset / _block_size) & bc->mask];
+        while (i >= 0 && bc->offsets[i] != offset) {
+                i = bc->chain[i];
+        }
+        return i;
+}
+
+/* take a slot for offset, evicting by CLOCK */
+static int bcache_insert(struct bplus_block_cache *bc, off_t offset)
+{
+        int i;
+        while (bc->ref[bc->hand]) {
+                bc->ref[bc->hand] = 0;
+                bc->hand = (bc->hand + 1) % bc->nr;
+        }
+        i = bc->hand;
+        bc->hand = (bc->hand + 1) % bc->nr;
+
+        /* unlink the victim from its bucket */
+        if (bc->offsets[i] != INVALID_OFFSET) {
+                int *p = &bc->buckets[(bc->offsets[i] / _block_size) & bc->mask];
+                while (*p != i) {
+                        p = &bc->chain[*p];
+                }
+                *p = bc->chain[i];
+        }
+
+        int *head = &bc->buckets[(offset / _block_size) & bc->mask];
+        bc->offsets[i] = offset;
+        bc->chain[i] = *head;
+        *head = i;
+        bc->ref[i] = 1;
+        return i;
+}
+
+/*
+ * Shadow paging. Node offsets of a BPLUS_TREE_COW tree are logical, the page
+ * map translates them to physical blocks of the file. A snapshot is a copy of
+ * the map taken at generation g; a block written at generation <= g may be
+ * read by it, so writing that node again goes to a fresh physical block and
+ * the old one is retired until no live snapshot can see it. Nodes keep their
+ * parent and sibling offsets as they are, since those stay logical.
+ */
+struct cow_retired {
+        off_t offset;
+        /* generations the block was written and replaced at, it is visible
+         * to snapshots with born <= gen < died */
+        unsigned long born;
+        unsigned long died;
+};
+
+struct bplus_cow {
+        /* logical block -> physical offset and the generation it was written at */
+        off_t *map;
+        unsigned long *born;
+        long nr;
+        long cap;
+        off_t phys_size;
+        /* free physical blocks */
+        off_t *free;
+        long nr_free;
+        long free_cap;
+        struct cow_retired *retired;
+        long nr_retired;
+        long retired_cap;
+        unsigned long gen;
+        /* generation of the newest live snapshot, 0 if there is none */
+        unsigned long pinned;
+        struct list_head snapshots;
+};
+
+/* grow a malloc'ed array to hold at least n elements */
+static void *array_reserve(void *array, long *cap, long n, size_t size)
+{
+        if (n <= *cap) {
+                return array;
+        }
+        long new_cap = *cap > 0 ? *cap : 64;
+        while (new_cap < n) {
+                new_cap *= 2;
+        }
+        array = realloc(array, new_cap * size);
+        assert(array != NULL);
+        *cap = new_cap;
+        return array;
+}
+
+static struct bplus_cow *cow_new(void)
+{
+        struct bplus_cow *cow = (struct bplus_cow *) calloc(1, sizeof(*cow));
+        assert(cow != NULL);
+        cow->gen = 1;
+        list_init(&cow->snapshots);
+        return cow;
+}
+
+/* make logical block i addressable */
+static void cow_map_grow(struct bplus_cow *cow, long i)
+{
+        if (i < cow->nr) {
+                return;
+        }
+        long cap = cow->cap;
+        cow->map = (off_t *) array_reserve(cow->map, &cap, i + 1, sizeof(off_t));
+        cow->born = (unsigned long *) array_reserve(cow->born, &cow->cap, i + 1, sizeof(unsigned long));
+        for (; cow->nr <= i; cow->nr++) {
+                cow->map[cow->nr] = INVALID_OFFSET;
+                cow->born[cow->nr] = 0;
+        }
+}
+
+static inline void cow_block_free(struct bplus_cow *cow, off_t offset)
+{
+        cow->free = (off_t *) array_reserve(cow->free, &cow->free_cap, cow->nr_free + 1, sizeof(off_t));
+        cow->free[cow->nr_free++] = offset;
+}
+
+/* give up a physical block written at born, it is kept while a snapshot sees it */
+static void cow_block_retire(struct bplus_cow *cow, off_t offset, unsigned long born)
+{
+        if (born > cow->pinned) {
+                cow_block_free(cow, offset);
+                return;
+        }
+        cow->retired = (struct cow_retired *) array_reserve(cow->retired, &cow->retired_cap,
+                                                            cow->nr_retired + 1, sizeof(struct cow_retired));
+        struct cow_retired *r = &cow->retired[cow->nr_retired++];
+        r->offset = offset;
+        r->born = born;
+        r->died = cow->gen;
+}
+
+/* physical offset a read of the logical offset goes to */
+static inline off_t cow_read_offset(struct bplus_tree *tree, off_t offset)
+{
+        struct bplus_cow *cow = tree->cow;
+        long i = offset / _block_size;
+        assert(i < cow->nr && cow->map[i] != INVALID_OFFSET);
+        return cow->map[i];
+}
+
+/* physical offset a write of the logical offset goes to, in place unless a
+ * live snapshot may read the current block */
+static off_t cow_write_offset(struct bplus_tree *tree, off_t offset)
+{
+        struct bplus_cow *cow = tree->cow;
+        long i = offset / _block_size;
+        cow_map_grow(cow, i);
+        if (cow->map[i] != INVALID_OFFSET) {
+                if (cow->born[i] > cow->pinned) {
+                        return cow->map[i];
+                }
+                cow_block_retire(cow, cow->map[i], cow->born[i]);
+                tree->stats.blocks_shadowed++;
+        }
+
+        if (cow->nr_free > 0) {
+                cow->map[i] = cow->free[--cow->nr_free];
+        } else {
+                cow->map[i] = cow->phys_size;
+                cow->phys_size += _block_size;
+        }
+        cow->born[i] = cow->gen;
+        return cow->map[i];
+}
+
+/* a node was deleted, its logical offset goes back to the free list */
+static void cow_unmap(struct bplus_tree *tree, off_t offset)
+{
+        struct bplus_cow *cow = tree->cow;
+        long i = offset / _block_size;
+        if (i < cow->nr && cow->map[i] != INVALID_OFFSET) {
+                cow_block_retire(cow, cow->map[i], cow->born[i]);
+                cow->map[i] = INVALID_OFFSET;
+        }
+}
+
+static void snapshot_free(struct bplus_snapshot *snap)
+{
+        free(snap->map);
+        free(snap->buf);
+        free(snap->node);
+        free(snap);
+}
+
+/* free released snapshots and the retired blocks none of the rest can see */
+static void cow_reclaim(struct bplus_tree *tree)
+{
+        struct bplus_cow *cow = tree->cow;
+        struct list_head *pos, *n;
+        int released = 0;
+        list_for_each_safe(pos, n, &cow->snapshots) {
+                struct bplus_snapshot *snap = list_entry(pos, struct bplus_snapshot, link);
+                if (__atomic_load_n(&snap->released, __ATOMIC_ACQUIRE)) {
+                        list_del(pos);
+                        snapshot_free(snap);
+                        released = 1;
+                }
+        }
+        if (!released) {
+                return;
+        }
+
+        cow->pinned = 0;
+        list_for_each(pos, &cow->snapshots) {
+                struct bplus_snapshot *snap = list_entry(pos, struct bplus_snapshot, link);
+                if (snap->gen > cow->pinned) {
+                        cow->pinned = snap->gen;
+                }
+        }
+
+        long i, kept = 0;
+        for (i = 0; i < cow->nr_retired; i++) {
+                struct cow_retired *r = &cow->retired[i];
+                int visible = 0;
+                list_for_each(pos, &cow->snapshots) {
+                        struct bplus_snapshot *snap = list_entry(pos, struct bplus_snapshot, link);
+                        if (r->born <= snap->gen && snap->gen < r->died) {
+                                visible = 1;
+                                break;
+                        }
+                }
+                if (visible) {
+                        cow->retired[kept++] = *r;
+                } else {
+                        cow_block_free(cow, r->offset);
+                }
+        }
+        cow->nr_retired = kept;
+}
+
+/* read a block through the block cache */
+static void block_read(struct bplus_tree *tree, char *buf, off_t offset)
+{
+        struct bplus_block_cache *bc = tree->bcache;
+        if (tree->cow != NULL) {
+                offset = cow_read_offset(tree, offset);
+        }
+        tree->stats.node_reads++;
+        if (bc != NULL) {
+                int i = bcache_lookup(bc, offset);
+                if (i >= 0) {
+                        bc->ref[i] = 1;
+                        memcpy(buf, bc->blocks + (size_t) i * _block_size, _block_size);
+                        tree->stats.cache_hits++;
+                        return;
+                }
+        }
+
+        int len = pread(tree->fd, buf, _block_size, offset);
+        assert(len == _block_size);
+        tree->stats.cache_misses++;
+        tree->stats.bytes_read += len;
+
+        if (bc != NULL) {
+                int i = bcache_insert(bc, offset);
+                memcpy(bc->blocks + (size_t) i * _block_size, buf, _block_size);
+        }
+}
+
+/* write a block, the cache is write-through so the file is always current */
+static void block_write(struct bplus_tree *tree, const char *buf, off_t offset)
+{
+        if (tree->cow != NULL) {
+                offset = cow_write_offset(tree, offset);
+        }
+        int len = pwrite(tree->fd, buf, _block_size, offset);
+        assert(len == _block_size);
+        tree->stats.node_writes++;
+        tree->stats.bytes_written += len;
+
+        struct bplus_block_cache *bc = tree->bcache;
+        if (bc != NULL) {
+                int i = bcache_lookup(bc, offset);
+                if (i < 0) {
+                        i = bcache_insert(bc, offset);
+                }
+                memcpy(bc->blocks + (size_t) i * _block_size, buf, _block_size);
+        }
+}
+
+/* the block buffer behind the node caches, packed nodes pass through it */
+static inline char *pack_buf(struct bplus_tree *tree)
+{
+        return tree->caches + _node_size * MIN_CACHE_NUM;
+}
+
+static inline uint32_t offset_pack(off_t offset)
+{
+        return offset == INVALID_OFFSET ? PACKED_INVALID : (uint32_t) (offset / _block_size);
+}
+
+static inline off_t offset_unpack(uint32_t block)
+{
+        return block == PACKED_INVALID ? (off_t) INVALID_OFFSET : (off_t) block * _block_size;
+}
+
+/* narrowest byte width holding every delta up to range */
+static inline int delta_width(uint64_t range)
+{
+        return range <= 0xff ? 1 : range <= 0xffff ? 2 : range <= 0xffffffff ? 4 : 8;
+}
+
+static inline uint64_t delta_get(const char *arr, int width, int i)
+{
+        uint8_t v8;
+        uint16_t v16;
+        uint32_t v32;
+        uint64_t v64;
+        switch (width) {
+        case 1:
+                memcpy(&v8, arr + i, 1);
+                return v8;
+        case 2:
+                memcpy(&v16, arr + 2 * i, 2);
+                return v16;
+        case 4:
+                memcpy(&v32, arr + 4 * i, 4);
+                return v32;
+        default:
+                memcpy(&v64, arr + 8 * i, 8);
+                return v64;
+        }
+}
+
+static inline void delta_set(char *arr, int width, int i, uint64_t v)
+{
+        uint8_t v8 = v;
+        uint16_t v16 = v;
+        uint32_t v32 = v;
+        switch (width) {
+        case 1:
+                memcpy(arr + i, &v8, 1);
+                break;
+        case 2:
+                memcpy(arr + 2 * i, &v16, 2);
+                break;
+        case 4:
+                memcpy(arr + 4 * i, &v32, 4);
+                break;
+        default:
+                memcpy(arr + 8 * i, &v, 8);
+                break;
+        }
+}
+
+static inline struct pack_range pack_range_init(void)
+{
+        struct pack_range r;
+        r.n = 0;
+        r.key_min = INT_MAX;
+        r.key_max = INT_MIN;
+        r.data_min = LONG_MAX;
+        r.data_max = LONG_MIN;
+        return r;
+}
+
+static inline struct pack_range pack_range_put(struct pack_range r, bptree_key_t key, bptree_val_t data)
+{
+        r.n++;
+        r.key_min = key < r.key_min ? key : r.key_min;
+        r.key_max = key > r.key_max ? key : r.key_max;
+        r.data_min = data < r.data_min ? data : r.data_min;
+        r.data_max = data > r.data_max ? data : r.data_max;
+        return r;
+}
+
+/* add entries [from, to) of leaf, the range is passed by value */
+static struct pack_range pack_range_add(struct pack_range r, struct bplus_node *leaf, int from, int to)
+{
+        int i;
+        for (i = from; i < to; i++) {
+                r = pack_range_put(r, key(leaf)[i], data(leaf)[i]);
+        }
+        return r;
+}
+
+/* whether the entries of r can be packed into one block */
+static int pack_range_fits(struct pack_range *r)
+{
+        if (r->n == 0) {
+                return 1;
+        }
+        int kw = delta_width((uint32_t) r->key_max - (uint32_t) r->key_min);
+        int dw = delta_width((uint64_t) r->data_max - (uint64_t) r->data_min);
+        return sizeof(struct bplus_packed_leaf) + (size_t) r->n * (kw + dw) <= (size_t) _block_size;
+}
+
+/* whether leaf still packs into a block with (key, data) added */
+static int leaf_fits(struct bplus_tree *tree, struct bplus_node *leaf, bptree_key_t key, bptree_val_t data)
+{
+        if (!(tree->flags & BPLUS_TREE_COMPRESS)) {
+                return 1;
+        }
+        /* full width deltas fit, no need to scan */
+        if (sizeof(struct bplus_packed_leaf) + (size_t) (leaf->children + 1) * 12 <= (size_t) _block_size) {
+                return 1;
+        }
+        struct pack_range r = pack_range_add(pack_range_init(), leaf, 0, leaf->children);
+        r = pack_range_put(r, key, data);
+        return pack_range_fits(&r);
+}
+
+/* whether leaf without entry skip (-1 for none) packs into a block with sib */
+static int leaf_merge_fits(struct bplus_tree *tree, struct bplus_node *leaf,
+                           struct bplus_node *sib, int skip)
+{
+        if (!(tree->flags & BPLUS_TREE_COMPRESS)) {
+                return 1;
+        }
+        struct pack_range r = pack_range_add(pack_range_init(), sib, 0, sib->children);
+        if (skip < 0) {
+                r = pack_range_add(r, leaf, 0, leaf->children);
+        } else {
+                r = pack_range_add(r, leaf, 0, skip);
+                r = pack_range_add(r, leaf, skip + 1, leaf->children);
+        }
+        return pack_range_fits(&r);
+}
+
+/* encode node into the block buf */
+static void node_pack(struct bplus_node *node, char *buf)
+{
+        int i;
+        struct bplus_packed *p = (struct bplus_packed *) buf;
+        p->self = offset_pack(node->self);
+        p->parent = offset_pack(node->parent);
+        p->prev = offset_pack(node->prev);
+        p->next = offset_pack(node->next);
+        p->type = node->type;
+        p->children = node->children;
+
+        if (is_leaf(node)) {
+                struct bplus_packed_leaf *l = (struct bplus_packed_leaf *) buf;
+                struct pack_range r = pack_range_add(pack_range_init(), node, 0, node->children);
+                assert(pack_range_fits(&r));
+
+                l->key_base = r.n > 0 ? key(node)[0] : 0;
+                l->data_base = r.n > 0 ? r.data_min : 0;
+                l->key_width = delta_width((uint32_t) r.key_max - (uint32_t) r.key_min);
+                l->data_width = delta_width((uint64_t) r.data_max - (uint64_t) r.data_min);
+
+                char *keys = buf + sizeof(*l);
+                char *datas = keys + node->children * l->key_width;
+                for (i = 0; i < node->children; i++) {
+                        delta_set(keys, l->key_width, i, (uint32_t) key(node)[i] - (uint32_t) l->key_base);
+                        delta_set(datas, l->data_width, i, (uint64_t) data(node)[i] - (uint64_t) l->data_base);
+                }
+        } else {
+                char *keys = buf + sizeof(*p);
+                uint32_t *subs = (uint32_t *) (keys + (node->children - 1) * sizeof(bptree_key_t));
+                memcpy(keys, key(node), (node->children - 1) * sizeof(bptree_key_t));
+                for (i = 0; i < node->children; i++) {
+                        subs[i] = offset_pack(sub(node)[i]);
+                }
+        }
+}
+
+/* decode the block buf into node */
+static void node_unpack(const char *buf, struct bplus_node *node)
+{
+        int i;
+        const struct bplus_packed *p = (const struct bplus_packed *) buf;
+        node->self = offset_unpack(p->self);
+        node->parent = offset_unpack(p->parent);
+        node->prev = offset_unpack(p->prev);
+        node->next = offset_unpack(p->next);
+        node->type = p->type;
+        node->children = p->children;
+
+        if (is_leaf(node)) {
+                const struct bplus_packed_leaf *l = (const struct bplus_packed_leaf *) buf;
+                const char *keys = buf + sizeof(*l);
+                const char *datas = keys + node->children * l->key_width;
+                for (i = 0; i < node->children; i++) {
+                        key(node)[i] = (bptree_key_t) ((uint32_t) l->key_base + delta_get(keys, l->key_width, i));
+                        data(node)[i] = (bptree_val_t) ((uint64_t) l->data_base + delta_get(datas, l->data_width, i));
+                }
+        } else {
+                const char *keys = buf + sizeof(*p);
+                const uint32_t *subs = (const uint32_t *) (keys + (node->children - 1) * sizeof(bptree_key_t));
+                memcpy(key(node), keys, (node->children - 1) * sizeof(bptree_key_t));
+                for (i = 0; i < node->children; i++) {
+                        sub(node)[i] = offset_unpack(subs[i]);
+                }
+        }
+}
+
+/* key_binary_search on a packed block, without decoding it */
+static int packed_key_search(const char *buf, bptree_key_t target)
+{
+        const struct bplus_packed *p = (const struct bplus_packed *) buf;
+        int len = p->type == BPLUS_TREE_LEAF ? p->children : p->children - 1;
+        int low = -1;
+        int high = len;
+
+        if (p->type != BPLUS_TREE_LEAF) {
+                const char *keys = buf + sizeof(*p);
+                while (low + 1 < high) {
+                        int mid = low + (high - low) / 2;
+                        bptree_key_t k;
+                        memcpy(&k, keys + mid * sizeof(k), sizeof(k));
+                        if (target > k) {
+                                low = mid;
+                        } else {
+                                high = mid;
+                        }
+                }
+                bptree_key_t k;
+                if (high < len) {
+                        memcpy(&k, keys + high * sizeof(k), sizeof(k));
+                }
+                return high >= len || k != target ? -high - 1 : high;
+        }
+
+        /* deltas are unsigned and sorted, keys below the base sort first */
+        const struct bplus_packed_leaf *l = (const struct bplus_packed_leaf *) buf;
+        if (len == 0 || target < l->key_base) {
+                return -1;
+        }
+        const char *keys = buf + sizeof(*l);
+        uint64_t delta = (uint32_t) target - (uint32_t) l->key_base;
+        while (low + 1 < high) {
+                int mid = low + (high - low) / 2;
+                if (delta > delta_get(keys, l->key_width, mid)) {
+                        low = mid;
+                } else {
+                        high = mid;
+                }
+        }
+
+        if (high >= len || delta_get(keys, l->key_width, high) != delta) {
+                return -high - 1;
+        } else {
+                return high;
+        }
+}
+
+static inline int packed_is_leaf(const char *buf)
+{
+        return ((const struct bplus_packed *) buf)->type == BPLUS_TREE_LEAF;
+}
+
+static inline off_t packed_sub(const char *buf, int i)
+{
+        const struct bplus_packed *p = (const struct bplus_packed *) buf;
+        uint32_t block;
+        memcpy(&block, buf + sizeof(*p) + (p->children - 1) * sizeof(bptree_key_t) + i * sizeof(block), sizeof(block));
+        return offset_unpack(block);
+}
+
+static inline bptree_val_t packed_data(const char *buf, int i)
+{
+        const struct bplus_packed_leaf *l = (const struct bplus_packed_leaf *) buf;
+        const char *datas = buf + sizeof(*l) + l->info.children * l->key_width;
+        return (bptree_val_t) ((uint64_t) l->data_base + delta_get(datas, l->data_width, i));
+}
+
+/* read the node at offset into a cache buffer */
+static void node_read(struct bplus_tree *tree, struct bplus_node *node, off_t offset)
+{
+        if (tree->flags & BPLUS_TREE_COMPRESS) {
+                block_read(tree, pack_buf(tree), offset);
+                node_unpack(pack_buf(tree), node);
+        } else {
+                block_read(tree, (char *) node, offset);
+        }
+}
+
+static void node_write(struct bplus_tree *tree, struct bplus_node *node)
+{
+        if (tree->flags & BPLUS_TREE_COMPRESS) {
+                node_pack(node, pack_buf(tree));
+                block_write(tree, pack_buf(tree), node->self);
+        } else {
+                block_write(tree, (char *) node, node->self);
+        }
+}
+
 /* read a node with offset from disk */
 static struct bplus_node *node_fetch(struct bplus_tree *tree, off_t offset)
 {
@@ -144,8 +841,7 @@ static struct bplus_node *node_fetch(struct bplus_tree *tree, off_t offset)
         }
 
         struct bplus_node *node = cache_refer(tree);
-        int len = pread(tree->fd, node, _block_size, offset);
-        assert(len == _block_size);
+        node_read(tree, node, offset);
         return node;
 }
 
@@ -159,9 +855,8 @@ static struct bplus_node *node_seek(struct bplus_tree *tree, off_t offset)
         int i;
         for (i = 0; i < MIN_CACHE_NUM; i++) {
                 if (!tree->used[i]) {
-                        char *buf = tree->caches + _block_size * i;
-                        int len = pread(tree->fd, buf, _block_size, offset);
-                        assert(len == _block_size);
+                        char *buf = tree->caches + _node_size * i;
+                        node_read(tree, (struct bplus_node *) buf, offset);
                         return (struct bplus_node *) buf;
                 }
         }
@@ -172,8 +867,7 @@ static struct bplus_node *node_seek(struct bplus_tree *tree, off_t offset)
 static inline void node_flush(struct bplus_tree *tree, struct bplus_node *node)
 {
         if (node != NULL) {
-                int len = pwrite(tree->fd, node, _block_size, node->self);
-                assert(len == _block_size);
+                node_write(tree, node);
                 cache_defer(tree, node);
         }
 }
@@ -184,18 +878,64 @@ static off_t new_node_append(struct bplus_tree *tree, struct bplus_node *node)
 {
         /* assign new offset to the new node */
         if (list_empty(&tree->free_blocks)) {
+                /* packed nodes address blocks with 32 bits */
+                assert(!(tree->flags & BPLUS_TREE_COMPRESS) || tree->file_size / _block_size < PACKED_INVALID);
                 node->self = tree->file_size;
                 tree->file_size += _block_size;
+                tree->stats.blocks_appended++;
         } else {
                 struct free_block *block;
                 block = list_first_entry(&tree->free_blocks, struct free_block, link);
                 list_del(&block->link);
                 node->self = block->offset;
                 free(block);
+                tree->stats.blocks_reused++;
         }
         return node->self;
 }
 
+/* queue a buffered non-leaf node to be drained */
+static void buffer_push(struct bplus_tree *tree, off_t offset)
+{
+        struct bplus_buffer *b = tree->buffer;
+        b->pending = (off_t *) array_reserve(b->pending, &b->pending_cap, b->nr_pending + 1, sizeof(off_t));
+        b->pending[b->nr_pending++] = offset;
+}
+
+/* a queued node was deleted, its block may come back as another node */
+static void buffer_forget(struct bplus_tree *tree, off_t offset)
+{
+        struct bplus_buffer *b = tree->buffer;
+        long i, j;
+        for (i = j = 0; i < b->nr_pending; i++) {
+                if (b->pending[i] != offset) {
+                        b->pending[j++] = b->pending[i];
+                }
+        }
+        b->nr_pending = j;
+}
+
+/* append the block at offset to the freeblock list, the node is not read */
+static void block_free(struct bplus_tree *tree, off_t offset)
+{
+        assert(offset != INVALID_OFFSET);
+        struct free_block *block = (free_block*)malloc(sizeof(*block));
+        assert(block != NULL);
+        /* deleted blocks can be allocated for other nodes */
+        block->offset = offset;
+        list_add_tail(&block->link, &tree->free_blocks);
+        if (tree->cow != NULL) {
+                cow_unmap(tree, offset);
+        }
+        if (tree->buffer != NULL) {
+                buffer_forget(tree, offset);
+        }
+        if (offset == tree->tail) {
+                tree->tail = INVALID_OFFSET;
+        }
+        tree->stats.blocks_freed++;
+}
+
 /* delete a node from tree (file)
  *      append this free block to the freeblock list and release the cache */
 static void node_delete(struct bplus_tree *tree, struct bplus_node *node,
@@ -217,26 +957,105 @@ static void node_delete(struct bplus_tree *tree, struct bplus_node *node,
                 }
         }
 
-        assert(node->self != INVALID_OFFSET);
-        struct free_block *block = (free_block*)malloc(sizeof(*block));
-        assert(block != NULL);
-        /* deleted blocks can be allocated for other nodes */
-        block->offset = node->self;
-        list_add_tail(&block->link, &tree->free_blocks);
+        block_free(tree, node->self);
         /* return the node cache borrowed from */
         cache_defer(tree, node);
 }
 
-/* update the child with index and flush it */
-static inline void sub_node_update(struct bplus_tree *tree, struct bplus_node *parent,
-                		   int index, struct bplus_node *sub_node)
+/* keys below node, from the counts of its children */
+static long node_total(struct bplus_node *node)
 {
-        assert(sub_node->self != INVALID_OFFSET);
-        sub(parent)[index] = sub_node->self;
-        sub_node->parent = parent->self;
-        node_flush(tree, sub_node);
-}
-
+        if (is_leaf(node)) {
+                return node->children;
+        }
+        long total = 0;
+        int i;
+        for (i = 0; i < node->children; i++) {
+                total += cnt(node)[i];
+        }
+        return total;
+}
+
+/* child ptr index of parent is node, take over its count */
+static inline void count_update(struct bplus_tree *tree, struct bplus_node *parent,
+                                int index, struct bplus_node *node)
+{
+        if (tree->flags & BPLUS_TREE_COUNTED) {
+                cnt(parent)[index] = node_total(node);
+        }
+}
+
+/* move n child ptrs, and their counts along with them */
+static inline void sub_move(struct bplus_tree *tree, struct bplus_node *dst, int to,
+                            struct bplus_node *src, int from, int n)
+{
+        memmove(&sub(dst)[to], &sub(src)[from], n * sizeof(off_t));
+        if (tree->flags & BPLUS_TREE_COUNTED) {
+                memmove(&cnt(dst)[to], &cnt(src)[from], n * sizeof(long));
+        }
+}
+
+/* keys below node changed by delta, add it to the entry of every node on the
+ * path up to the root. The fields of node are read before anything is
+ * fetched, so it may be called right after node is flushed */
+static void count_add(struct bplus_tree *tree, struct bplus_node *node, long delta)
+{
+        if (!(tree->flags & BPLUS_TREE_COUNTED) || delta == 0) {
+                return;
+        }
+
+        off_t self = node->self;
+        off_t up = node->parent;
+        while (up != INVALID_OFFSET) {
+                struct bplus_node *parent = node_fetch(tree, up);
+                int i;
+                for (i = 0; i < parent->children && sub(parent)[i] != self; i++) {
+                        continue;
+                }
+                assert(i < parent->children);
+                cnt(parent)[i] += delta;
+                self = parent->self;
+                up = parent->parent;
+                node_flush(tree, parent);
+        }
+}
+
+/* The leaf of key changed in ways the entries above it did not follow: walk
+ * up its path and give every entry on it the total of its child */
+static void count_fix(struct bplus_tree *tree, bptree_key_t key)
+{
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL && !is_leaf(node)) {
+                int i = key_binary_search(node, key);
+                node = node_seek(tree, sub(node)[i >= 0 ? i + 1 : -i - 1]);
+        }
+
+        while (node != NULL && node->parent != INVALID_OFFSET) {
+                long total = node_total(node);
+                struct bplus_node *parent = node_fetch(tree, node->parent);
+                int i = key_binary_search(parent, key);
+                i = i >= 0 ? i + 1 : -i - 1;
+                if (cnt(parent)[i] != total) {
+                        cnt(parent)[i] = total;
+                        node_flush(tree, parent);
+                } else {
+                        cache_defer(tree, parent);
+                }
+                node = parent;
+        }
+}
+
+/* update the child with index and flush it */
+static inline void sub_node_update(struct bplus_tree *tree, struct bplus_node *parent,
+                		   int index, struct bplus_node *sub_node)
+{
+        assert(sub_node->self != INVALID_OFFSET);
+        sub(parent)[index] = sub_node->self;
+        count_update(tree, parent, index, sub_node);
+        sub_node->parent = parent->self;
+        node_flush(tree, sub_node);
+}
+
 /* update the child node parent ptr and flush it */
 static inline void sub_node_flush(struct bplus_tree *tree, struct bplus_node *parent, off_t sub_offset)
 {
@@ -246,9 +1065,116 @@ static inline void sub_node_flush(struct bplus_tree *tree, struct bplus_node *pa
         node_flush(tree, sub_node);
 }
 
+/* binary search the buffer of a non-leaf node like key_binary_search */
+static int msg_search(struct bplus_node *node, bptree_key_t target)
+{
+        struct bplus_msg *arr = msg(node);
+        int len = msg_nr(node);
+        int low = -1;
+        int high = len;
+
+        while (low + 1 < high) {
+                int mid = low + (high - low) / 2;
+                if (target > arr[mid].key) {
+                        low = mid;
+                } else {
+                        high = mid;
+                }
+        }
+
+        if (high >= len || arr[high].key != target) {
+                return -high - 1;
+        } else {
+                return high;
+        }
+}
+
+/* fold two messages for one key into one with the effect of both in order */
+static inline struct bplus_msg msg_compose(struct bplus_msg older, struct bplus_msg newer)
+{
+        if (newer.op != BUFFER_INSERT) {
+                return newer;
+        }
+        if (older.op == BUFFER_DELETE) {
+                newer.op = BUFFER_SET;
+                return newer;
+        }
+        /* the key exists since the older message, the newer insert is a no-op */
+        return older;
+}
+
+/* add a sorted batch of messages, newer than the ones there, to the buffer of node */
+static void msg_merge(struct bplus_tree *tree, struct bplus_node *node, const struct bplus_msg *batch, int n)
+{
+        struct bplus_msg *old = msg(node);
+        struct bplus_msg *out = tree->buffer->merge;
+        int nr = msg_nr(node);
+        int i = 0, j = 0, k = 0;
+
+        while (i < nr || j < n) {
+                if (j >= n || (i < nr && old[i].key < batch[j].key)) {
+                        out[k++] = old[i++];
+                } else if (i >= nr || batch[j].key < old[i].key) {
+                        out[k++] = batch[j++];
+                } else {
+                        out[k++] = msg_compose(old[i++], batch[j++]);
+                }
+        }
+        assert(k <= _buffer_max);
+        memcpy(old, out, k * sizeof(*out));
+        msg_nr(node) = k;
+}
+
+/* a buffered non-leaf node was split in two, the messages of keys >= split_key
+ * belong to the right one now */
+static void msg_split(struct bplus_tree *tree, struct bplus_node *left,
+                      struct bplus_node *right, bptree_key_t split_key)
+{
+        /* one of them is the new node and empty */
+        struct bplus_node *node = msg_nr(left) > 0 ? left : right;
+        struct bplus_msg *all = tree->buffer->merge;
+        int n = msg_nr(node);
+        int i = msg_search(node, split_key);
+        i = i >= 0 ? i : -i - 1;
+
+        memcpy(all, msg(node), n * sizeof(*all));
+        memcpy(msg(left), all, i * sizeof(*all));
+        msg_nr(left) = i;
+        memcpy(msg(right), all + i, (n - i) * sizeof(*all));
+        msg_nr(right) = n - i;
+
+        /* the halves drain after the node that caused the split */
+        if (msg_nr(left) > _buffer_flush) {
+                buffer_push(tree, left->self);
+        }
+        if (msg_nr(right) > _buffer_flush) {
+                buffer_push(tree, right->self);
+        }
+}
+
+/* search the packed blocks directly, no node is decoded on the way down */
+static bptree_val_t packed_tree_search(struct bplus_tree *tree, bptree_key_t key)
+{
+        char *buf = pack_buf(tree);
+        off_t offset = tree->root;
+        while (offset != INVALID_OFFSET) {
+                block_read(tree, buf, offset);
+                int i = packed_key_search(buf, key);
+                if (packed_is_leaf(buf)) {
+                        return i >= 0 ? packed_data(buf, i) : -1;
+                }
+                offset = packed_sub(buf, i >= 0 ? i + 1 : -i - 1);
+        }
+        return -1;
+}
+
 /* seach the value for key in tree */
 static bptree_val_t bplus_tree_search(struct bplus_tree *tree, bptree_key_t key)
 {
+        if (tree->flags & BPLUS_TREE_COMPRESS) {
+                return packed_tree_search(tree, key);
+        }
+
         bptree_val_t ret = -1;
         struct bplus_node *node = node_seek(tree, tree->root);
         while (node != NULL) {
@@ -271,6 +1197,101 @@ static bptree_val_t bplus_tree_search(struct bplus_tree *tree, bptree_key_t key)
         return ret;
 }
 
+enum {
+        FINGER_LO = 1,
+        FINGER_HI = 2,
+};
+
+/* a node on the path of the last get and the keys routed to it, [lo, hi) with
+ * FINGER_LO/FINGER_HI telling which ends are bounded */
+struct finger_level {
+        off_t offset;
+        bptree_key_t lo;
+        bptree_key_t hi;
+        int bounds;
+};
+
+/* path of the last get, good while no write changed the tree */
+struct bplus_finger {
+        struct finger_level *level;
+        int depth;
+        long cap;
+        unsigned long epoch;
+};
+
+/* bplus_tree_search starting at the deepest node of the last path whose keys
+ * take in key, a get next to the last one reads the leaf alone */
+static bptree_val_t finger_search(struct bplus_tree *tree, bptree_key_t key)
+{
+        struct bplus_finger *f = tree->finger;
+        int d = 0;
+        if (f->depth > 0 && f->epoch == tree->epoch) {
+                for (d = f->depth - 1; d > 0; d--) {
+                        struct finger_level *l = &f->level[d];
+                        if ((!(l->bounds & FINGER_LO) || key >= l->lo) &&
+                            (!(l->bounds & FINGER_HI) || key < l->hi)) {
+                                break;
+                        }
+                }
+        }
+        f->epoch = tree->epoch;
+
+        struct finger_level l;
+        if (d > 0) {
+                tree->stats.finger_hits++;
+                l = f->level[d];
+        } else {
+                l.offset = tree->root;
+                l.lo = l.hi = 0;
+                l.bounds = 0;
+        }
+        for (; ; d++) {
+                struct bplus_node *node = node_seek(tree, l.offset);
+                if (node == NULL) {
+                        f->depth = 0;
+                        return -1;
+                }
+                f->level = (struct finger_level *) array_reserve(f->level, &f->cap, d + 1, sizeof(l));
+                f->level[d] = l;
+                int i = key_binary_search(node, key);
+                if (is_leaf(node)) {
+                        f->depth = d + 1;
+                        return i >= 0 ? data(node)[i] : -1;
+                }
+                i = i >= 0 ? i + 1 : -i - 1;
+                if (i > 0) {
+                        l.lo = key(node)[i - 1];
+                        l.bounds |= FINGER_LO;
+                }
+                if (i < node->children - 1) {
+                        l.hi = key(node)[i];
+                        l.bounds |= FINGER_HI;
+                }
+                l.offset = sub(node)[i];
+        }
+}
+
+/* remember the path of each get, see finger_search */
+int bplus_tree_finger_enable(struct bplus_tree *tree)
+{
+        if (tree->finger == NULL) {
+                tree->finger = (struct bplus_finger *) calloc(1, sizeof(*tree->finger));
+                assert(tree->finger != NULL);
+                /* no path yet, never taken for the current tree */
+                tree->finger->epoch = ~0UL;
+        }
+        return 0;
+}
+
+void bplus_tree_finger_disable(struct bplus_tree *tree)
+{
+        if (tree->finger != NULL) {
+                free(tree->finger->level);
+                free(tree->finger);
+                tree->finger = NULL;
+        }
+}
+
 /* add a bplus_node left before node */
 static void left_node_add(struct bplus_tree *tree, struct bplus_node *node, struct bplus_node *left)
 {
@@ -305,6 +1326,17 @@ static void right_node_add(struct bplus_tree *tree, struct bplus_node *node, str
         node->next = right->self;
 }
 
+/* entries of total the left node keeps when an append splits the rightmost
+ * node, no fewer than a middle split and at least min for the right one */
+static inline int append_split(int total, int min)
+{
+        int split = total * BPLUS_APPEND_FILL / 100;
+        if (split > total - min) {
+                split = total - min;
+        }
+        return split > total / 2 ? split : total / 2;
+}
+
 static bptree_key_t non_leaf_insert(struct bplus_tree *tree, struct bplus_node *node,
                              struct bplus_node *l_ch, struct bplus_node *r_ch, bptree_key_t key);
 
@@ -319,6 +1351,8 @@ static int parent_node_build(struct bplus_tree *tree, struct bplus_node *l_ch,
                 key(parent)[0] = key;
                 sub(parent)[0] = l_ch->self;
                 sub(parent)[1] = r_ch->self;
+                count_update(tree, parent, 0, l_ch);
+                count_update(tree, parent, 1, r_ch);
                 parent->children = 2;
                 /* write new parent and update root */
                 tree->root = new_node_append(tree, parent);
@@ -360,11 +1394,11 @@ static bptree_key_t non_leaf_split_left(struct bplus_tree *tree, struct bplus_no
         /* sum = left->children = pivot + (split - pivot - 1) + 1 */
         /* replicate from key[0] to key[insert] in original node */
         memmove(&key(left)[0], &key(node)[0], pivot * sizeof(bptree_key_t));
-        memmove(&sub(left)[0], &sub(node)[0], pivot * sizeof(off_t));
+        sub_move(tree, left, 0, node, 0, pivot);
 
         /* replicate from key[insert] to key[split - 1] in original node */
         memmove(&key(left)[pivot + 1], &key(node)[pivot], (split - pivot - 1) * sizeof(bptree_key_t));
-        memmove(&sub(left)[pivot + 1], &sub(node)[pivot], (split - pivot - 1) * sizeof(off_t));
+        sub_move(tree, left, pivot + 1, node, pivot, split - pivot - 1);
 
         /* flush sub-nodes of the new splitted left node */
         for (i = 0; i < left->children; i++) {
@@ -385,14 +1419,14 @@ static bptree_key_t non_leaf_split_left(struct bplus_tree *tree, struct bplus_no
                 /* both new children in split left node */
                 sub_node_update(tree, left, pivot, l_ch);
                 sub_node_update(tree, left, pivot + 1, r_ch);
-                sub(node)[0] = sub(node)[split - 1];
+                sub_move(tree, node, 0, node, split - 1, 1);
                 //split_key = key(node)[split - 2];
         }
 
         /* sum = node->children = 1 + (node->children - 1) */
         /* right node left shift from key[split - 1] to key[children - 2] */
         memmove(&key(node)[0], &key(node)[split - 1], (node->children - 1) * sizeof(bptree_key_t));
-        memmove(&sub(node)[1], &sub(node)[split], (node->children - 1) * sizeof(off_t));
+        sub_move(tree, node, 1, node, split, node->children - 1);
 
         return key(left)[split - 1];
 }
@@ -428,7 +1462,7 @@ static bptree_key_t non_leaf_split_right1(struct bplus_tree *tree, struct bplus_
         /* sum = right->children = 2 + (right->children - 2) */
         /* replicate from key[split] to key[_max_order - 2] */
         memmove(&key(right)[pivot + 1], &key(node)[split], (right->children - 2) * sizeof(bptree_key_t));
-        memmove(&sub(right)[pivot + 2], &sub(node)[split + 1], (right->children - 2) * sizeof(off_t));
+        sub_move(tree, right, pivot + 2, node, split + 1, right->children - 2);
 
         /* flush sub-nodes of the new splitted right node */
         for (i = pivot + 2; i < right->children; i++) {
@@ -443,16 +1477,12 @@ static bptree_key_t non_leaf_split_right1(struct bplus_tree *tree, struct bplus_
  *      and keeps left size #(split + 1) eles */
 static bptree_key_t non_leaf_split_right2(struct bplus_tree *tree, struct bplus_node *node,
                         	   struct bplus_node *right, struct bplus_node *l_ch,
-                        	   struct bplus_node *r_ch, bptree_key_t key, int insert)
+                        	   struct bplus_node *r_ch, bptree_key_t key, int insert, int split)
 {
         int i;
 
-        /* split = [m/2] */
-        int split = (_max_order + 1) / 2;
-
         /* split as right sibling */
         right_node_add(tree, node, right);
-        printf("maxorder = %d, split = %d\r\n",_max_order, split);
         /* split key is key[split] */
         //bptree_key_t split_key = key(node)[split];
 
@@ -464,7 +1494,7 @@ static bptree_key_t non_leaf_split_right2(struct bplus_tree *tree, struct bplus_
         /* sum = right->children = pivot + 2 + (_max_order - insert - 1) */
         /* replicate from key[split + 1] to key[insert] */
         memmove(&key(right)[0], &key(node)[split + 1], pivot * sizeof(bptree_key_t));
-        memmove(&sub(right)[0], &sub(node)[split + 1], pivot * sizeof(off_t));
+        sub_move(tree, right, 0, node, split + 1, pivot);
 
         /* insert new key and sub-node */
         key(right)[pivot] = key;
@@ -473,7 +1503,7 @@ static bptree_key_t non_leaf_split_right2(struct bplus_tree *tree, struct bplus_
 
         /* replicate from key[insert] to key[order - 1] */
         memmove(&key(right)[pivot + 1], &key(node)[insert], (_max_order - insert - 1) * sizeof(bptree_key_t));
-        memmove(&sub(right)[pivot + 2], &sub(node)[insert + 1], (_max_order - insert - 1) * sizeof(off_t));
+        sub_move(tree, right, pivot + 2, node, insert + 1, _max_order - insert - 1);
 
         /* flush sub-nodes of the new splitted right node */
         for (i = 0; i < right->children; i++) {
@@ -491,7 +1521,7 @@ static void non_leaf_simple_insert(struct bplus_tree *tree, struct bplus_node *n
                         	   bptree_key_t key, int insert)
 {
         memmove(&key(node)[insert + 1], &key(node)[insert], (node->children - 1 - insert) * sizeof(bptree_key_t));
-        memmove(&sub(node)[insert + 2], &sub(node)[insert + 1], (node->children - 1 - insert) * sizeof(off_t));
+        sub_move(tree, node, insert + 2, node, insert + 1, node->children - 1 - insert);
         /* insert new key and sub-nodes */
         key(node)[insert] = key;
         sub_node_update(tree, node, insert, l_ch);
@@ -513,13 +1543,26 @@ static int non_leaf_insert(struct bplus_tree *tree, struct bplus_node *node,
                 bptree_key_t split_key;
                 /* split = [m/2] */
                 int split = (node->children + 1) / 2;
+                if (insert == node->children - 1 && node->next == INVALID_OFFSET) {
+                        /* appending to the rightmost node, the right one takes
+                         * two children and the rest stays */
+                        split = append_split(_max_order + 1, 2) - 1;
+                }
                 struct bplus_node *sibling = non_leaf_new(tree);
+                tree->stats.non_leaf_splits++;
                 if (insert < split) {
                         split_key = non_leaf_split_left(tree, node, sibling, l_ch, r_ch, key, insert);
                 } else if (insert == split) {
                         split_key = non_leaf_split_right1(tree, node, sibling, l_ch, r_ch, key, insert);
                 } else {
-                        split_key = non_leaf_split_right2(tree, node, sibling, l_ch, r_ch, key, insert);
+                        split_key = non_leaf_split_right2(tree, node, sibling, l_ch, r_ch, key, insert, split);
+                }
+                if (tree->buffer != NULL) {
+                        if (insert < split) {
+                                msg_split(tree, sibling, node, split_key);
+                        } else {
+                                msg_split(tree, node, sibling, split_key);
+                        }
                 }
                 
                 /* build a new parent , recursive insertion */
@@ -529,14 +1572,11 @@ static int non_leaf_insert(struct bplus_tree *tree, struct bplus_node *node,
                 } else {
                         res = parent_node_build(tree, node, sibling, split_key);
                 }
-                printf("nodepar = %d\r\n",node->parent);
-                printf("split_key = %d, insert = %d, cur_key=%d, nodechild = %d"
-                        "siblingchild = %d, firstchild_of_siblings=%d, parchild=%d\r\n", 
-                        split_key, insert,key,node->children,sibling->children,key(sibling)[1],  node_seek(tree, node->parent)->children);
                 return res;
         } else {
                 non_leaf_simple_insert(tree, node, l_ch, r_ch, key, insert);
                 node_flush(tree, node);
+                count_add(tree, node, 1);
         }
         
         return 0;
@@ -554,8 +1594,8 @@ static bptree_key_t leaf_split_left(struct bplus_tree *tree, struct bplus_node *
 
         /* calculate split leaves' children (sum as (entries + 1)) */
         int pivot = insert;
-        left->children = split;                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                                
-        leaf->children = _max_entries - split + 1;
+        left->children = split;
+        leaf->children = leaf->children - split + 1;
 
         /* sum = left->children = pivot + 1 + (split - pivot - 1) */
         /* replicate from key[0] to key[insert] */
@@ -577,22 +1617,21 @@ static bptree_key_t leaf_split_left(struct bplus_tree *tree, struct bplus_node *
         return key(leaf)[0];
 }
 
-/* split a leaf into two leaf and insert (key,data) to the right  */
+/* split a leaf into two leaf and insert (key,data) to the right, the
+ * original leaf keeps #split entries */
 static bptree_key_t leaf_split_right(struct bplus_tree *tree, struct bplus_node *leaf,
-                	      struct bplus_node *right, bptree_key_t key, bptree_val_t data, int insert)
+                	      struct bplus_node *right, bptree_key_t key, bptree_val_t data, int insert, int split)
 {
-        /* split = [m/2] */
-        int split = (leaf->children + 1) / 2;
-
         /* split as right sibling */
         right_node_add(tree, leaf, right);
 
         /* calculate split leaves' children (sum as (entries + 1)) */
+        int entries = leaf->children;
         int pivot = insert - split;
         leaf->children = split;
-        right->children = _max_entries - split + 1;
+        right->children = entries - split + 1;
 
-        /* sum = right->children = pivot + 1 + (_max_entries - pivot - split) */
+        /* sum = right->children = pivot + 1 + (entries - pivot - split) */
         /* replicate from key[split] to key[children - 1] in original leaf */
         memmove(&key(right)[0], &key(leaf)[split], pivot * sizeof(bptree_key_t));
         memmove(&data(right)[0], &data(leaf)[split], pivot * sizeof(bptree_val_t));
@@ -602,8 +1641,8 @@ static bptree_key_t leaf_split_right(struct bplus_tree *tree, struct bplus_node
         data(right)[pivot] = data;
 
         /* replicate from key[insert] to key[children - 1] in original leaf */
-        memmove(&key(right)[pivot + 1], &key(leaf)[insert], (_max_entries - insert) * sizeof(bptree_key_t));
-        memmove(&data(right)[pivot + 1], &data(leaf)[insert], (_max_entries - insert) * sizeof(bptree_val_t));
+        memmove(&key(right)[pivot + 1], &key(leaf)[insert], (entries - insert) * sizeof(bptree_key_t));
+        memmove(&data(right)[pivot + 1], &data(leaf)[insert], (entries - insert) * sizeof(bptree_val_t));
 
         return key(right)[0];
 }
@@ -631,21 +1670,29 @@ static int leaf_insert(struct bplus_tree *tree, struct bplus_node *leaf, bptree_
         insert = -insert - 1;
 
         /* fetch from free node caches */
-        int i = ((char *) leaf - tree->caches) / _block_size;
+        int i = ((char *) leaf - tree->caches) / _node_size;
         tree->used[i] = 1;
 
-        /* leaf is full, split occur */
-        if (leaf->children == _max_entries) {
+        /* leaf is full (or its packed form would overflow), split occur */
+        if (leaf->children == _max_entries || !leaf_fits(tree, leaf, key, data)) {
                 bptree_key_t split_key;
                 /* split = [m/2] */
-                int split = (_max_entries + 1) / 2;
+                int split = (leaf->children + 1) / 2;
+                if (insert == leaf->children && leaf->next == INVALID_OFFSET) {
+                        /* appending to the rightmost leaf, keep it nearly full */
+                        split = append_split(leaf->children + 1, 1);
+                }
                 struct bplus_node *sibling = leaf_new(tree);
+                tree->stats.leaf_splits++;
 
                 /* sibling leaf replication due to location of insertion */
                 if (insert < split) {
                         split_key = leaf_split_left(tree, leaf, sibling, key, data, insert);
                 } else {
-                        split_key = leaf_split_right(tree, leaf, sibling, key, data, insert);
+                        split_key = leaf_split_right(tree, leaf, sibling, key, data, insert, split);
+                        if (leaf->self == tree->tail) {
+                                tree->tail = sibling->self;
+                        }
                 }
 
                 /* build new parent */
@@ -657,6 +1704,7 @@ static int leaf_insert(struct bplus_tree *tree, struct bplus_node *leaf, bptree_
         } else {
                 leaf_simple_insert(tree, leaf, key, data, insert);
                 node_flush(tree, leaf);
+                count_add(tree, leaf, 1);
         }
 
         return 0;
@@ -665,10 +1713,23 @@ static int leaf_insert(struct bplus_tree *tree, struct bplus_node *leaf, bptree_
 /* insert a key/data pair */
 static int bplus_tree_insert(struct bplus_tree *tree, bptree_key_t key, bptree_val_t data)
 {
-        struct bplus_node *node = node_seek(tree, tree->root);
+        struct bplus_node *node;
+        if (tree->tail != INVALID_OFFSET) {
+                /* a key above the largest one goes to the rightmost leaf */
+                node = node_seek(tree, tree->tail);
+                if (node->children > 0 && key > key(node)[node->children - 1]) {
+                        tree->stats.appends++;
+                        return leaf_insert(tree, node, key, data);
+                }
+        }
+
+        node = node_seek(tree, tree->root);
         /* search which leaf to insert. */
         while (node != NULL) {
                 if (is_leaf(node)) {
+                        if (node->next == INVALID_OFFSET) {
+                                tree->tail = node->self;
+                        }
                         return leaf_insert(tree, node, key, data);
                 } else {
                         int i = key_binary_search(node, key);
@@ -687,6 +1748,7 @@ static int bplus_tree_insert(struct bplus_tree *tree, bptree_key_t key, bptree_v
         data(root)[0] = data;
         root->children = 1;
         tree->root = new_node_append(tree, root);
+        tree->tail = tree->root;
         tree->level = 1;
         node_flush(tree, root);
         return 0;
@@ -713,19 +1775,23 @@ static void non_leaf_shift_from_left(struct bplus_tree *tree, struct bplus_node
                         	     struct bplus_node *left, struct bplus_node *parent,
                         	     int parent_key_index, int remove)
 {
+        tree->stats.non_leaf_shifts++;
+
         /* node's elements right shift */
         memmove(&key(node)[1], &key(node)[0], remove * sizeof(bptree_key_t));
-        memmove(&sub(node)[1], &sub(node)[0], (remove + 1) * sizeof(off_t));
+        sub_move(tree, node, 1, node, 0, remove + 1);
 
         /* parent key right rotation */
         key(node)[0] = key(parent)[parent_key_index];
         key(parent)[parent_key_index] = key(left)[left->children - 2];
 
         /* borrow the last sub-node from left sibling */
-        sub(node)[0] = sub(left)[left->children - 1];
+        sub_move(tree, node, 0, left, left->children - 1, 1);
         sub_node_flush(tree, node, sub(node)[0]);
 
         left->children--;
+        count_update(tree, parent, parent_key_index, left);
+        count_update(tree, parent, parent_key_index + 1, node);
 }
 
 /* merge two nonleaf node to the left one */
@@ -733,17 +1799,19 @@ static void non_leaf_merge_into_left(struct bplus_tree *tree, struct bplus_node
                         	     struct bplus_node *left, struct bplus_node *parent,
                         	     int parent_key_index, int remove)
 {
+        tree->stats.non_leaf_merges++;
+
         /* move parent key down */
         key(left)[left->children - 1] = key(parent)[parent_key_index];
 
         /* merge into left sibling */
         /* key sum = node->children - 2 */
         memmove(&key(left)[left->children], &key(node)[0], remove * sizeof(bptree_key_t));
-        memmove(&sub(left)[left->children], &sub(node)[0], (remove + 1) * sizeof(off_t));
+        sub_move(tree, left, left->children, node, 0, remove + 1);
 
         /* sub-node sum = node->children - 1 */
         memmove(&key(left)[left->children + remove], &key(node)[remove + 1], (node->children - remove - 2) * sizeof(bptree_key_t));
-        memmove(&sub(left)[left->children + remove + 1], &sub(node)[remove + 2], (node->children - remove - 2) * sizeof(off_t));
+        sub_move(tree, left, left->children + remove + 1, node, remove + 2, node->children - remove - 2);
 
         /* flush sub-nodes of the new merged left node */
         int i, j;
@@ -752,6 +1820,7 @@ static void non_leaf_merge_into_left(struct bplus_tree *tree, struct bplus_node
         }
 
         left->children += node->children - 1;
+        count_update(tree, parent, parent_key_index, left);
 }
 
 /* move one ele from right sibling to current node */
@@ -759,20 +1828,24 @@ static void non_leaf_shift_from_right(struct bplus_tree *tree, struct bplus_node
                         	      struct bplus_node *right, struct bplus_node *parent,
                         	      int parent_key_index)
 {
+        tree->stats.non_leaf_shifts++;
+
         /* parent key left rotation */
         key(node)[node->children - 1] = key(parent)[parent_key_index];
         key(parent)[parent_key_index] = key(right)[0];
 
         /* borrow the frist sub-node from right sibling */
-        sub(node)[node->children] = sub(right)[0];
+        sub_move(tree, node, node->children, right, 0, 1);
         sub_node_flush(tree, node, sub(node)[node->children]);
         node->children++;
 
         /* right sibling left shift*/
         memmove(&key(right)[0], &key(right)[1], (right->children - 2) * sizeof(bptree_key_t));
-        memmove(&sub(right)[0], &sub(right)[1], (right->children - 1) * sizeof(off_t));
+        sub_move(tree, right, 0, right, 1, right->children - 1);
 
         right->children--;
+        count_update(tree, parent, parent_key_index, node);
+        count_update(tree, parent, parent_key_index + 1, right);
 }
 
 /* merge two nonleaf node to the right one */
@@ -780,13 +1853,15 @@ static void non_leaf_merge_from_right(struct bplus_tree *tree, struct bplus_node
                         	      struct bplus_node *right, struct bplus_node *parent,
                         	      int parent_key_index)
 {
+        tree->stats.non_leaf_merges++;
+
         /* move parent key down */
         key(node)[node->children - 1] = key(parent)[parent_key_index];
         node->children++;
 
         /* merge from right sibling */
         memmove(&key(node)[node->children - 1], &key(right)[0], (right->children - 1) * sizeof(bptree_key_t));
-        memmove(&sub(node)[node->children - 1], &sub(right)[0], right->children * sizeof(off_t));
+        sub_move(tree, node, node->children - 1, right, 0, right->children);
 
         /* flush sub-nodes of the new merged node */
         int i, j;
@@ -795,6 +1870,7 @@ static void non_leaf_merge_from_right(struct bplus_tree *tree, struct bplus_node
         }
 
         node->children += right->children - 1;
+        count_update(tree, parent, parent_key_index, node);
 }
 
 /* simple remove, no merge or shift occur */
@@ -802,7 +1878,7 @@ static inline void non_leaf_simple_remove(struct bplus_tree *tree, struct bplus_
 {
         assert(node->children >= 2);
         memmove(&key(node)[remove], &key(node)[remove + 1], (node->children - remove - 2) * sizeof(bptree_key_t));
-        memmove(&sub(node)[remove + 1], &sub(node)[remove + 2], (node->children - remove - 2) * sizeof(off_t));
+        sub_move(tree, node, remove + 1, node, remove + 2, node->children - remove - 2);
         node->children--;
 }
 
@@ -839,6 +1915,7 @@ static void non_leaf_remove(struct bplus_tree *tree, struct bplus_node *node, in
                                 node_flush(tree, l_sib);
                                 node_flush(tree, r_sib);
                                 node_flush(tree, parent);
+                                count_add(tree, parent, -1);
                         } else {
                                 non_leaf_merge_into_left(tree, node, l_sib, parent, i, remove);
                                 /* delete empty node and flush */
@@ -857,6 +1934,7 @@ static void non_leaf_remove(struct bplus_tree *tree, struct bplus_node *node, in
                                 node_flush(tree, l_sib);
                                 node_flush(tree, r_sib);
                                 node_flush(tree, parent);
+                                count_add(tree, parent, -1);
                         } else {
                                 non_leaf_merge_from_right(tree, node, r_sib, parent, i + 1);
                                 /* delete empty right sibling and flush */
@@ -870,6 +1948,7 @@ static void non_leaf_remove(struct bplus_tree *tree, struct bplus_node *node, in
         } else {
                 non_leaf_simple_remove(tree, node, remove);
                 node_flush(tree, node);
+                count_add(tree, node, -1);
         }
 }
 
@@ -878,6 +1957,8 @@ static void leaf_shift_from_left(struct bplus_tree *tree, struct bplus_node *lea
                 		 struct bplus_node *left, struct bplus_node *parent,
                 		 int parent_key_index, int remove)
 {
+        tree->stats.leaf_shifts++;
+
         /* right shift in leaf node */
         memmove(&key(leaf)[1], &key(leaf)[0], remove * sizeof(bptree_key_t));
         memmove(&data(leaf)[1], &data(leaf)[0], remove * sizeof(off_t));
@@ -889,12 +1970,16 @@ static void leaf_shift_from_left(struct bplus_tree *tree, struct bplus_node *lea
 
         /* update parent key */
         key(parent)[parent_key_index] = key(leaf)[0];
+        count_update(tree, parent, parent_key_index, left);
+        count_update(tree, parent, parent_key_index + 1, leaf);
 }
 
 /* merge two leaf to the left */
 static void leaf_merge_into_left(struct bplus_tree *tree, struct bplus_node *leaf,
                 		 struct bplus_node *left, int parent_key_index, int remove)
 {
+        tree->stats.leaf_merges++;
+
         /* merge into left sibling, sum = leaf->children - 1*/
         memmove(&key(left)[left->children], &key(leaf)[0], remove * sizeof(bptree_key_t));
         memmove(&data(left)[left->children], &data(leaf)[0], remove * sizeof(off_t));
@@ -908,6 +1993,8 @@ static void leaf_shift_from_right(struct bplus_tree *tree, struct bplus_node *le
                                   struct bplus_node *right, struct bplus_node *parent,
                                   int parent_key_index)
 {
+        tree->stats.leaf_shifts++;
+
         /* borrow the first element from right sibling */
         key(leaf)[leaf->children] = key(right)[0];
         data(leaf)[leaf->children] = data(right)[0];
@@ -920,12 +2007,16 @@ static void leaf_shift_from_right(struct bplus_tree *tree, struct bplus_node *le
 
         /* update parent key */
         key(parent)[parent_key_index] = key(right)[0];
+        count_update(tree, parent, parent_key_index, leaf);
+        count_update(tree, parent, parent_key_index + 1, right);
 }
 
 /* merge two leaf to the right */
 static inline void leaf_merge_from_right(struct bplus_tree *tree, struct bplus_node *leaf,
                                          struct bplus_node *right)
 {
+        tree->stats.leaf_merges++;
+
         memmove(&key(leaf)[leaf->children], &key(right)[0], right->children * sizeof(bptree_key_t));
         memmove(&data(leaf)[leaf->children], &data(right)[0], right->children * sizeof(off_t));
         leaf->children += right->children;
@@ -948,7 +2039,7 @@ static void leaf_remove(struct bplus_tree *tree, struct bplus_node *leaf, int re
         assert(remove >= 0);
 
         /* fetch from free node caches */
-        int i = ((char *) leaf - tree->caches) / _block_size;
+        int i = ((char *) leaf - tree->caches) / _node_size;
         tree->used[i] = 1;
         
         if (leaf->parent == INVALID_OFFSET) {
@@ -971,15 +2062,18 @@ static void leaf_remove(struct bplus_tree *tree, struct bplus_node *leaf, int re
 
                 /* decide which sibling to be borrowed from */
                 if (sibling_select(l_sib, r_sib, parent, i) == LEFT_SIBLING) {
-                        if (l_sib->children > (_max_entries + 1) / 2) {
+                        if (l_sib->children > (_max_entries + 1) / 2 ||
+                            !leaf_merge_fits(tree, leaf, l_sib, remove)) {
                                 leaf_shift_from_left(tree, leaf, l_sib, parent, i, remove);
                                 /* flush leaves */
                                 node_flush(tree, leaf);
                                 node_flush(tree, l_sib);
                                 node_flush(tree, r_sib);
                                 node_flush(tree, parent);
+                                count_add(tree, parent, -1);
                         } else {
                                 leaf_merge_into_left(tree, leaf, l_sib, i, remove);
+                                count_update(tree, parent, i, l_sib);
                                 /* delete empty leaf and flush */
                                 node_delete(tree, leaf, l_sib, r_sib);
                                 /* trace upwards */
@@ -989,15 +2083,18 @@ static void leaf_remove(struct bplus_tree *tree, struct bplus_node *leaf, int re
                         /* remove at first in case of overflow during merging with sibling */
                         leaf_simple_remove(tree, leaf, remove);
 
-                        if (r_sib->children > (_max_entries + 1) / 2) {
+                        if (r_sib->children > (_max_entries + 1) / 2 ||
+                            !leaf_merge_fits(tree, leaf, r_sib, -1)) {
                                 leaf_shift_from_right(tree, leaf, r_sib, parent, i + 1);
                                 /* flush leaves */
                                 node_flush(tree, leaf);
                                 node_flush(tree, l_sib);
                                 node_flush(tree, r_sib);
                                 node_flush(tree, parent);
+                                count_add(tree, parent, -1);
                         } else {
                                 leaf_merge_from_right(tree, leaf, r_sib);
+                                count_update(tree, parent, i + 1, leaf);
                                 /* delete empty right sibling flush */
                                 struct bplus_node *rr_sib = node_fetch(tree, r_sib->next);
                                 node_delete(tree, r_sib, leaf, rr_sib);
@@ -1009,6 +2106,7 @@ static void leaf_remove(struct bplus_tree *tree, struct bplus_node *leaf, int re
         } else {
                 leaf_simple_remove(tree, leaf, remove);
                 node_flush(tree, leaf);
+                count_add(tree, leaf, -1);
         }
 }
 
@@ -1029,77 +2127,2255 @@ static int bplus_tree_delete(struct bplus_tree *tree, bptree_key_t key)
                                 //         node_flush(tree, cur);
                                 // }
 
-                                leaf_remove(tree, node, remove);
-                                return 0;
+                                leaf_remove(tree, node, remove);
+                                return 0;
+                        }
+                        
+                        return -1;
+                } else {
+                        int i = key_binary_search(node, key);
+                        if (i >= 0) {
+                                assert(cur == NULL && t == -1);
+                                // t = i;
+                                // cur = node;
+                                // tree->used[((char *) cur - tree->caches) / _block_size] = 1;
+                                node = node_seek(tree, sub(node)[i + 1]);
+                        } else {
+                                i = -i - 1;
+                                node = node_seek(tree, sub(node)[i]);
+                        }
+                }
+        }
+        return -1;
+}
+
+/* seek the leftmost leaf, the head of the leaf chain */
+static struct bplus_node *leaf_first_seek(struct bplus_tree *tree)
+{
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL && !is_leaf(node)) {
+                node = node_seek(tree, sub(node)[0]);
+        }
+        return node;
+}
+
+/* descend to the leaf of key without looking at the buffers, the leaf is
+ * pinned. Keys from *end on go to later leaves, *bounded is 0 for the last one */
+static struct bplus_node *leaf_locate(struct bplus_tree *tree, bptree_key_t key,
+                                      bptree_key_t *end, int *bounded)
+{
+        struct bplus_node *node = node_seek(tree, tree->root);
+        *bounded = 0;
+        while (node != NULL && !is_leaf(node)) {
+                int i = key_binary_search(node, key);
+                i = i >= 0 ? i + 1 : -i - 1;
+                if (i < node->children - 1) {
+                        *end = key(node)[i];
+                        *bounded = 1;
+                }
+                node = node_seek(tree, sub(node)[i]);
+        }
+        if (node != NULL) {
+                tree->used[((char *) node - tree->caches) / _node_size] = 1;
+        }
+        return node;
+}
+
+/* A buffered tree does not merge: messages of a non-leaf node would have to
+ * move along and may not fit. A leaf that runs empty is unlinked from its
+ * parent instead, unless it is the only child, so non-leaf nodes never lose
+ * their last child. */
+static void buffer_leaf_remove(struct bplus_tree *tree, struct bplus_node *leaf)
+{
+        if (leaf->parent == INVALID_OFFSET) {
+                tree->root = INVALID_OFFSET;
+                tree->level = 0;
+                node_delete(tree, leaf, NULL, NULL);
+                return;
+        }
+
+        struct bplus_node *parent = node_fetch(tree, leaf->parent);
+        if (parent->children == 1) {
+                cache_defer(tree, parent);
+                node_flush(tree, leaf);
+                return;
+        }
+
+        int i = 0;
+        while (sub(parent)[i] != leaf->self) {
+                i++;
+        }
+        assert(i < parent->children);
+        struct bplus_node *l_sib = node_fetch(tree, leaf->prev);
+        struct bplus_node *r_sib = node_fetch(tree, leaf->next);
+        node_delete(tree, leaf, l_sib, r_sib);
+
+        if (i == 0) {
+                /* the keys of the first child go to the second one */
+                memmove(&key(parent)[0], &key(parent)[1], (parent->children - 2) * sizeof(bptree_key_t));
+                sub_move(tree, parent, 0, parent, 1, parent->children - 1);
+                parent->children--;
+        } else {
+                non_leaf_simple_remove(tree, parent, i - 1);
+        }
+        node_flush(tree, parent);
+}
+
+/* apply a sorted batch of messages to the leaf they are routed to, the leaf
+ * is written once unless it splits or runs empty on the way. Without buffers
+ * (bplus_tree_merge) a delete that would underflow the leaf goes through
+ * leaf_remove so the tree stays balanced. changed[j], when given, tells
+ * whether message j changed the tree: a delete of a missing key does not.
+ * The keys a leaf gained or lost go up to the counts once it is written */
+static void buffer_apply(struct bplus_tree *tree, struct bplus_node *leaf,
+                         const struct bplus_msg *batch, int n, char *changed)
+{
+        int j, dirty = 0, bounded = 0;
+        long delta = 0;
+        bptree_key_t end = 0;
+        for (j = 0; j < n; j++) {
+                const struct bplus_msg *m = &batch[j];
+                if (leaf != NULL && bounded && m->key >= end) {
+                        if (dirty) {
+                                node_flush(tree, leaf);
+                                count_add(tree, leaf, delta);
+                        } else {
+                                cache_defer(tree, leaf);
+                        }
+                        leaf = NULL;
+                }
+                if (leaf == NULL) {
+                        /* the leaves changed, route the rest of the batch again */
+                        leaf = leaf_locate(tree, m->key, &end, &bounded);
+                        dirty = 0;
+                        delta = 0;
+                        if (leaf == NULL) {
+                                if (m->op != BUFFER_DELETE) {
+                                        bplus_tree_insert(tree, m->key, m->data);
+                                }
+                                if (changed != NULL) {
+                                        changed[j] = m->op != BUFFER_DELETE;
+                                }
+                                tree->stats.buffer_applied++;
+                                continue;
+                        }
+                }
+
+                int i = key_binary_search(leaf, m->key);
+                tree->stats.buffer_applied++;
+                if (changed != NULL) {
+                        changed[j] = i >= 0 || m->op != BUFFER_DELETE;
+                }
+                if (i >= 0 && m->op == BUFFER_SET && (tree->flags & BPLUS_TREE_COMPRESS)) {
+                        /* the new data may widen the packed range, insert it again */
+                        leaf_simple_remove(tree, leaf, i);
+                        i = -i - 1;
+                        dirty = 1;
+                        delta--;
+                }
+                if (i >= 0) {
+                        if (m->op == BUFFER_SET) {
+                                data(leaf)[i] = m->data;
+                                dirty = 1;
+                        } else if (m->op == BUFFER_DELETE && tree->buffer == NULL &&
+                                   (leaf->parent == INVALID_OFFSET ? leaf->children == 1 :
+                                    leaf->children <= (_max_entries + 1) / 2)) {
+                                /* rebalances and writes the leaf */
+                                count_add(tree, leaf, delta);
+                                leaf_remove(tree, leaf, i);
+                                leaf = NULL;
+                        } else if (m->op == BUFFER_DELETE) {
+                                leaf_simple_remove(tree, leaf, i);
+                                delta--;
+                                if (leaf->children == 0) {
+                                        buffer_leaf_remove(tree, leaf);
+                                        leaf = NULL;
+                                } else {
+                                        dirty = 1;
+                                }
+                        }
+                } else if (m->op != BUFFER_DELETE) {
+                        if (leaf->children < _max_entries && leaf_fits(tree, leaf, m->key, m->data)) {
+                                leaf_simple_insert(tree, leaf, m->key, m->data, -i - 1);
+                                dirty = 1;
+                                delta++;
+                        } else {
+                                /* splits and writes the leaf */
+                                count_add(tree, leaf, delta);
+                                leaf_insert(tree, leaf, m->key, m->data);
+                                leaf = NULL;
+                        }
+                }
+        }
+
+        if (leaf != NULL) {
+                if (dirty) {
+                        node_flush(tree, leaf);
+                        count_add(tree, leaf, delta);
+                } else {
+                        cache_defer(tree, leaf);
+                }
+        }
+}
+
+/* send the messages of the child with the most of them one level down */
+static void buffer_flush(struct bplus_tree *tree, struct bplus_node *node)
+{
+        struct bplus_buffer *b = tree->buffer;
+        struct bplus_msg *m = msg(node);
+        int nr = msg_nr(node);
+        int c, from = 0, best = 0, best_from = 0, n = 0;
+
+        /* the messages of child c are the run below key(node)[c] */
+        for (c = 0; c < node->children && from < nr; c++) {
+                int to = from;
+                if (c == node->children - 1) {
+                        to = nr;
+                } else {
+                        while (to < nr && m[to].key < key(node)[c]) {
+                                to++;
+                        }
+                }
+                if (to - from > n) {
+                        best = c;
+                        best_from = from;
+                        n = to - from;
+                }
+                from = to;
+        }
+
+        off_t self = node->self;
+        struct bplus_node *child = node_fetch(tree, sub(node)[best]);
+        if (!is_leaf(child) && n > _buffer_max - msg_nr(child)) {
+                n = _buffer_max - msg_nr(child);
+                if (n <= 0) {
+                        /* the child is still full, drain it first */
+                        buffer_push(tree, self);
+                        buffer_push(tree, child->self);
+                        cache_defer(tree, child);
+                        cache_defer(tree, node);
+                        return;
+                }
+        }
+
+        memcpy(b->batch, m + best_from, n * sizeof(*m));
+        memmove(m + best_from, m + best_from + n, (nr - best_from - n) * sizeof(*m));
+        msg_nr(node) = nr - n;
+        node_flush(tree, node);
+        tree->stats.buffer_flushes++;
+
+        /* come back to node once the child is done */
+        buffer_push(tree, self);
+        if (is_leaf(child)) {
+                buffer_apply(tree, child, b->batch, n, NULL);
+        } else {
+                msg_merge(tree, child, b->batch, n);
+                buffer_push(tree, child->self);
+                node_flush(tree, child);
+        }
+}
+
+/* flush the queued nodes until every buffer is within _buffer_flush */
+static void buffer_drain(struct bplus_tree *tree)
+{
+        struct bplus_buffer *b = tree->buffer;
+        while (b->nr_pending > 0) {
+                off_t offset = b->pending[--b->nr_pending];
+                struct bplus_node *node = node_fetch(tree, offset);
+                assert(!is_leaf(node));
+                if (msg_nr(node) > _buffer_flush) {
+                        buffer_flush(tree, node);
+                } else if (offset == tree->root && node->children == 1 && msg_nr(node) == 0) {
+                        /* the root lost all but one child, that one takes over */
+                        struct bplus_node *root = node_fetch(tree, sub(node)[0]);
+                        root->parent = INVALID_OFFSET;
+                        tree->root = root->self;
+                        tree->level--;
+                        node_delete(tree, node, NULL, NULL);
+                        if (!is_leaf(root)) {
+                                buffer_push(tree, root->self);
+                        }
+                        node_flush(tree, root);
+                } else {
+                        cache_defer(tree, node);
+                }
+        }
+}
+
+/* add a message to the buffer of the root, full buffers are flushed down */
+static void buffer_put(struct bplus_tree *tree, bptree_key_t key, bptree_val_t data, int op)
+{
+        struct bplus_msg m;
+        m.key = key;
+        m.op = op;
+        m.data = data;
+
+        struct bplus_node *root = node_fetch(tree, tree->root);
+        if (root == NULL || is_leaf(root)) {
+                /* no buffer above the leaves yet */
+                buffer_apply(tree, root, &m, 1, NULL);
+                return;
+        }
+
+        msg_merge(tree, root, &m, 1);
+        if (msg_nr(root) > _buffer_flush || root->children == 1) {
+                buffer_push(tree, root->self);
+        }
+        node_flush(tree, root);
+        buffer_drain(tree);
+}
+
+/* search a buffered tree, the newest message for key on the way down decides
+ * unless it is an insert, which only counts if the key is missing below */
+static bptree_val_t buffer_search(struct bplus_tree *tree, bptree_key_t key)
+{
+        bptree_val_t ret = -1;
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL) {
+                int i = key_binary_search(node, key);
+                if (is_leaf(node)) {
+                        return i >= 0 ? data(node)[i] : ret;
+                }
+                int j = msg_search(node, key);
+                if (j >= 0) {
+                        struct bplus_msg *m = &msg(node)[j];
+                        if (m->op == BUFFER_DELETE) {
+                                return ret;
+                        } else if (m->op == BUFFER_SET) {
+                                return m->data;
+                        }
+                        /* of two inserts the older one wins */
+                        ret = m->data;
+                }
+                node = node_seek(tree, sub(node)[i >= 0 ? i + 1 : -i - 1]);
+        }
+        return ret;
+}
+
+/* node copy of depth in a range scan, the copies above are kept on growth */
+static struct bplus_node *buffer_path(struct bplus_tree *tree, int depth)
+{
+        struct bplus_buffer *b = tree->buffer;
+        if (depth >= b->path_levels) {
+                int levels = 2 * depth + 2;
+                void *path;
+                if (posix_memalign(&path, _block_size, (size_t) levels * _block_size) != 0) {
+                        /* the scan has nowhere to keep the nodes above the leaf */
+                        fprintf(stderr, "Out of memory for the buffered range path!\n");
+                        abort();
+                }
+                if (b->path != NULL) {
+                        memcpy(path, b->path, (size_t) b->path_levels * _block_size);
+                        free(b->path);
+                }
+                b->path = (char *) path;
+                b->path_levels = levels;
+        }
+        return (struct bplus_node *) (b->path + (size_t) depth * _block_size);
+}
+
+/* value of key in the leaf at depth given the buffers above it, 0 if it is not there */
+static int buffer_resolve(struct bplus_tree *tree, struct bplus_node *leaf, int depth,
+                          bptree_key_t key, bptree_val_t *ret)
+{
+        int d, found = 0;
+        for (d = 0; d < depth; d++) {
+                struct bplus_node *node = buffer_path(tree, d);
+                int j = msg_search(node, key);
+                if (j >= 0) {
+                        struct bplus_msg *m = &msg(node)[j];
+                        if (m->op == BUFFER_DELETE) {
+                                return found;
+                        }
+                        *ret = m->data;
+                        found = 1;
+                        if (m->op == BUFFER_SET) {
+                                return 1;
+                        }
+                }
+        }
+        int i = key_binary_search(leaf, key);
+        if (i >= 0) {
+                *ret = data(leaf)[i];
+                found = 1;
+        }
+        return found;
+}
+
+/* find the largest key of [min, max] below offset that is in the tree, it
+ * goes to last and its value to ret. Children are walked from the right so
+ * the first key found is the answer */
+static int buffer_range(struct bplus_tree *tree, off_t offset, int depth,
+                        bptree_key_t min, bptree_key_t max, bptree_key_t *last, bptree_val_t *ret)
+{
+        struct bplus_node *node = buffer_path(tree, depth);
+        node_read(tree, node, offset);
+
+        if (!is_leaf(node)) {
+                int lo = key_binary_search(node, min);
+                int hi = key_binary_search(node, max);
+                lo = lo >= 0 ? lo + 1 : -lo - 1;
+                hi = hi >= 0 ? hi + 1 : -hi - 1;
+                int i;
+                for (i = hi; i >= lo; i--) {
+                        /* the copy may have moved while the path grew */
+                        node = buffer_path(tree, depth);
+                        bptree_key_t a = i > lo ? key(node)[i - 1] : min;
+                        bptree_key_t b = i < hi ? key(node)[i] - 1 : max;
+                        if (buffer_range(tree, sub(node)[i], depth + 1, a, b, last, ret)) {
+                                return 1;
+                        }
+                }
+                return 0;
+        }
+
+        /* the candidates are the keys of the leaf and the messages routed to
+         * it, a deleted one sends the search on to the next smaller */
+        for (;;) {
+                int d, found = 0;
+                bptree_key_t key = max;
+                int i = key_binary_search(node, max);
+                i = i >= 0 ? i : -i - 2;
+                if (i >= 0 && key(node)[i] >= min) {
+                        key = key(node)[i];
+                        found = 1;
+                }
+                for (d = 0; d < depth; d++) {
+                        struct bplus_node *up = buffer_path(tree, d);
+                        int j = msg_search(up, max);
+                        j = j >= 0 ? j : -j - 2;
+                        if (j >= 0 && msg(up)[j].key >= min && (!found || msg(up)[j].key > key)) {
+                                key = msg(up)[j].key;
+                                found = 1;
+                        }
+                }
+                if (!found) {
+                        return 0;
+                }
+                if (buffer_resolve(tree, node, depth, key, ret)) {
+                        *last = key;
+                        return 1;
+                }
+                if (key == min) {
+                        return 0;
+                }
+                max = key - 1;
+        }
+}
+
+/* splitmix64 finalizer, spreads consecutive keys over the whole filter */
+static inline uint64_t bloom_hash(bptree_key_t key)
+{
+        uint64_t h = (uint64_t) key + 0x9e3779b97f4a7c15ULL;
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        return h ^ (h >> 31);
+}
+
+/* the high half of the hash picks the block, the low half the bits inside it */
+static inline uint64_t *bloom_block(struct bplus_bloom *bloom, uint64_t h)
+{
+        uint64_t i = ((h >> 32) * (uint64_t) bloom->blocks) >> 32;
+        return bloom->bits + i * BLOOM_BLOCK_WORDS;
+}
+
+static void bloom_add(struct bplus_bloom *bloom, bptree_key_t key)
+{
+        int i;
+        uint64_t h = bloom_hash(key);
+        uint64_t *block = bloom_block(bloom, h);
+        uint32_t bit = (uint32_t) h, step = (uint32_t) (h >> 23) | 1;
+
+        for (i = 0; i < bloom->hashes; i++, bit += step) {
+                block[(bit % BLOOM_BLOCK_BITS) / 64] |= 1ULL << (bit % 64);
+        }
+        bloom->keys++;
+}
+
+/* return 0 if key is surely not in the tree */
+static int bloom_may_contain(struct bplus_bloom *bloom, bptree_key_t key)
+{
+        int i;
+        uint64_t h = bloom_hash(key);
+        uint64_t *block = bloom_block(bloom, h);
+        uint32_t bit = (uint32_t) h, step = (uint32_t) (h >> 23) | 1;
+
+        for (i = 0; i < bloom->hashes; i++, bit += step) {
+                if (!(block[(bit % BLOOM_BLOCK_BITS) / 64] & (1ULL << (bit % 64)))) {
+                        return 0;
+                }
+        }
+        return 1;
+}
+
+/* replace the bit array with an empty one sized for capacity keys */
+static int bloom_reset(struct bplus_bloom *bloom, long capacity)
+{
+        if (capacity < BLOOM_MIN_CAPACITY) {
+                capacity = BLOOM_MIN_CAPACITY;
+        }
+
+        long blocks = (capacity * bloom->bits_per_key + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+        uint64_t *bits = (uint64_t *) calloc(blocks * BLOOM_BLOCK_WORDS, sizeof(uint64_t));
+        if (bits == NULL) {
+                return -1;
+        }
+
+        free(bloom->bits);
+        bloom->bits = bits;
+        bloom->blocks = blocks;
+        bloom->capacity = capacity;
+        bloom->keys = 0;
+        bloom->stale = 0;
+        return 0;
+}
+
+/* refill the filter from the leaf chain, this drops the bits of deleted keys */
+static int bloom_rebuild(struct bplus_tree *tree, long capacity)
+{
+        struct bplus_bloom *bloom = tree->bloom;
+        if (bloom_reset(bloom, capacity) != 0) {
+                return -1;
+        }
+
+        struct bplus_node *node = leaf_first_seek(tree);
+        while (node != NULL) {
+                int i;
+                for (i = 0; i < node->children; i++) {
+                        bloom_add(bloom, key(node)[i]);
+                }
+                node = node_seek(tree, node->next);
+        }
+
+        if (tree->buffer != NULL) {
+                /* and the inserts still buffered, level by level */
+                off_t first = tree->root;
+                node = node_seek(tree, first);
+                while (node != NULL && !is_leaf(node)) {
+                        first = sub(node)[0];
+                        while (node != NULL) {
+                                int i;
+                                for (i = 0; i < msg_nr(node); i++) {
+                                        if (msg(node)[i].op != BUFFER_DELETE) {
+                                                bloom_add(bloom, msg(node)[i].key);
+                                        }
+                                }
+                                node = node_seek(tree, node->next);
+                        }
+                        node = node_seek(tree, first);
+                }
+        }
+        return 0;
+}
+
+/* Rebuild lazily: deletes cannot clear bits and inserts beyond capacity raise
+ * the false positive rate, so the filter is refreshed on the next lookup once
+ * either has drifted too far. */
+static inline void bloom_refresh(struct bplus_tree *tree)
+{
+        struct bplus_bloom *bloom = tree->bloom;
+        if (bloom->keys > bloom->capacity || bloom->stale > bloom->capacity / 4) {
+                if (bloom_rebuild(tree, 2 * (bloom->keys - bloom->stale)) != 0) {
+                        /* keep the filter usable, no bit was lost */
+                        bloom->capacity = bloom->keys;
+                }
+        }
+}
+
+/* start of a timed call in ns, 0 while latency is not recorded */
+static inline long stats_clock(struct bplus_tree *tree)
+{
+        if (!tree->timing) {
+                return 0;
+        }
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+/* log-linear bucket of a latency, values below 2 * SUB_BUCKETS are exact */
+static inline int stats_bucket(long ns)
+{
+        if (ns < BPLUS_STAT_SUB_BUCKETS) {
+                return ns < 0 ? 0 : ns;
+        }
+        int e = 63 - __builtin_clzl(ns);
+        int b = (e - 2) * BPLUS_STAT_SUB_BUCKETS + (ns >> (e - 3)) - BPLUS_STAT_SUB_BUCKETS;
+        return b < BPLUS_STAT_BUCKETS ? b : BPLUS_STAT_BUCKETS - 1;
+}
+
+/* largest latency falling into bucket b */
+static inline long stats_bucket_max(int b)
+{
+        if (b < BPLUS_STAT_SUB_BUCKETS) {
+                return b;
+        }
+        int e = b / BPLUS_STAT_SUB_BUCKETS + 2;
+        long sub = b % BPLUS_STAT_SUB_BUCKETS;
+        return ((BPLUS_STAT_SUB_BUCKETS + sub + 1) << (e - 3)) - 1;
+}
+
+static inline void stats_op(struct bplus_tree *tree, int op, long begin)
+{
+        tree->stats.ops[op]++;
+        if (begin != 0) {
+                tree->stats.latency[op][stats_bucket(stats_clock(tree) - begin)]++;
+        }
+}
+
+bptree_val_t bplus_tree_get(struct bplus_tree *tree, bptree_key_t key)
+{
+        long begin = stats_clock(tree);
+        bptree_val_t ret;
+        if (tree->bloom != NULL) {
+                bloom_refresh(tree);
+        }
+        if (tree->bloom != NULL && !bloom_may_contain(tree->bloom, key)) {
+                tree->stats.bloom_negatives++;
+                ret = -1;
+        } else if (tree->buffer != NULL) {
+                ret = buffer_search(tree, key);
+        } else if (tree->finger != NULL) {
+                ret = finger_search(tree, key);
+        } else {
+                ret = bplus_tree_search(tree, key);
+        }
+        stats_op(tree, BPLUS_STAT_GET, begin);
+        return ret;
+}
+
+/* bookkeeping after a put changed the tree */
+static inline void put_done(struct bplus_tree *tree, bptree_key_t key, bptree_val_t data)
+{
+        tree->epoch++;
+        if (tree->cow != NULL && !list_empty(&tree->cow->snapshots)) {
+                cow_reclaim(tree);
+        }
+        if (tree->bloom != NULL) {
+                if (data) {
+                        bloom_add(tree->bloom, key);
+                } else {
+                        tree->bloom->stale++;
+                }
+        }
+}
+
+int bplus_tree_put(struct bplus_tree *tree, bptree_key_t key, bptree_val_t data)
+{
+        long begin = stats_clock(tree);
+        int ret;
+        if (tree->buffer != NULL) {
+                buffer_put(tree, key, data, data ? BUFFER_INSERT : BUFFER_DELETE);
+                ret = 0;
+        } else if (data) {
+                ret = bplus_tree_insert(tree, key, data);
+        } else {
+                ret = bplus_tree_delete(tree, key);
+        }
+        if (ret == 0) {
+                put_done(tree, key, data);
+        }
+        stats_op(tree, data ? BPLUS_STAT_INSERT : BPLUS_STAT_DELETE, begin);
+        return ret;
+}
+
+/* Merge n puts sorted by key into the tree, a key takes the new data and 0
+ * deletes it. Consecutive keys of a leaf are applied in memory and the leaf is
+ * written once, so a sorted run costs one write per leaf rather than per key. */
+int bplus_tree_merge(struct bplus_tree *tree, const bptree_key_t *keys, const bptree_val_t *data, int n)
+{
+        struct bplus_msg batch[BPLUS_MERGE_BATCH];
+        char changed[BPLUS_MERGE_BATCH];
+        long begin = stats_clock(tree);
+        int i, j, k;
+
+        for (i = 1; i < n; i++) {
+                if (keys[i - 1] >= keys[i]) {
+                        fprintf(stderr, "Keys to merge must be sorted and unique!\n");
+                        return -1;
+                }
+        }
+
+        for (i = 0; i < n; i += j) {
+                for (j = 0; j < BPLUS_MERGE_BATCH && i + j < n; j++) {
+                        batch[j].key = keys[i + j];
+                        batch[j].op = data[i + j] ? BUFFER_SET : BUFFER_DELETE;
+                        batch[j].data = data[i + j];
+                }
+                if (tree->buffer != NULL) {
+                        /* buffered like bplus_tree_put, counted as changed */
+                        for (k = 0; k < j; k++) {
+                                buffer_put(tree, batch[k].key, batch[k].data, batch[k].op);
+                                changed[k] = 1;
+                        }
+                } else {
+                        buffer_apply(tree, NULL, batch, j, changed);
+                }
+                for (k = 0; k < j; k++) {
+                        if (changed[k]) {
+                                put_done(tree, batch[k].key, batch[k].data);
+                        }
+                }
+        }
+
+        for (i = 0; i < n; i++) {
+                stats_op(tree, data[i] ? BPLUS_STAT_INSERT : BPLUS_STAT_DELETE, begin);
+        }
+        return 0;
+}
+
+/* remove the entries of leaf in [min, max], returns how many */
+static int leaf_trim(struct bplus_node *leaf, bptree_key_t min, bptree_key_t max)
+{
+        int from = key_binary_search(leaf, min);
+        int to = key_binary_search(leaf, max);
+        from = from >= 0 ? from : -from - 1;
+        to = to >= 0 ? to + 1 : -to - 1;
+        if (from >= to) {
+                return 0;
+        }
+        memmove(&key(leaf)[from], &key(leaf)[to], (leaf->children - to) * sizeof(bptree_key_t));
+        memmove(&data(leaf)[from], &data(leaf)[to], (leaf->children - to) * sizeof(bptree_val_t));
+        leaf->children -= to - from;
+        return to - from;
+}
+
+/* drop the buffered messages of keys in [min, max] */
+static void msg_trim(struct bplus_node *node, bptree_key_t min, bptree_key_t max)
+{
+        int from = msg_search(node, min);
+        int to = msg_search(node, max);
+        from = from >= 0 ? from : -from - 1;
+        to = to >= 0 ? to + 1 : -to - 1;
+        if (from < to) {
+                memmove(&msg(node)[from], &msg(node)[to], (msg_nr(node) - to) * sizeof(struct bplus_msg));
+                msg_nr(node) -= to - from;
+        }
+}
+
+/* free the subtree at offset, height 0 is a leaf. Leaves go to the free list
+ * without being read, only the non-leaf nodes above them are */
+static void subtree_free(struct bplus_tree *tree, off_t offset, int height)
+{
+        if (height > 0) {
+                struct bplus_node *node = node_seek(tree, offset);
+                int i, n = node->children;
+                off_t *subs = (off_t *) malloc(n * sizeof(off_t));
+                assert(subs != NULL);
+                memcpy(subs, sub(node), n * sizeof(off_t));
+                for (i = 0; i < n; i++) {
+                        subtree_free(tree, subs[i], height - 1);
+                }
+                free(subs);
+        }
+        block_free(tree, offset);
+}
+
+/* Free the subtrees of child ptrs [from, to) of node, height is theirs, and
+ * take the ptrs out with the key left of each. Dropping the first ptr takes
+ * the key right of the last one instead. Returns the keys freed for a
+ * BPLUS_TREE_COUNTED tree */
+static long range_drop(struct bplus_tree *tree, struct bplus_node *node, int from, int to, int height)
+{
+        long dropped = 0;
+        int i;
+        if (from >= to) {
+                return 0;
+        }
+        for (i = from; i < to; i++) {
+                if (tree->flags & BPLUS_TREE_COUNTED) {
+                        dropped += cnt(node)[i];
+                }
+                subtree_free(tree, sub(node)[i], height);
+        }
+
+        int k = from > 0 ? from - 1 : 0;
+        memmove(&key(node)[k], &key(node)[k + to - from], (node->children - 1 - k - (to - from)) * sizeof(bptree_key_t));
+        sub_move(tree, node, from, node, to, node->children - to);
+        node->children -= to - from;
+        return dropped;
+}
+
+/* Rebalance two neighbours of one level, sep is the key between them kept in
+ * a common ancestor. If either is under half full and both fit in one node
+ * right is merged into left and freed, 1 is returned and its parent has to
+ * drop it. Otherwise entries move over until both hold about half and sep
+ * follows them. Both nodes are written, total gets the keys below each for
+ * the counts of their parents. A non-leaf right may come with no child left */
+static int range_rebalance(struct bplus_tree *tree, struct bplus_node *left,
+                           struct bplus_node *right, bptree_key_t *sep, long *total)
+{
+        int i, leaf = is_leaf(left);
+        int half = ((leaf ? _max_entries : _max_order) + 1) / 2;
+        int n = left->children + right->children;
+
+        if (left->children >= half && right->children >= half) {
+                /* both fine */
+        } else if (leaf && n <= _max_entries && leaf_merge_fits(tree, right, left, -1)) {
+                leaf_merge_from_right(tree, left, right);
+                total[0] = left->children;
+                total[1] = 0;
+                node_delete(tree, right, left, node_fetch(tree, right->next));
+                return 1;
+        } else if (!leaf && n <= _max_order) {
+                tree->stats.non_leaf_merges++;
+                if (right->children > 0) {
+                        /* the key between them comes down */
+                        key(left)[left->children - 1] = *sep;
+                        memmove(&key(left)[left->children], &key(right)[0], (right->children - 1) * sizeof(bptree_key_t));
+                        sub_move(tree, left, left->children, right, 0, right->children);
+                        for (i = left->children; i < n; i++) {
+                                sub_node_flush(tree, left, sub(left)[i]);
+                        }
+                        left->children = n;
+                }
+                total[0] = tree->flags & BPLUS_TREE_COUNTED ? node_total(left) : 0;
+                total[1] = 0;
+                node_delete(tree, right, left, node_fetch(tree, right->next));
+                return 1;
+        } else if (leaf) {
+                tree->stats.leaf_shifts++;
+                /* one entry at a time, a packed leaf may take fewer */
+                int k = 0;
+                while (left->children < n / 2 && leaf_fits(tree, left, key(right)[k], data(right)[k])) {
+                        key(left)[left->children] = key(right)[k];
+                        data(left)[left->children] = data(right)[k];
+                        left->children++;
+                        k++;
+                }
+                memmove(&key(right)[0], &key(right)[k], (right->children - k) * sizeof(bptree_key_t));
+                memmove(&data(right)[0], &data(right)[k], (right->children - k) * sizeof(bptree_val_t));
+                right->children -= k;
+                while (right->children < n / 2 &&
+                       leaf_fits(tree, right, key(left)[left->children - 1], data(left)[left->children - 1])) {
+                        memmove(&key(right)[1], &key(right)[0], right->children * sizeof(bptree_key_t));
+                        memmove(&data(right)[1], &data(right)[0], right->children * sizeof(bptree_val_t));
+                        key(right)[0] = key(left)[left->children - 1];
+                        data(right)[0] = data(left)[left->children - 1];
+                        right->children++;
+                        left->children--;
+                }
+                *sep = key(right)[0];
+        } else {
+                tree->stats.non_leaf_shifts++;
+                int k = n / 2 - left->children;
+                if (k > 0) {
+                        /* the first k ptrs of right rotate through sep */
+                        key(left)[left->children - 1] = *sep;
+                        memmove(&key(left)[left->children], &key(right)[0], (k - 1) * sizeof(bptree_key_t));
+                        sub_move(tree, left, left->children, right, 0, k);
+                        *sep = key(right)[k - 1];
+                        memmove(&key(right)[0], &key(right)[k], (right->children - k - 1) * sizeof(bptree_key_t));
+                        sub_move(tree, right, 0, right, k, right->children - k);
+                        for (i = left->children; i < left->children + k; i++) {
+                                sub_node_flush(tree, left, sub(left)[i]);
+                        }
+                        left->children += k;
+                        right->children -= k;
+                } else if (k < 0) {
+                        /* and the last -k ptrs of left the other way */
+                        k = -k;
+                        memmove(&key(right)[k], &key(right)[0], (right->children - 1) * sizeof(bptree_key_t));
+                        sub_move(tree, right, k, right, 0, right->children);
+                        key(right)[k - 1] = *sep;
+                        memmove(&key(right)[0], &key(left)[left->children - k], (k - 1) * sizeof(bptree_key_t));
+                        sub_move(tree, right, 0, left, left->children - k, k);
+                        *sep = key(left)[left->children - k - 1];
+                        for (i = 0; i < k; i++) {
+                                sub_node_flush(tree, right, sub(right)[i]);
+                        }
+                        left->children -= k;
+                        right->children += k;
+                }
+        }
+
+        total[0] = tree->flags & BPLUS_TREE_COUNTED ? node_total(left) : 0;
+        total[1] = tree->flags & BPLUS_TREE_COUNTED ? node_total(right) : 0;
+        node_flush(tree, left);
+        node_flush(tree, right);
+        return 0;
+}
+
+/* the pair of children c and c + 1 of parent was rebalanced, see range_rebalance */
+static void range_parent_update(struct bplus_tree *tree, off_t offset, int c, int gone,
+                                bptree_key_t sep, const long *total)
+{
+        struct bplus_node *parent = node_fetch(tree, offset);
+        if (tree->flags & BPLUS_TREE_COUNTED) {
+                cnt(parent)[c] = total[0];
+        }
+        if (gone) {
+                non_leaf_simple_remove(tree, parent, c);
+        } else {
+                key(parent)[c] = sep;
+                if (tree->flags & BPLUS_TREE_COUNTED) {
+                        cnt(parent)[c + 1] = total[1];
+                }
+        }
+        node_flush(tree, parent);
+}
+
+/* Walk down the path of key and even out every node under half full with a
+ * sibling. A merge may leave the parent under half full in turn, the walk
+ * starts over from the root then, which also hands a root with one child over
+ * to it */
+static void range_repair(struct bplus_tree *tree, bptree_key_t key)
+{
+        off_t offset = INVALID_OFFSET;
+        while (1) {
+                if (offset == INVALID_OFFSET) {
+                        struct bplus_node *root = node_fetch(tree, tree->root);
+                        if (root == NULL) {
+                                return;
+                        }
+                        if (is_leaf(root) && root->children == 0) {
+                                tree->root = INVALID_OFFSET;
+                                tree->level = 0;
+                                node_delete(tree, root, NULL, NULL);
+                                return;
+                        }
+                        if (!is_leaf(root) && root->children == 1) {
+                                struct bplus_node *child = node_fetch(tree, sub(root)[0]);
+                                child->parent = INVALID_OFFSET;
+                                tree->root = child->self;
+                                tree->level--;
+                                node_delete(tree, root, NULL, NULL);
+                                node_flush(tree, child);
+                                continue;
+                        }
+                        offset = root->self;
+                        cache_defer(tree, root);
+                }
+
+                struct bplus_node *parent = node_seek(tree, offset);
+                if (is_leaf(parent)) {
+                        return;
+                }
+                int i = key_binary_search(parent, key);
+                i = i >= 0 ? i + 1 : -i - 1;
+                int c = i > 0 ? i - 1 : 0;
+                off_t child = sub(parent)[i];
+                off_t sib = sub(parent)[c < i ? c : c + 1];
+                bptree_key_t sep = key(parent)[c];
+                if (parent->children < 2) {
+                        offset = child;
+                        continue;
+                }
+
+                struct bplus_node *node = node_fetch(tree, child);
+                int half = ((is_leaf(node) ? _max_entries : _max_order) + 1) / 2;
+                if (node->children >= half) {
+                        cache_defer(tree, node);
+                        offset = child;
+                        continue;
+                }
+                long total[2];
+                int gone = c < i ? range_rebalance(tree, node_fetch(tree, sib), node, &sep, total) :
+                                   range_rebalance(tree, node, node_fetch(tree, sib), &sep, total);
+                range_parent_update(tree, offset, c, gone, sep, total);
+                if (gone) {
+                        offset = INVALID_OFFSET;
+                } else {
+                        /* the path may lead to the sibling now */
+                        parent = node_seek(tree, offset);
+                        i = key_binary_search(parent, key);
+                        offset = sub(parent)[i >= 0 ? i + 1 : -i - 1];
+                }
+        }
+}
+
+/* a level of the two boundary paths of a range delete */
+struct range_level {
+        /* nodes left and right of the range, one node above the split */
+        off_t left;
+        off_t right;
+        /* child ptr taken from left on the way down */
+        int index;
+};
+
+/* Delete every key in [key1, key2]. The paths to both ends go apart at one
+ * node, every subtree between them is freed there and on the way down without
+ * its leaves being read, and the boundary leaves are trimmed. The two sides
+ * are then joined once from the leaves up, each level merged or evened out,
+ * and what is still underfull along the path of the low key is repaired from
+ * the root down. A BPLUS_TREE_BUFFERED tree drops the messages of the range
+ * from the paths and frees empty boundary leaves, it never merges */
+int bplus_tree_delete_range(struct bplus_tree *tree, bptree_key_t key1, bptree_key_t key2)
+{
+        long begin = stats_clock(tree);
+        bptree_key_t min = key1 <= key2 ? key1 : key2;
+        bptree_key_t max = min == key1 ? key2 : key1;
+        if (tree->root == INVALID_OFFSET) {
+                return -1;
+        }
+
+        /* levels below the root, the leftmost path tells */
+        int height = 0;
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (!is_leaf(node)) {
+                node = node_seek(tree, sub(node)[0]);
+                height++;
+        }
+
+        struct range_level *lv = NULL;
+        long cap = 0, removed = 0, dropped = 0;
+        int d, split = -1;
+        bptree_key_t sep = 0;
+        off_t left = tree->root, right = tree->root;
+        for (d = 0; ; d++) {
+                lv = (struct range_level *) array_reserve(lv, &cap, d + 1, sizeof(*lv));
+                lv[d].left = left;
+                lv[d].right = right;
+                struct bplus_node *l = node_fetch(tree, left);
+                struct bplus_node *r = split >= 0 ? node_fetch(tree, right) : l;
+                if (r != l) {
+                        /* whatever was between them is gone */
+                        l->next = r->self;
+                        r->prev = l->self;
+                }
+                if (is_leaf(l)) {
+                        removed += leaf_trim(l, min, max);
+                        if (r != l) {
+                                removed += leaf_trim(r, min, max);
+                                node_flush(tree, r);
+                        }
+                        node_flush(tree, l);
+                        break;
+                }
+                if (tree->buffer != NULL) {
+                        msg_trim(l, min, max);
+                        if (r != l) {
+                                msg_trim(r, min, max);
+                        }
+                }
+
+                int i = key_binary_search(l, min);
+                int j = key_binary_search(r, max);
+                i = i >= 0 ? i + 1 : -i - 1;
+                j = j >= 0 ? j + 1 : -j - 1;
+                lv[d].index = i;
+                if (r != l) {
+                        dropped += l->children - i - 1 + j;
+                        removed += range_drop(tree, l, i + 1, l->children, height - d - 1);
+                        removed += range_drop(tree, r, 0, j, height - d - 1);
+                        right = sub(r)[0];
+                        node_flush(tree, r);
+                } else if (i < j) {
+                        /* the paths split here, the key right of the gap stays between them */
+                        dropped += j - i - 1;
+                        removed += range_drop(tree, l, i + 1, j, height - d - 1);
+                        split = d;
+                        sep = key(l)[i];
+                        right = sub(l)[i + 1];
+                } else {
+                        right = sub(l)[i];
+                }
+                left = sub(l)[i];
+                node_flush(tree, l);
+        }
+
+        if (tree->buffer != NULL) {
+                node = node_fetch(tree, lv[d].left);
+                if (node->children == 0) {
+                        buffer_leaf_remove(tree, node);
+                } else {
+                        cache_defer(tree, node);
+                }
+                if (lv[d].right != lv[d].left) {
+                        node = node_fetch(tree, lv[d].right);
+                        if (node->children == 0) {
+                                buffer_leaf_remove(tree, node);
+                        } else {
+                                cache_defer(tree, node);
+                        }
+                }
+        } else {
+                /* join the two sides level by level from the leaves, each
+                 * pair hands its counts and the key between them up. A right
+                 * node that lost its only child is not written, it is freed
+                 * by the next pair */
+                int empty = 0;
+                for (; split >= 0 && d > split; d--) {
+                        long total[2];
+                        struct bplus_node *l = node_fetch(tree, lv[d].left);
+                        struct bplus_node *r = node_fetch(tree, lv[d].right);
+                        if (empty) {
+                                r->children = 0;
+                        }
+                        int gone = range_rebalance(tree, l, r, &sep, total);
+                        if (d - 1 == split) {
+                                range_parent_update(tree, lv[split].left, lv[split].index, gone, sep, total);
+                                continue;
+                        }
+
+                        l = node_fetch(tree, lv[d - 1].left);
+                        if (tree->flags & BPLUS_TREE_COUNTED) {
+                                cnt(l)[l->children - 1] = total[0];
+                        }
+                        node_flush(tree, l);
+                        r = node_fetch(tree, lv[d - 1].right);
+                        empty = gone && r->children == 1;
+                        if (!gone) {
+                                if (tree->flags & BPLUS_TREE_COUNTED) {
+                                        cnt(r)[0] = total[1];
+                                }
+                        } else if (r->children > 1) {
+                                /* the first key of right now sits between the two */
+                                sep = key(r)[0];
+                                memmove(&key(r)[0], &key(r)[1], (r->children - 2) * sizeof(bptree_key_t));
+                                sub_move(tree, r, 0, r, 1, r->children - 1);
+                                r->children--;
+                        }
+                        if (empty) {
+                                cache_defer(tree, r);
+                        } else {
+                                node_flush(tree, r);
+                        }
+                }
+                if (tree->flags & BPLUS_TREE_COUNTED) {
+                        count_fix(tree, min);
+                }
+                range_repair(tree, min);
+        }
+        free(lv);
+
+        tree->epoch++;
+        if (tree->cow != NULL && !list_empty(&tree->cow->snapshots)) {
+                cow_reclaim(tree);
+        }
+        if (tree->bloom != NULL) {
+                /* freed subtrees are only counted in a counted tree, otherwise
+                 * have the filter rebuilt on the next get */
+                if (dropped > 0 && !(tree->flags & BPLUS_TREE_COUNTED)) {
+                        tree->bloom->stale = tree->bloom->keys;
+                } else {
+                        tree->bloom->stale += removed;
+                }
+        }
+        stats_op(tree, BPLUS_STAT_DELETE, begin);
+        return 0;
+}
+
+/* build a bloom filter over the keys already stored, puts keep it up to date */
+int bplus_tree_bloom_enable(struct bplus_tree *tree, int bits_per_key)
+{
+        if (bits_per_key <= 0) {
+                fprintf(stderr, "Bloom filter needs at least one bit per key!\n");
+                return -1;
+        }
+
+        bplus_tree_bloom_disable(tree);
+
+        struct bplus_bloom *bloom = (bplus_bloom*)calloc(1, sizeof(*bloom));
+        assert(bloom != NULL);
+        bloom->bits_per_key = bits_per_key;
+        /* k = ln2 * bits per key minimizes the false positive rate */
+        bloom->hashes = (bits_per_key * 69 + 50) / 100;
+        if (bloom->hashes < 1) {
+                bloom->hashes = 1;
+        } else if (bloom->hashes > BLOOM_MAX_HASHES) {
+                bloom->hashes = BLOOM_MAX_HASHES;
+        }
+        tree->bloom = bloom;
+
+        /* count the keys first so the filter is sized for them */
+        long count = 0;
+        struct bplus_node *node = leaf_first_seek(tree);
+        while (node != NULL) {
+                count += node->children;
+                node = node_seek(tree, node->next);
+        }
+
+        if (bloom_rebuild(tree, 2 * count) != 0) {
+                bplus_tree_bloom_disable(tree);
+                return -1;
+        }
+        return 0;
+}
+
+void bplus_tree_bloom_disable(struct bplus_tree *tree)
+{
+        if (tree->bloom != NULL) {
+                free(tree->bloom->bits);
+                free(tree->bloom);
+                tree->bloom = NULL;
+        }
+}
+
+/* seek the leaf holding the largest key <= max, *index is that entry. Keys
+ * below the first one of a leaf sit in the leaves before it */
+static struct bplus_node *leaf_seek_desc(struct bplus_tree *tree, bptree_key_t max, int *index)
+{
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL && !is_leaf(node)) {
+                int i = key_binary_search(node, max);
+                node = node_seek(tree, sub(node)[i >= 0 ? i + 1 : -i - 1]);
+        }
+
+        int i = -1;
+        if (node != NULL) {
+                i = key_binary_search(node, max);
+                i = i >= 0 ? i : -i - 2;
+        }
+        while (node != NULL && i < 0) {
+                node = node_seek(tree, node->prev);
+                i = node != NULL ? node->children - 1 : -1;
+        }
+        *index = i;
+        return node;
+}
+
+bptree_val_t bplus_tree_get_range(struct bplus_tree *tree, bptree_key_t key1, bptree_key_t key2)
+{
+        long begin = stats_clock(tree);
+        bptree_val_t start = -1;
+        bptree_key_t min = key1 <= key2 ? key1 : key2;
+        bptree_key_t max = min == key1 ? key2 : key1;
+
+        if (tree->buffer != NULL) {
+                bptree_key_t key;
+                if (tree->root != INVALID_OFFSET) {
+                        buffer_range(tree, tree->root, 0, min, max, &key, &start);
+                }
+                stats_op(tree, BPLUS_STAT_RANGE, begin);
+                return start;
+        }
+
+        /* the answer is the last key of the range, no need to walk up to it */
+        int i;
+        struct bplus_node *leaf = leaf_seek_desc(tree, max, &i);
+        if (leaf != NULL && key(leaf)[i] >= min) {
+                start = data(leaf)[i];
+        }
+
+        stats_op(tree, BPLUS_STAT_RANGE, begin);
+        return start;
+}
+
+/* A leaf is read before the one after it in a descending scan, which the
+ * kernel readahead does not detect. Advise the previous leaf, and a window of
+ * blocks below it when the leaves lie in key order (bplus_tree_defrag) */
+static void cursor_readahead(struct bplus_cursor *cur)
+{
+        struct bplus_tree *tree = cur->tree;
+        off_t prev = cur->leaf->prev;
+        if (prev == INVALID_OFFSET || (tree->flags & BPLUS_TREE_DIRECT_IO)) {
+                /* no page cache to read into */
+                return;
+        }
+        if (tree->cow != NULL) {
+                prev = cow_read_offset(tree, prev);
+        } else if (prev >= cur->ra_from && prev < cur->ra_to) {
+                return;
+        }
+        if (tree->bcache != NULL && bcache_lookup(tree->bcache, prev) >= 0) {
+                return;
+        }
+
+        off_t from = prev;
+        if (tree->cow == NULL && prev + _block_size == cur->leaf->self) {
+                from = prev - (BPLUS_READAHEAD_BLOCKS - 1) * (off_t) _block_size;
+                if (from < 0) {
+                        from = 0;
+                }
+        }
+        cur->ra_from = from;
+        cur->ra_to = prev + _block_size;
+        posix_fadvise(tree->fd, from, cur->ra_to - from, POSIX_FADV_WILLNEED);
+}
+
+/* position the cursor on the largest key <= cur->max */
+static void cursor_seek(struct bplus_cursor *cur)
+{
+        struct bplus_tree *tree = cur->tree;
+        int i;
+        struct bplus_node *leaf = leaf_seek_desc(tree, cur->max, &i);
+        cur->epoch = tree->epoch;
+        if (leaf == NULL) {
+                cur->done = 1;
+                return;
+        }
+        memcpy(cur->leaf, leaf, _node_size);
+        cur->index = i;
+        cursor_readahead(cur);
+}
+
+/* cursor over [key1, key2] returning keys from the largest one down, NULL
+ * when its leaf buffer cannot be allocated */
+struct bplus_cursor *bplus_tree_cursor_desc(struct bplus_tree *tree, bptree_key_t key1, bptree_key_t key2)
+{
+        struct bplus_cursor *cur = (bplus_cursor *)calloc(1, sizeof(*cur));
+        assert(cur != NULL);
+        cur->tree = tree;
+        cur->min = key1 <= key2 ? key1 : key2;
+        cur->max = cur->min == key1 ? key2 : key1;
+        if (tree->buffer == NULL) {
+                void *leaf;
+                if (posix_memalign(&leaf, _block_size, _node_size) != 0) {
+                        free(cur);
+                        return NULL;
+                }
+                cur->leaf = (struct bplus_node *) leaf;
+                cursor_seek(cur);
+        }
+        return cur;
+}
+
+/* the next key down and its data, -1 once the range is used up. A put in
+ * between is fine, the cursor seeks again below the last key returned */
+int bplus_cursor_prev(struct bplus_cursor *cur, bptree_key_t *key, bptree_val_t *data)
+{
+        struct bplus_tree *tree = cur->tree;
+        bptree_key_t k;
+        bptree_val_t d = -1;
+
+        if (cur->done) {
+                return -1;
+        }
+
+        if (tree->buffer != NULL) {
+                /* messages above the leaves decide, look each key up from the root */
+                if (tree->root == INVALID_OFFSET ||
+                    !buffer_range(tree, tree->root, 0, cur->min, cur->max, &k, &d)) {
+                        cur->done = 1;
+                        return -1;
+                }
+        } else {
+                if (cur->epoch != tree->epoch) {
+                        cursor_seek(cur);
+                        if (cur->done) {
+                                return -1;
+                        }
+                }
+                while (cur->index < 0) {
+                        if (cur->leaf->prev == INVALID_OFFSET) {
+                                cur->done = 1;
+                                return -1;
+                        }
+                        node_read(tree, cur->leaf, cur->leaf->prev);
+                        cur->index = cur->leaf->children - 1;
+                        cursor_readahead(cur);
+                }
+                k = key(cur->leaf)[cur->index];
+                d = data(cur->leaf)[cur->index];
+                cur->index--;
+                if (k < cur->min) {
+                        cur->done = 1;
+                        return -1;
+                }
+        }
+
+        if (k == cur->min) {
+                cur->done = 1;
+        } else {
+                cur->max = k - 1;
+        }
+        if (key != NULL) {
+                *key = k;
+        }
+        if (data != NULL) {
+                *data = d;
+        }
+        return 0;
+}
+
+void bplus_cursor_free(struct bplus_cursor *cur)
+{
+        free(cur->leaf);
+        free(cur);
+}
+
+/* the largest limit keys of [key1, key2] in descending order, either array may
+ * be NULL. Returns how many were found, -1 if no cursor could be set up */
+long bplus_tree_get_range_desc(struct bplus_tree *tree, bptree_key_t key1, bptree_key_t key2, long limit,
+                               bptree_key_t *keys, bptree_val_t *data)
+{
+        long begin = stats_clock(tree);
+        struct bplus_cursor *cur = bplus_tree_cursor_desc(tree, key1, key2);
+        long n = 0;
+        if (cur == NULL) {
+                return -1;
+        }
+        while (n < limit && bplus_cursor_prev(cur, keys != NULL ? &keys[n] : NULL,
+                                              data != NULL ? &data[n] : NULL) == 0) {
+                n++;
+        }
+        bplus_cursor_free(cur);
+        stats_op(tree, BPLUS_STAT_RANGE, begin);
+        return n;
+}
+
+/* keys below key in a BPLUS_TREE_COUNTED tree, key itself included with
+ * inclusive set. The counts left of the path add up on the way down */
+static long count_below(struct bplus_tree *tree, bptree_key_t key, int inclusive)
+{
+        long n = 0;
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL) {
+                int i = key_binary_search(node, key);
+                if (is_leaf(node)) {
+                        return n + (i >= 0 ? i + inclusive : -i - 1);
+                }
+                i = i >= 0 ? i + 1 : -i - 1;
+                int j;
+                for (j = 0; j < i; j++) {
+                        n += cnt(node)[j];
+                }
+                node = node_seek(tree, sub(node)[i]);
+        }
+        return n;
+}
+
+/* number of keys in [key1, key2], -1 unless the tree is BPLUS_TREE_COUNTED */
+long bplus_tree_count_range(struct bplus_tree *tree, bptree_key_t key1, bptree_key_t key2)
+{
+        if (!(tree->flags & BPLUS_TREE_COUNTED)) {
+                return -1;
+        }
+        long begin = stats_clock(tree);
+        bptree_key_t min = key1 <= key2 ? key1 : key2;
+        bptree_key_t max = min == key1 ? key2 : key1;
+        long n = count_below(tree, max, 1) - count_below(tree, min, 0);
+        stats_op(tree, BPLUS_STAT_RANGE, begin);
+        return n;
+}
+
+/* number of keys below key, -1 unless the tree is BPLUS_TREE_COUNTED */
+long bplus_tree_rank(struct bplus_tree *tree, bptree_key_t key)
+{
+        if (!(tree->flags & BPLUS_TREE_COUNTED)) {
+                return -1;
+        }
+        return count_below(tree, key, 0);
+}
+
+/* the key of rank k (0 for the smallest) and its data, -1 if there are not
+ * that many keys or the tree is not BPLUS_TREE_COUNTED */
+int bplus_tree_select(struct bplus_tree *tree, long k, bptree_key_t *key, bptree_val_t *data)
+{
+        if (!(tree->flags & BPLUS_TREE_COUNTED) || k < 0) {
+                return -1;
+        }
+        struct bplus_node *node = node_seek(tree, tree->root);
+        while (node != NULL && !is_leaf(node)) {
+                int i = 0;
+                while (i < node->children - 1 && k >= cnt(node)[i]) {
+                        k -= cnt(node)[i];
+                        i++;
+                }
+                node = node_seek(tree, sub(node)[i]);
+        }
+        if (node == NULL || k >= node->children) {
+                return -1;
+        }
+        if (key != NULL) {
+                *key = key(node)[k];
+        }
+        if (data != NULL) {
+                *data = data(node)[k];
+        }
+        return 0;
+}
+
+/* pin the current tree, blocks it can see are not written until it is released */
+struct bplus_snapshot *bplus_tree_snapshot(struct bplus_tree *tree)
+{
+        struct bplus_cow *cow = tree->cow;
+        if (cow == NULL) {
+                fprintf(stderr, "Snapshots need a BPLUS_TREE_COW tree!\n");
+                return NULL;
+        }
+        cow_reclaim(tree);
+
+        struct bplus_snapshot *snap = (struct bplus_snapshot *) calloc(1, sizeof(*snap));
+        assert(snap != NULL);
+        snap->tree = tree;
+        snap->fd = tree->fd;
+        snap->flags = tree->flags;
+        snap->root = tree->root;
+        snap->gen = cow->gen;
+        snap->nr = cow->nr;
+        snap->map = (off_t *) malloc((cow->nr > 0 ? cow->nr : 1) * sizeof(off_t));
+        assert(snap->map != NULL);
+        memcpy(snap->map, cow->map, cow->nr * sizeof(off_t));
+        /* aligned for O_DIRECT, the block size is a multiple of the device block */
+        void *buf;
+        if (posix_memalign(&buf, _block_size, _block_size) != 0) {
+                free(snap->map);
+                free(snap);
+                return NULL;
+        }
+        snap->buf = (char *) buf;
+        snap->node = (char *) malloc(_node_size);
+        assert(snap->node != NULL);
+
+        list_add_tail(&snap->link, &cow->snapshots);
+        cow->pinned = cow->gen++;
+        return snap;
+}
+
+/* may be called from the reader thread, the snapshot must not be used after */
+void bplus_snapshot_release(struct bplus_snapshot *snap)
+{
+        __atomic_store_n(&snap->released, 1, __ATOMIC_RELEASE);
+}
+
+/* read a node of the snapshot into its own buffer, the tree is not touched.
+ * A failed or short read ends the walk like a missing node */
+static struct bplus_node *snapshot_node(struct bplus_snapshot *snap, off_t offset)
+{
+        if (offset == INVALID_OFFSET) {
+                return NULL;
+        }
+        assert(offset / _block_size < snap->nr);
+        ssize_t len = pread(snap->fd, snap->buf, _block_size, snap->map[offset / _block_size]);
+        if (len != _block_size) {
+                return NULL;
+        }
+        if (snap->flags & BPLUS_TREE_COMPRESS) {
+                node_unpack(snap->buf, (struct bplus_node *) snap->node);
+                return (struct bplus_node *) snap->node;
+        }
+        return (struct bplus_node *) snap->buf;
+}
+
+bptree_val_t bplus_snapshot_get(struct bplus_snapshot *snap, bptree_key_t key)
+{
+        struct bplus_node *node = snapshot_node(snap, snap->root);
+        while (node != NULL) {
+                int i = key_binary_search(node, key);
+                if (is_leaf(node)) {
+                        return i >= 0 ? data(node)[i] : -1;
+                }
+                node = snapshot_node(snap, sub(node)[i >= 0 ? i + 1 : -i - 1]);
+        }
+        return -1;
+}
+
+/* bplus_tree_get_range on the snapshot */
+bptree_val_t bplus_snapshot_get_range(struct bplus_snapshot *snap, bptree_key_t key1, bptree_key_t key2)
+{
+        bptree_key_t min = key1 <= key2 ? key1 : key2;
+        bptree_key_t max = min == key1 ? key2 : key1;
+
+        /* seek the last key of the range like bplus_tree_get_range */
+        struct bplus_node *node = snapshot_node(snap, snap->root);
+        while (node != NULL && !is_leaf(node)) {
+                int i = key_binary_search(node, max);
+                node = snapshot_node(snap, sub(node)[i >= 0 ? i + 1 : -i - 1]);
+        }
+
+        int i = -1;
+        if (node != NULL) {
+                i = key_binary_search(node, max);
+                i = i >= 0 ? i : -i - 2;
+        }
+        while (node != NULL && i < 0) {
+                node = snapshot_node(snap, node->prev);
+                i = node != NULL ? node->children - 1 : -1;
+        }
+        return node != NULL && key(node)[i] >= min ? data(node)[i] : -1;
+}
+
+#ifdef __linux__
+/* a minimal io_uring, the rings are used directly without liburing */
+struct bplus_uring {
+        int fd;
+        unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+        unsigned *cq_head, *cq_tail, *cq_mask;
+        struct io_uring_sqe *sqes;
+        struct io_uring_cqe *cqes;
+        void *sq_ring, *cq_ring;
+        size_t sq_ring_size, cq_ring_size, sqes_size;
+};
+
+static int uring_setup(struct bplus_uring *ring, unsigned entries)
+{
+        struct io_uring_params p;
+        memset(&p, 0, sizeof(p));
+        ring->fd = syscall(__NR_io_uring_setup, entries, &p);
+        if (ring->fd < 0) {
+                return -1;
+        }
+
+        ring->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        ring->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+        ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+        ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+        ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+                             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        ring->sqes = (struct io_uring_sqe *) mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                                                  MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+        if (ring->sq_ring == MAP_FAILED || ring->cq_ring == MAP_FAILED || ring->sqes == MAP_FAILED) {
+                if (ring->sq_ring != MAP_FAILED) munmap(ring->sq_ring, ring->sq_ring_size);
+                if (ring->cq_ring != MAP_FAILED) munmap(ring->cq_ring, ring->cq_ring_size);
+                if (ring->sqes != MAP_FAILED) munmap(ring->sqes, ring->sqes_size);
+                close(ring->fd);
+                ring->fd = -1;
+                return -1;
+        }
+
+        char *sq = (char *) ring->sq_ring;
+        char *cq = (char *) ring->cq_ring;
+        ring->sq_head = (unsigned *) (sq + p.sq_off.head);
+        ring->sq_tail = (unsigned *) (sq + p.sq_off.tail);
+        ring->sq_mask = (unsigned *) (sq + p.sq_off.ring_mask);
+        ring->sq_array = (unsigned *) (sq + p.sq_off.array);
+        ring->cq_head = (unsigned *) (cq + p.cq_off.head);
+        ring->cq_tail = (unsigned *) (cq + p.cq_off.tail);
+        ring->cq_mask = (unsigned *) (cq + p.cq_off.ring_mask);
+        ring->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+        return 0;
+}
+
+static void uring_exit(struct bplus_uring *ring)
+{
+        if (ring->fd >= 0) {
+                munmap(ring->sq_ring, ring->sq_ring_size);
+                munmap(ring->cq_ring, ring->cq_ring_size);
+                munmap(ring->sqes, ring->sqes_size);
+                close(ring->fd);
+                ring->fd = -1;
+        }
+}
+
+/* queue a block read, it is not submitted until uring_enter */
+static void uring_read(struct bplus_uring *ring, int fd, char *buf, off_t offset, void *user)
+{
+        unsigned tail = *ring->sq_tail;
+        unsigned i = tail & *ring->sq_mask;
+        struct io_uring_sqe *sqe = &ring->sqes[i];
+
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_READ;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t) (uintptr_t) buf;
+        sqe->len = _block_size;
+        sqe->off = offset;
+        sqe->user_data = (uint64_t) (uintptr_t) user;
+        ring->sq_array[i] = i;
+        __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_enter(struct bplus_uring *ring, unsigned submit, unsigned wait)
+{
+        return syscall(__NR_io_uring_enter, ring->fd, submit, wait,
+                       wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+}
+#else
+struct bplus_uring {
+        int fd;
+};
+
+static int uring_setup(struct bplus_uring *ring, unsigned entries)
+{
+        ring->fd = -1;
+        return -1;
+}
+
+static void uring_exit(struct bplus_uring *ring)
+{
+}
+#endif
+
+/* Asynchronous requests descend the tree one block read at a time, each with
+ * its own buffer, so up to depth lookups are in flight at once. Without
+ * io_uring the requests are queued and run synchronously by bplus_tree_poll. */
+struct bplus_aio {
+        /* ring.fd < 0 means synchronous fallback */
+        struct bplus_uring ring;
+        int depth;
+        /* depth block buffers and a stack of the free ones */
+        char *bufs;
+        char **free_bufs;
+        int nr_free;
+        /* reads queued in the ring but not yet submitted */
+        unsigned queued;
+        int inflight;
+        /* requests waiting for a buffer (or for poll without io_uring) */
+        struct list_head waiting;
+        /* finished requests whose callback has not run yet */
+        struct list_head ready;
+};
+
+/* like node_seek, but the block is already in buf */
+static struct bplus_node *node_seek_buf(struct bplus_tree *tree, const char *buf)
+{
+        struct bplus_node *node = cache_refer(tree);
+        if (tree->flags & BPLUS_TREE_COMPRESS) {
+                node_unpack(buf, node);
+        } else {
+                memcpy(node, buf, _block_size);
+        }
+        cache_defer(tree, node);
+        return node;
+}
+
+/* accessors of a block as read from disk, packed or not */
+static inline int block_key_search(struct bplus_tree *tree, const char *buf, bptree_key_t key)
+{
+        if (tree->flags & BPLUS_TREE_COMPRESS) {
+                return packed_key_search(buf, key);
+        }
+        return key_binary_search((struct bplus_node *) buf, key);
+}
+
+static inline int block_is_leaf(struct bplus_tree *tree, const char *buf)
+{
+        if (tree->flags & BPLUS_TREE_COMPRESS) {
+                return packed_is_leaf(buf);
+        }
+        return is_leaf((struct bplus_node *) buf);
+}
+
+static inline off_t block_sub(struct bplus_tree *tree, const char *buf, int i)
+{
+        if (tree->flags & BPLUS_TREE_COMPRESS) {
+                return packed_sub(buf, i);
+        }
+        return sub((struct bplus_node *) buf)[i];
+}
+
+static inline bptree_val_t block_data(struct bplus_tree *tree, const char *buf, int i)
+{
+        if (tree->flags & BPLUS_TREE_COMPRESS) {
+                return packed_data(buf, i);
+        }
+        return data((struct bplus_node *) buf)[i];
+}
+
+/* apply a put to the leaf its descent ended in */
+static int leaf_put(struct bplus_tree *tree, struct bplus_node *leaf, bptree_key_t key, bptree_val_t data)
+{
+        if (data) {
+                return leaf_insert(tree, leaf, key, data);
+        }
+
+        int remove = key_binary_search(leaf, key);
+        if (remove < 0) {
+                return -1;
+        }
+        leaf_remove(tree, leaf, remove);
+        return 0;
+}
+
+static void aio_start(struct bplus_tree *tree, struct bplus_request *req);
+static void aio_advance(struct bplus_tree *tree, struct bplus_request *req, int res);
+
+/* release the buffer of a finished request and hand it to a waiting one */
+static void aio_complete(struct bplus_tree *tree, struct bplus_request *req, long ret)
+{
+        struct bplus_aio *aio = tree->aio;
+        req->ret = ret;
+        if (req->buf != NULL) {
+                aio->free_bufs[aio->nr_free++] = req->buf;
+                req->buf = NULL;
+        }
+        list_add_tail(&req->link, &aio->ready);
+
+        if (aio->ring.fd >= 0 && !list_empty(&aio->waiting)) {
+                struct bplus_request *next = list_first_entry(&aio->waiting, struct bplus_request, link);
+                list_del(&next->link);
+                aio_start(tree, next);
+        }
+}
+
+/* read the next block of the descent, or finish when there is none */
+static void aio_read(struct bplus_tree *tree, struct bplus_request *req, off_t offset)
+{
+        struct bplus_aio *aio = tree->aio;
+        if (offset == INVALID_OFFSET) {
+                /* empty tree */
+                aio_complete(tree, req, req->op == BPLUS_REQ_GET ? -1 : bplus_tree_put(tree, req->key, req->data));
+                return;
+        }
+
+        req->offset = tree->cow != NULL ? cow_read_offset(tree, offset) : offset;
+        offset = req->offset;
+
+        /* cached blocks need no I/O */
+        struct bplus_block_cache *bc = tree->bcache;
+        int i = bc != NULL ? bcache_lookup(bc, offset) : -1;
+        tree->stats.node_reads++;
+        if (i >= 0) {
+                bc->ref[i] = 1;
+                memcpy(req->buf, bc->blocks + (size_t) i * _block_size, _block_size);
+                tree->stats.cache_hits++;
+                aio_advance(tree, req, _block_size);
+                return;
+        }
+
+        tree->stats.cache_misses++;
+        tree->stats.bytes_read += _block_size;
+#ifdef __linux__
+        uring_read(&aio->ring, tree->fd, req->buf, offset, req);
+        aio->queued++;
+        aio->inflight++;
+#endif
+}
+
+static void aio_start(struct bplus_tree *tree, struct bplus_request *req)
+{
+        struct bplus_aio *aio = tree->aio;
+        if (req->op == BPLUS_REQ_GET && tree->bloom != NULL) {
+                bloom_refresh(tree);
+                if (!bloom_may_contain(tree->bloom, req->key)) {
+                        tree->stats.bloom_negatives++;
+                        aio_complete(tree, req, -1);
+                        return;
+                }
+        }
+
+        if (aio->nr_free == 0) {
+                list_add_tail(&req->link, &aio->waiting);
+                return;
+        }
+        req->buf = aio->free_bufs[--aio->nr_free];
+        req->epoch = tree->epoch;
+        aio_read(tree, req, tree->root);
+}
+
+/* a block read of req finished, step one level down */
+static void aio_advance(struct bplus_tree *tree, struct bplus_request *req, int res)
+{
+        if (res != _block_size) {
+                /* failed or short read, the block is of no use */
+                aio_complete(tree, req, -1);
+                return;
+        }
+
+        /* a put ran while the block was read, the path may be gone */
+        if (req->epoch != tree->epoch) {
+                req->epoch = tree->epoch;
+                aio_read(tree, req, tree->root);
+                return;
+        }
+
+        struct bplus_block_cache *bc = tree->bcache;
+        if (bc != NULL && bcache_lookup(bc, req->offset) < 0) {
+                int slot = bcache_insert(bc, req->offset);
+                memcpy(bc->blocks + (size_t) slot * _block_size, req->buf, _block_size);
+        }
+
+        int i = block_key_search(tree, req->buf, req->key);
+        if (!block_is_leaf(tree, req->buf)) {
+                aio_read(tree, req, block_sub(tree, req->buf, i >= 0 ? i + 1 : -i - 1));
+        } else if (req->op == BPLUS_REQ_GET) {
+                aio_complete(tree, req, i >= 0 ? block_data(tree, req->buf, i) : -1);
+        } else {
+                struct bplus_node *node = node_seek_buf(tree, req->buf);
+                int ret = leaf_put(tree, node, req->key, req->data);
+                if (ret == 0) {
+                        put_done(tree, req->key, req->data);
+                }
+                aio_complete(tree, req, ret);
+        }
+}
+
+/* set up the async engine with depth in-flight requests,
+ * return 0 with io_uring, 1 for the synchronous fallback */
+int bplus_tree_aio_init(struct bplus_tree *tree, int depth)
+{
+        int i;
+        if (tree->aio != NULL || depth <= 0) {
+                return -1;
+        }
+        if (tree->buffer != NULL) {
+                /* requests descend block by block and would miss the buffers */
+                fprintf(stderr, "Async requests on a BPLUS_TREE_BUFFERED tree are not supported!\n");
+                return -1;
+        }
+
+        struct bplus_aio *aio = (bplus_aio*)calloc(1, sizeof(*aio));
+        assert(aio != NULL);
+        aio->depth = depth;
+        list_init(&aio->waiting);
+        list_init(&aio->ready);
+
+        void *bufs;
+        if (posix_memalign(&bufs, _block_size, (size_t) depth * _block_size) != 0) {
+                free(aio);
+                return -1;
+        }
+        aio->bufs = (char *) bufs;
+        aio->free_bufs = (char **) malloc(depth * sizeof(char *));
+        assert(aio->free_bufs != NULL);
+        for (i = 0; i < depth; i++) {
+                aio->free_bufs[i] = aio->bufs + (size_t) i * _block_size;
+        }
+        aio->nr_free = depth;
+
+        uring_setup(&aio->ring, depth);
+        tree->aio = aio;
+        return aio->ring.fd >= 0 ? 0 : 1;
+}
+
+/* start a get or put, its callback runs from a later bplus_tree_poll */
+int bplus_tree_submit(struct bplus_tree *tree, struct bplus_request *req)
+{
+        struct bplus_aio *aio = tree->aio;
+        if (aio == NULL) {
+                return -1;
+        }
+
+        if (req->op == BPLUS_REQ_GET) {
+                tree->stats.aio_gets++;
+        } else {
+                tree->stats.aio_puts++;
+        }
+
+        req->buf = NULL;
+        if (aio->ring.fd < 0) {
+                list_add_tail(&req->link, &aio->waiting);
+        } else {
+                aio_start(tree, req);
+        }
+        return 0;
+}
+
+#ifdef __linux__
+/* submit the queued reads and wait for wait of them to finish. The kernel may
+ * take fewer than queued, the rest stay for the next call, and so do all of
+ * them when it is interrupted or busy with completions not yet reaped */
+static void aio_submit(struct bplus_aio *aio, unsigned wait)
+{
+        int ret = uring_enter(&aio->ring, aio->queued, wait);
+        if (ret >= 0) {
+                aio->queued -= (unsigned) ret < aio->queued ? (unsigned) ret : aio->queued;
+        } else if (errno != EINTR && errno != EBUSY && errno != EAGAIN) {
+                fprintf(stderr, "io_uring_enter failed: %s\n", strerror(errno));
+        }
+}
+#endif
+
+/* Submit queued reads, reap finished ones and run the callbacks of completed
+ * requests. With wait set it blocks until at least one completes.
+ * Return the number of callbacks run. */
+int bplus_tree_poll(struct bplus_tree *tree, int wait)
+{
+        struct bplus_aio *aio = tree->aio;
+        struct list_head *pos, *n;
+        int done = 0;
+
+        if (aio == NULL) {
+                return -1;
+        }
+
+        if (aio->ring.fd < 0) {
+                list_for_each_safe(pos, n, &aio->waiting) {
+                        struct bplus_request *req = list_entry(pos, struct bplus_request, link);
+                        list_del(pos);
+                        req->ret = req->op == BPLUS_REQ_GET ? bplus_tree_get(tree, req->key)
+                                                            : bplus_tree_put(tree, req->key, req->data);
+                        list_add_tail(&req->link, &aio->ready);
+                }
+        }
+
+#ifdef __linux__
+        while (aio->ring.fd >= 0 && (aio->queued > 0 || aio->inflight > 0)) {
+                unsigned reap = wait && aio->inflight > 0 && list_empty(&aio->ready) ? 1 : 0;
+                aio_submit(aio, reap);
+
+                /* reaping may queue the next level of each descent */
+                unsigned head = *aio->ring.cq_head;
+                unsigned tail = __atomic_load_n(aio->ring.cq_tail, __ATOMIC_ACQUIRE);
+                for (; head != tail; head++) {
+                        struct io_uring_cqe *cqe = &aio->ring.cqes[head & *aio->ring.cq_mask];
+                        struct bplus_request *req = (struct bplus_request *) (uintptr_t) cqe->user_data;
+                        aio->inflight--;
+                        aio_advance(tree, req, cqe->res);
+                }
+                __atomic_store_n(aio->ring.cq_head, head, __ATOMIC_RELEASE);
+
+                if (!wait || !list_empty(&aio->ready)) {
+                        break;
+                }
+        }
+#endif
+
+        list_for_each_safe(pos, n, &aio->ready) {
+                struct bplus_request *req = list_entry(pos, struct bplus_request, link);
+                list_del(pos);
+                req->callback(req, req->ret);
+                done++;
+        }
+
+#ifdef __linux__
+        /* callbacks and restarted descents may have queued more reads */
+        if (aio->ring.fd >= 0 && aio->queued > 0) {
+                aio_submit(aio, 0);
+        }
+#endif
+        return done;
+}
+
+/* wait for all requests and tear the engine down */
+static void aio_deinit(struct bplus_tree *tree)
+{
+        struct bplus_aio *aio = tree->aio;
+        if (aio == NULL) {
+                return;
+        }
+
+        while (aio->inflight > 0 || !list_empty(&aio->waiting) || !list_empty(&aio->ready)) {
+                bplus_tree_poll(tree, 1);
+        }
+        uring_exit(&aio->ring);
+        free(aio->free_bufs);
+        free(aio->bufs);
+        free(aio);
+        tree->aio = NULL;
+}
+
+/* cache nr_blocks blocks in memory, for O_DIRECT this is the only caching */
+int bplus_tree_cache_enable(struct bplus_tree *tree, int nr_blocks)
+{
+        int i;
+        if (tree->bcache != NULL || nr_blocks <= 0) {
+                return -1;
+        }
+
+        struct bplus_block_cache *bc = (bplus_block_cache*)calloc(1, sizeof(*bc));
+        assert(bc != NULL);
+        bc->nr = nr_blocks;
+        for (bc->mask = 1; bc->mask < nr_blocks; bc->mask <<= 1);
+        bc->blocks = (char *) malloc((size_t) nr_blocks * _block_size);
+        bc->offsets = (off_t *) malloc(nr_blocks * sizeof(off_t));
+        bc->ref = (unsigned char *) calloc(nr_blocks, 1);
+        bc->buckets = (int *) malloc(bc->mask * sizeof(int));
+        bc->chain = (int *) malloc(nr_blocks * sizeof(int));
+        if (bc->blocks == NULL || bc->offsets == NULL || bc->ref == NULL ||
+            bc->buckets == NULL || bc->chain == NULL) {
+                free(bc->blocks);
+                free(bc->offsets);
+                free(bc->ref);
+                free(bc->buckets);
+                free(bc->chain);
+                free(bc);
+                return -1;
+        }
+
+        for (i = 0; i < nr_blocks; i++) {
+                bc->offsets[i] = INVALID_OFFSET;
+                bc->chain[i] = -1;
+        }
+        for (i = 0; i < bc->mask; i++) {
+                bc->buckets[i] = -1;
+        }
+        bc->mask--;
+        tree->bcache = bc;
+        return 0;
+}
+
+static int offset_cmp(const void *a, const void *b)
+{
+        off_t x = *(const off_t *) a, y = *(const off_t *) b;
+        return x < y ? -1 : x > y;
+}
+
+static inline off_t defrag_remap(const long *perm, off_t offset)
+{
+        return offset == INVALID_OFFSET ? offset : (off_t) perm[offset / _block_size] * _block_size;
+}
+
+/* fetch the node in block b with its offsets moved to the new layout, NULL
+ * for a free block */
+static struct bplus_node *defrag_load(struct bplus_tree *tree, const long *perm, const char *live, long b)
+{
+        int i;
+        if (!live[b]) {
+                return NULL;
+        }
+        struct bplus_node *node = node_fetch(tree, (off_t) b * _block_size);
+        node->self = defrag_remap(perm, node->self);
+        node->parent = defrag_remap(perm, node->parent);
+        node->prev = defrag_remap(perm, node->prev);
+        node->next = defrag_remap(perm, node->next);
+        if (!is_leaf(node)) {
+                for (i = 0; i < node->children; i++) {
+                        sub(node)[i] = defrag_remap(perm, sub(node)[i]);
+                }
+        }
+        return node;
+}
+
+/*
+ * Rewrite the tree so leaves lie in key order in one contiguous run at the end
+ * of the file, with levels non-zero every level above them is laid out the
+ * same way, root first. Otherwise internal nodes keep their relative order.
+ * Free blocks are squeezed out and the file is truncated. The new layout is
+ * a permutation of the blocks, applied in place one cycle at a time with two
+ * node caches. Returns the number of nodes moved, -1 if the tree cannot be
+ * defragmented.
+ */
+long bplus_tree_defrag(struct bplus_tree *tree, int levels)
+{
+        long i, b;
+        if (tree->cow != NULL) {
+                /* the page map owns the physical layout of a shadow paged tree */
+                fprintf(stderr, "Defragmenting a BPLUS_TREE_COW tree is not supported!\n");
+                return -1;
+        }
+        if (tree->root == INVALID_OFFSET) {
+                return 0;
+        }
+
+        /* nodes level by level, each level in key order */
+        long nblocks = tree->file_size / _block_size;
+        off_t *order = (off_t *) malloc(nblocks * sizeof(off_t));
+        long *perm = (long *) malloc(nblocks * sizeof(long));
+        char *live = (char *) calloc(nblocks, 1);
+        char *done = (char *) calloc(nblocks, 1);
+        assert(order != NULL && perm != NULL && live != NULL && done != NULL);
+
+        long n = 0, level = 0, leaves = 0;
+        order[n++] = tree->root;
+        while (level < n) {
+                long end = n;
+                for (i = level; i < end; i++) {
+                        struct bplus_node *node = node_seek(tree, order[i]);
+                        if (is_leaf(node)) {
+                                leaves++;
+                                continue;
+                        }
+                        for (b = 0; b < node->children; b++) {
+                                order[n++] = sub(node)[b];
+                        }
+                }
+                level = end;
+        }
+
+        if (!levels) {
+                /* only the leaves, internal nodes stay in file order before them */
+                qsort(order, n - leaves, sizeof(off_t), offset_cmp);
+        }
+
+        /* live blocks go to [0, n), free ones fill the rest */
+        for (i = 0; i < n; i++) {
+                b = order[i] / _block_size;
+                live[b] = 1;
+                perm[b] = i;
+        }
+        long hole = n;
+        for (b = 0; b < nblocks; b++) {
+                if (!live[b]) {
+                        perm[b] = hole++;
+                }
+        }
+
+        /* follow each cycle, carrying the node displaced by every write */
+        long moved = 0;
+        for (b = 0; b < nblocks; b++) {
+                if (done[b]) {
+                        continue;
+                }
+                struct bplus_node *carry = defrag_load(tree, perm, live, b);
+                long cur = b;
+                for (;;) {
+                        long t = perm[cur];
+                        done[cur] = 1;
+                        struct bplus_node *next = t == b ? NULL : defrag_load(tree, perm, live, t);
+                        if (carry != NULL) {
+                                moved += t != cur;
+                                node_flush(tree, carry);
                         }
-                        
-                        return -1;
-                } else {
-                        int i = key_binary_search(node, key);
-                        if (i >= 0) {
-                                assert(cur == NULL && t == -1);
-                                // t = i;
-                                // cur = node;
-                                // tree->used[((char *) cur - tree->caches) / _block_size] = 1;
-                                node = node_seek(tree, sub(node)[i + 1]);
-                        } else {
-                                i = -i - 1;
-                                node = node_seek(tree, sub(node)[i]);
+                        if (t == b) {
+                                break;
                         }
+                        carry = next;
+                        cur = t;
                 }
         }
-        return -1;
+
+        tree->root = defrag_remap(perm, tree->root);
+        tree->tail = INVALID_OFFSET;
+        struct list_head *pos, *tmp;
+        list_for_each_safe(pos, tmp, &tree->free_blocks) {
+                list_del(pos);
+                free(list_entry(pos, struct free_block, link));
+        }
+        tree->file_size = (off_t) n * _block_size;
+        if (ftruncate(tree->fd, tree->file_size) != 0) {
+                perror("ftruncate");
+        }
+        /* in-flight async descents restart from the new root */
+        tree->epoch++;
+
+        free(order);
+        free(perm);
+        free(live);
+        free(done);
+        return moved;
 }
 
-bptree_val_t bplus_tree_get(struct bplus_tree *tree, bptree_key_t key)
+/* copy the counters out, the tree keeps counting */
+void bplus_tree_stats(struct bplus_tree *tree, struct bplus_stats *stats)
 {
-        return bplus_tree_search(tree, key);
+        memcpy(stats, &tree->stats, sizeof(*stats));
 }
 
-int bplus_tree_put(struct bplus_tree *tree, bptree_key_t key, bptree_val_t data)
+void bplus_tree_stats_reset(struct bplus_tree *tree)
 {
-        if (data) {
-                return bplus_tree_insert(tree, key, data);
-        } else {
-                return bplus_tree_delete(tree, key);
-        }
+        memset(&tree->stats, 0, sizeof(tree->stats));
 }
 
-bptree_val_t bplus_tree_get_range(struct bplus_tree *tree, bptree_key_t key1, bptree_key_t key2)
+/* record per-call latency, costs two clock reads per call */
+void bplus_tree_stats_latency(struct bplus_tree *tree, int enable)
 {
-        bptree_val_t start = -1;
-        bptree_key_t min = key1 <= key2 ? key1 : key2;
-        bptree_key_t max = min == key1 ? key2 : key1;
+        tree->timing = enable;
+}
 
-        struct bplus_node *node = node_seek(tree, tree->root);
-        while (node != NULL) {
-                int i = key_binary_search(node, min);
-                if (is_leaf(node)) {
-                        if (i < 0) {
-                                i = -i - 1;
-                                if (i >= node->children) {
-                                        node = node_seek(tree, node->next);
-                                }
-                        }
-                        while (node != NULL && key(node)[i] <= max) {
-                                start = data(node)[i];
-                                if (++i >= node->children) {
-                                        node = node_seek(tree, node->next);
-                                        i = 0;
-                                }
-                        }
+/* latency in ns that a fraction p of the op calls stay within, -1 if none was timed */
+long bplus_stats_percentile(const struct bplus_stats *stats, int op, double p)
+{
+        int i;
+        long total = 0, seen = 0;
+        for (i = 0; i < BPLUS_STAT_BUCKETS; i++) {
+                total += stats->latency[op][i];
+        }
+        if (total == 0) {
+                return -1;
+        }
+
+        long rank = (long) (p * total);
+        for (i = 0; i < BPLUS_STAT_BUCKETS; i++) {
+                seen += stats->latency[op][i];
+                if (seen > rank) {
                         break;
-                } else {
-                        if (i >= 0) {
-                                node = node_seek(tree, sub(node)[i + 1]);
-                        } else  {
-                                i = -i - 1;
-                                node = node_seek(tree, sub(node)[i]);
-                        }
                 }
         }
+        return stats_bucket_max(i < BPLUS_STAT_BUCKETS ? i : BPLUS_STAT_BUCKETS - 1);
+}
 
-        return start;
+void bplus_tree_stats_dump(struct bplus_tree *tree)
+{
+        static const char *names[BPLUS_STAT_OPS] = { "get", "insert", "delete", "range" };
+        struct bplus_stats *st = &tree->stats;
+        int op;
+
+        printf("ops: get %ld insert %ld delete %ld range %ld, aio get %ld put %ld, bloom negatives %ld, finger hits %ld\n",
+               st->ops[BPLUS_STAT_GET], st->ops[BPLUS_STAT_INSERT], st->ops[BPLUS_STAT_DELETE],
+               st->ops[BPLUS_STAT_RANGE], st->aio_gets, st->aio_puts, st->bloom_negatives, st->finger_hits);
+        printf("io: node reads %ld (cache hits %ld misses %ld) writes %ld, bytes read %ld written %ld\n",
+               st->node_reads, st->cache_hits, st->cache_misses, st->node_writes,
+               st->bytes_read, st->bytes_written);
+        printf("leaf: splits %ld merges %ld shifts %ld appends %ld, non-leaf: splits %ld merges %ld shifts %ld\n",
+               st->leaf_splits, st->leaf_merges, st->leaf_shifts, st->appends,
+               st->non_leaf_splits, st->non_leaf_merges, st->non_leaf_shifts);
+        printf("blocks: appended %ld reused %ld freed %ld shadowed %ld\n",
+               st->blocks_appended, st->blocks_reused, st->blocks_freed, st->blocks_shadowed);
+        if (tree->buffer != NULL) {
+                printf("buffer: flushes %ld applied %ld\n", st->buffer_flushes, st->buffer_applied);
+        }
+        for (op = 0; op < BPLUS_STAT_OPS; op++) {
+                if (bplus_stats_percentile(st, op, 0.5) >= 0) {
+                        printf("%s latency: p50 %ld ns p99 %ld ns p999 %ld ns\n", names[op],
+                               bplus_stats_percentile(st, op, 0.5),
+                               bplus_stats_percentile(st, op, 0.99),
+                               bplus_stats_percentile(st, op, 0.999));
+                }
+        }
 }
 
 int bplus_open(char *filename)
@@ -1154,15 +4430,251 @@ static inline ssize_t offset_store(int fd, off_t offset)
         return write(fd, buf, sizeof(buf));
 }
 
+/* path of a metadata file kept next to the index file */
+static inline char *meta_filename(struct bplus_tree *tree, const char *suffix, char *path)
+{
+        strcpy(path, tree->filename);
+        return strcat(path, suffix);
+}
+
+/* Bloom filter file: root and file size of the tree it describes, the filter
+ * parameters and counters, then the raw bit array. A file that could not be
+ * written in full is removed rather than loaded half written. */
+static void bloom_store(struct bplus_tree *tree)
+{
+        struct bplus_bloom *bloom = tree->bloom;
+        char path[sizeof(tree->filename) + 8];
+        int fd = open(meta_filename(tree, ".bloom", path), O_CREAT | O_RDWR | O_TRUNC, 0644);
+        if (fd < 0) {
+                return;
+        }
+
+        off_t header[] = {
+                tree->root, tree->file_size, bloom->bits_per_key, bloom->hashes,
+                bloom->capacity, bloom->keys, bloom->stale, bloom->blocks,
+        };
+        int failed = 0;
+        size_t i;
+        for (i = 0; i < sizeof(header) / sizeof(header[0]); i++) {
+                if (offset_store(fd, header[i]) != ADDR_STR_WIDTH) {
+                        failed = 1;
+                }
+        }
+
+        size_t size = bloom->blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+        if (write(fd, bloom->bits, size) != (ssize_t) size) {
+                failed = 1;
+        }
+        close(fd);
+        if (failed) {
+                unlink(path);
+        }
+}
+
+/* load the filter saved by bloom_store, rebuild it if it does not match the tree */
+static void bloom_load(struct bplus_tree *tree)
+{
+        char path[sizeof(tree->filename) + 8];
+        int fd = open(meta_filename(tree, ".bloom", path), O_RDONLY);
+        if (fd < 0) {
+                return;
+        }
+
+        off_t root = offset_load(fd);
+        off_t file_size = offset_load(fd);
+        int bits_per_key = offset_load(fd);
+
+        if (root != tree->root || file_size != tree->file_size) {
+                close(fd);
+                bplus_tree_bloom_enable(tree, bits_per_key);
+                return;
+        }
+
+        struct bplus_bloom *bloom = (bplus_bloom*)calloc(1, sizeof(*bloom));
+        assert(bloom != NULL);
+        bloom->bits_per_key = bits_per_key;
+        bloom->hashes = offset_load(fd);
+        bloom->capacity = offset_load(fd);
+        bloom->keys = offset_load(fd);
+        bloom->stale = offset_load(fd);
+        bloom->blocks = offset_load(fd);
+
+        size_t size = bloom->blocks * BLOOM_BLOCK_WORDS * sizeof(uint64_t);
+        bloom->bits = (uint64_t *) malloc(size);
+        if (bloom->bits == NULL || read(fd, bloom->bits, size) != (ssize_t) size) {
+                free(bloom->bits);
+                free(bloom);
+                close(fd);
+                bplus_tree_bloom_enable(tree, bits_per_key);
+                return;
+        }
+        tree->bloom = bloom;
+        close(fd);
+}
+
+/* Page map file of a shadow paged tree: root and file size of the tree it
+ * belongs to, physical file size, number of logical blocks, then the physical
+ * offset of each of them. Blocks no logical one maps to are free. */
+static void cow_store(struct bplus_tree *tree)
+{
+        struct bplus_cow *cow = tree->cow;
+        char path[sizeof(tree->filename) + 8];
+        int fd = open(meta_filename(tree, ".map", path), O_CREAT | O_RDWR | O_TRUNC, 0644);
+        assert(fd >= 0);
+
+        off_t header[] = { tree->root, tree->file_size, cow->phys_size, cow->nr };
+        int failed = 0;
+        size_t i;
+        for (i = 0; i < sizeof(header) / sizeof(header[0]); i++) {
+                if (offset_store(fd, header[i]) != ADDR_STR_WIDTH) {
+                        failed = 1;
+                }
+        }
+        for (i = 0; i < (size_t) cow->nr; i++) {
+                if (offset_store(fd, cow->map[i]) != ADDR_STR_WIDTH) {
+                        failed = 1;
+                }
+        }
+        close(fd);
+        if (failed) {
+                fprintf(stderr, "Cannot write %s, the tree may not reopen!\n", path);
+        }
+}
+
+static int cow_load(struct bplus_tree *tree)
+{
+        char path[sizeof(tree->filename) + 8];
+        int fd = open(meta_filename(tree, ".map", path), O_RDONLY);
+        if (fd < 0) {
+                return -1;
+        }
+
+        struct bplus_cow *cow = cow_new();
+        off_t root = offset_load(fd);
+        off_t file_size = offset_load(fd);
+        cow->phys_size = offset_load(fd);
+        long i, nr = offset_load(fd);
+        if (root != tree->root || file_size != tree->file_size || nr < 0) {
+                close(fd);
+                free(cow);
+                return -1;
+        }
+
+        long blocks = cow->phys_size / _block_size;
+        char *used = (char *) calloc(blocks > 0 ? blocks : 1, 1);
+        assert(used != NULL);
+        if (nr > 0) {
+                cow_map_grow(cow, nr - 1);
+        }
+        for (i = 0; i < nr; i++) {
+                cow->map[i] = offset_load(fd);
+                if (cow->map[i] != INVALID_OFFSET) {
+                        assert(cow->map[i] / _block_size < blocks);
+                        used[cow->map[i] / _block_size] = 1;
+                }
+        }
+        for (i = blocks - 1; i >= 0; i--) {
+                if (!used[i]) {
+                        cow_block_free(cow, (off_t) i * _block_size);
+                }
+        }
+        free(used);
+        close(fd);
+        tree->cow = cow;
+        return 0;
+}
+
+static void cow_deinit(struct bplus_tree *tree)
+{
+        struct bplus_cow *cow = tree->cow;
+        struct list_head *pos, *n;
+        list_for_each_safe(pos, n, &cow->snapshots) {
+                list_del(pos);
+                snapshot_free(list_entry(pos, struct bplus_snapshot, link));
+        }
+        free(cow->map);
+        free(cow->born);
+        free(cow->free);
+        free(cow->retired);
+        free(cow);
+        tree->cow = NULL;
+}
+
+/* O_DIRECT needs buffers, offsets and sizes aligned to the logical block size
+ * of the device, st_blksize is a safe upper bound of it */
+static int direct_io_align(int fd)
+{
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_blksize <= 0) {
+                return 4096;
+        }
+        return st.st_blksize;
+}
+
+/* open the data file, with O_DIRECT the node caches must be aligned too */
+static int data_file_open(struct bplus_tree *tree, char *filename)
+{
+        if (!(tree->flags & BPLUS_TREE_DIRECT_IO)) {
+                tree->fd = bplus_open(filename);
+                /* node caches plus the block buffer of pack_buf() */
+                tree->caches = (char*)malloc(_node_size * MIN_CACHE_NUM + _block_size);
+                return tree->fd >= 0 ? 0 : -1;
+        }
+
+#ifdef O_DIRECT
+        tree->fd = open(filename, O_CREAT | O_RDWR | O_DIRECT, 0644);
+        if (tree->fd < 0) {
+                fprintf(stderr, "O_DIRECT is not supported for %s!\n", filename);
+                return -1;
+        }
+
+        int align = direct_io_align(tree->fd);
+        if (_block_size % align != 0) {
+                fprintf(stderr, "Block size must be a multiple of %d for O_DIRECT!\n", align);
+                return -1;
+        }
+
+        void *caches;
+        if (posix_memalign(&caches, align, _node_size * MIN_CACHE_NUM + _block_size) != 0) {
+                return -1;
+        }
+        tree->caches = (char *) caches;
+        return 0;
+#else
+        fprintf(stderr, "O_DIRECT is not supported on this platform!\n");
+        return -1;
+#endif
+}
+
+/* free a tree that failed to open, nothing is written back */
+static void tree_abort(struct bplus_tree *tree)
+{
+        struct list_head *pos, *n;
+        list_for_each_safe(pos, n, &tree->free_blocks) {
+                list_del(pos);
+                free(list_entry(pos, struct free_block, link));
+        }
+        if (tree->fd >= 0) {
+                bplus_close(tree->fd);
+        }
+        free(tree->caches);
+        free(tree);
+}
+
 /* init bplus tree
  * 1. set _block_size = block_size, _max_order = , _max_entries =  
  * 2.  */
 struct bplus_tree *bplus_tree_init(char *filename, int block_size)
+{
+        return bplus_tree_init_flags(filename, block_size, 0);
+}
+
+struct bplus_tree *bplus_tree_init_flags(char *filename, int block_size, int flags)
 {
         int i;
         struct bplus_node node;
 
-        if (strlen(filename) >= 1024) {
+        if (strlen(filename) >= sizeof(((struct bplus_tree *) 0)->filename)) {
                 fprintf(stderr, "Index file name too long!\n");
                 return NULL;
         }
@@ -1189,12 +4701,23 @@ struct bplus_tree *bplus_tree_init(char *filename, int block_size)
         assert(tree != NULL);
         list_init(&tree->free_blocks);
         strcpy(tree->filename, filename);
+        tree->flags = flags;
+        tree->fd = -1;
+        tree->tail = INVALID_OFFSET;
 
         /* load index boot file */
-        int fd = open(strcat(tree->filename, ".boot"), O_RDWR, 0644);
+        char path[sizeof(tree->filename) + 8];
+        int fd = open(meta_filename(tree, ".boot", path), O_RDWR, 0644);
         if (fd >= 0) {
                 tree->root = offset_load(fd);
-                _block_size = offset_load(fd);
+                off_t size = offset_load(fd);
+                _block_size = size & ~(BOOT_COMPRESS | BOOT_COW | BOOT_BUFFERED | BOOT_COUNTED);
+                tree->flags = (flags & ~(BPLUS_TREE_COMPRESS | BPLUS_TREE_COW | BPLUS_TREE_BUFFERED |
+                                         BPLUS_TREE_COUNTED)) |
+                              (size & BOOT_COMPRESS ? BPLUS_TREE_COMPRESS : 0) |
+                              (size & BOOT_COW ? BPLUS_TREE_COW : 0) |
+                              (size & BOOT_BUFFERED ? BPLUS_TREE_BUFFERED : 0) |
+                              (size & BOOT_COUNTED ? BPLUS_TREE_COUNTED : 0);
                 tree->file_size = offset_load(fd);
                 /* load free blocks */
                 while ((i = offset_load(fd)) != INVALID_OFFSET) {
@@ -1213,35 +4736,166 @@ struct bplus_tree *bplus_tree_init(char *filename, int block_size)
         /* set order and entries */
         _max_order = (_block_size - sizeof(node)) / (sizeof(bptree_key_t) + sizeof(off_t));
         _max_entries = (_block_size - sizeof(node)) / (sizeof(bptree_key_t) + sizeof(bptree_val_t));
+        _node_size = _block_size;
+        if (tree->flags & BPLUS_TREE_COMPRESS) {
+                /* a leaf of half the entries packs at any width, so a full
+                 * leaf splits into two that always fit. Both counts keep
+                 * data() and sub() 8-byte aligned */
+                int half = (_block_size - sizeof(struct bplus_packed_leaf)) / (sizeof(bptree_key_t) + sizeof(bptree_val_t));
+                _max_entries = 2 * half - 2;
+                _max_order = (_block_size - sizeof(struct bplus_packed) + sizeof(bptree_key_t)) /
+                             (sizeof(bptree_key_t) + sizeof(uint32_t));
+                _max_order -= (_max_order - 1) % 2;
+                _node_size = 2 * _block_size;
+                assert(sizeof(node) + _max_entries * (sizeof(bptree_key_t) + sizeof(bptree_val_t)) <= (size_t) _node_size);
+                assert(sizeof(node) + _max_order * (sizeof(bptree_key_t) + sizeof(off_t)) <= (size_t) _node_size);
+        }
+        if (tree->flags & BPLUS_TREE_COUNTED) {
+                if (tree->flags & (BPLUS_TREE_COMPRESS | BPLUS_TREE_BUFFERED)) {
+                        fprintf(stderr, "BPLUS_TREE_COUNTED does not go with packed or buffered nodes!\n");
+                        tree_abort(tree);
+                        return NULL;
+                }
+                /* a count next to each child ptr, odd order keeps both 8-byte aligned */
+                _max_order = (_block_size - sizeof(node) + sizeof(bptree_key_t)) /
+                             (sizeof(bptree_key_t) + sizeof(off_t) + sizeof(long));
+                _max_order -= (_max_order - 1) % 2;
+                if (_max_order <= 2) {
+                        fprintf(stderr, "block size is too small for counted nodes!\n");
+                        tree_abort(tree);
+                        return NULL;
+                }
+        }
+        if (tree->flags & BPLUS_TREE_BUFFERED) {
+                if (tree->flags & (BPLUS_TREE_COMPRESS | BPLUS_TREE_COW)) {
+                        fprintf(stderr, "BPLUS_TREE_BUFFERED does not go with packed or shadow paged nodes!\n");
+                        tree_abort(tree);
+                        return NULL;
+                }
+                /* fanout about the square root of the plain one (epsilon = 1/2),
+                 * odd so the child ptrs stay 8-byte aligned */
+                int order = 4;
+                while (order * order < _max_order) {
+                        order++;
+                }
+                _max_order = order + (order - 1) % 2;
+                _buffer_offset = (_max_order - 1) * sizeof(bptree_key_t) + _max_order * sizeof(off_t);
+                _buffer_max = (_block_size - (int) sizeof(node) - _buffer_offset - (int) sizeof(bptree_val_t)) /
+                              (int) sizeof(struct bplus_msg);
+                if (_buffer_max < 1) {
+                        fprintf(stderr, "block size is too small for buffered nodes!\n");
+                        tree_abort(tree);
+                        return NULL;
+                }
+                /* a child at the threshold still takes a whole batch */
+                _buffer_flush = (_buffer_max - 1) / 2;
+                printf("config buffered messages:%d flushed above:%d\n", _buffer_max, _buffer_flush);
+        }
         printf("config node order:%d and leaf entries:%d\n", _max_order, _max_entries);
 
-        /* init free node caches */
-        tree->caches = (char*)malloc(_block_size * MIN_CACHE_NUM);
+        /* open data file and init free node caches */
+        if (data_file_open(tree, filename) != 0) {
+                tree_abort(tree);
+                return NULL;
+        }
+
+        if (tree->flags & BPLUS_TREE_COW) {
+                if (fd < 0) {
+                        tree->cow = cow_new();
+                } else if (cow_load(tree) != 0) {
+                        fprintf(stderr, "Page map of %s is missing or stale!\n", filename);
+                        tree_abort(tree);
+                        return NULL;
+                }
+        }
+
+        if (tree->flags & BPLUS_TREE_BUFFERED) {
+                tree->buffer = (struct bplus_buffer *) calloc(1, sizeof(*tree->buffer));
+                assert(tree->buffer != NULL);
+                tree->buffer->batch = (struct bplus_msg *) malloc(2 * _buffer_max * sizeof(struct bplus_msg));
+                assert(tree->buffer->batch != NULL);
+                tree->buffer->merge = tree->buffer->batch + _buffer_max;
+        }
 
-        /* open data file */
-        tree->fd = bplus_open(filename);
-        assert(tree->fd >= 0);
+        /* a filter saved along with the boot file is only valid for that tree */
+        if (fd >= 0) {
+                bloom_load(tree);
+        }
         return tree;
 }
 
 /* store root offset, filesize, blocksize and freeblock offsets */
 void bplus_tree_deinit(struct bplus_tree *tree)
 {
-        int fd = open(tree->filename, O_CREAT | O_RDWR, 0644);
+        /* in-flight puts must land before the metadata is stored */
+        aio_deinit(tree);
+
+        char path[sizeof(tree->filename) + 8];
+        int fd = open(meta_filename(tree, ".boot", path), O_CREAT | O_RDWR | O_TRUNC, 0644);
         assert(fd >= 0);
-        assert(offset_store(fd, tree->root) == ADDR_STR_WIDTH);
-        assert(offset_store(fd, _block_size) == ADDR_STR_WIDTH);
-        assert(offset_store(fd, tree->file_size) == ADDR_STR_WIDTH);
+        off_t size = _block_size;
+        if (tree->flags & BPLUS_TREE_COMPRESS) {
+                size |= BOOT_COMPRESS;
+        }
+        if (tree->cow != NULL) {
+                size |= BOOT_COW;
+        }
+        if (tree->buffer != NULL) {
+                size |= BOOT_BUFFERED;
+        }
+        if (tree->flags & BPLUS_TREE_COUNTED) {
+                size |= BOOT_COUNTED;
+        }
+        int failed = offset_store(fd, tree->root) != ADDR_STR_WIDTH ||
+                     offset_store(fd, size) != ADDR_STR_WIDTH ||
+                     offset_store(fd, tree->file_size) != ADDR_STR_WIDTH;
 
         /* store free blocks in files for future reuse */
         struct list_head *pos, *n;
         list_for_each_safe(pos, n, &tree->free_blocks) {
                 list_del(pos);
                 struct free_block *block = list_entry(pos, struct free_block, link);
-                assert(offset_store(fd, block->offset) == ADDR_STR_WIDTH);
+                if (offset_store(fd, block->offset) != ADDR_STR_WIDTH) {
+                        failed = 1;
+                }
                 free(block);
         }
+        close(fd);
+        if (failed) {
+                fprintf(stderr, "Cannot write %s, the tree may not reopen!\n", path);
+        }
+
+        /* snapshots end with the tree, retired blocks are free once it is closed */
+        if (tree->cow != NULL) {
+                cow_store(tree);
+                cow_deinit(tree);
+        }
+
+        /* an outdated filter would hide keys, so never leave one behind */
+        if (tree->bloom != NULL) {
+                bloom_store(tree);
+                bplus_tree_bloom_disable(tree);
+        } else {
+                unlink(meta_filename(tree, ".bloom", path));
+        }
+
+        if (tree->buffer != NULL) {
+                free(tree->buffer->pending);
+                free(tree->buffer->batch);
+                free(tree->buffer->path);
+                free(tree->buffer);
+        }
 
+        bplus_tree_finger_disable(tree);
+        if (tree->bcache != NULL) {
+                struct bplus_block_cache *bc = tree->bcache;
+                free(bc->blocks);
+                free(bc->offsets);
+                free(bc->ref);
+                free(bc->buckets);
+                free(bc->chain);
+                free(bc);
+        }
         bplus_close(tree->fd);
         free(tree->caches);
         free(tree);
@@ -1348,8 +5002,276 @@ void bplus_tree_dump(struct bplus_tree *tree)
 }
 
 
+/* a finger enabled on a reopened tree has no path to reuse */
+static void test_finger_reopen(void)
+{
+        int i;
+        bplus_tree *tree = bplus_tree_init("bplustreefinger.txt", 1024);
+        bplus_tree_finger_enable(tree);
+        long data = bplus_tree_get(tree, 1);
+        assert(data == -1);
+        for (i = 1; i <= 10000; i++) {
+                bplus_tree_put(tree, i, i);
+        }
+        bplus_tree_deinit(tree);
+
+        tree = bplus_tree_init("bplustreefinger.txt", 1024);
+        bplus_tree_finger_enable(tree);
+        for (i = 1; i <= 10000; i += 7) {
+                data = bplus_tree_get(tree, i);
+                assert(data == i);
+        }
+        data = bplus_tree_get(tree, 10001);
+        assert(data == -1);
+        (void) data;
+        bplus_tree_deinit(tree);
+        unlink("bplustreefinger.txt");
+        unlink("bplustreefinger.txt.boot");
+}
+
+#define TEST_KEYS 20000
+
+/* the index file and the metadata files kept next to it */
+static void test_files_remove(const char *filename)
+{
+        const char *suffixes[] = { "", ".boot", ".map", ".bloom" };
+        char path[1024];
+        size_t i;
+        for (i = 0; i < sizeof(suffixes) / sizeof(suffixes[0]); i++) {
+                snprintf(path, sizeof(path), "%s%s", filename, suffixes[i]);
+                unlink(path);
+        }
+}
+
+/* n random puts and deletes, model[key] follows with the data of each key
+ * and 0 for a missing one. A put does not replace the data of a key */
+static void test_random_puts(struct bplus_tree *tree, long *model, int n)
+{
+        int i;
+        for (i = 0; i < n; i++) {
+                int k = rand() % TEST_KEYS;
+                if (rand() % 3) {
+                        long data = rand() % 100000 + 1;
+                        bplus_tree_put(tree, k, data);
+                        if (model[k] == 0) {
+                                model[k] = data;
+                        }
+                } else {
+                        bplus_tree_put(tree, k, 0);
+                        model[k] = 0;
+                }
+        }
+}
+
+/* every key has the data of the model, or is missing like there */
+static void test_compare(struct bplus_tree *tree, const long *model)
+{
+        int k;
+        for (k = -1; k <= TEST_KEYS; k++) {
+                long data = bplus_tree_get(tree, k);
+                assert(data == (k >= 0 && k < TEST_KEYS && model[k] ? model[k] : -1));
+                (void) data;
+        }
+}
+
+/* a snapshot keeps the keys it was taken on while the live tree moves on,
+ * and the live tree reopens with its page map */
+static void test_cow_snapshot(void)
+{
+        static long live[TEST_KEYS], pinned[TEST_KEYS];
+        int k;
+        bplus_tree *tree = bplus_tree_init_flags("bplustreecow.txt", 1024, BPLUS_TREE_COW);
+        test_random_puts(tree, live, 30000);
+        memcpy(pinned, live, sizeof(live));
+
+        struct bplus_snapshot *snap = bplus_tree_snapshot(tree);
+        assert(snap != NULL);
+        test_random_puts(tree, live, 30000);
+        test_compare(tree, live);
+        for (k = 0; k < TEST_KEYS; k++) {
+                long data = bplus_snapshot_get(snap, k);
+                assert(data == (pinned[k] ? pinned[k] : -1));
+                (void) data;
+        }
+        bplus_snapshot_release(snap);
+
+        /* the next put reclaims the blocks only the snapshot saw */
+        test_random_puts(tree, live, 1000);
+        test_compare(tree, live);
+        bplus_tree_deinit(tree);
+
+        tree = bplus_tree_init("bplustreecow.txt", 1024);
+        assert(tree->cow != NULL);
+        test_compare(tree, live);
+        bplus_tree_deinit(tree);
+        test_files_remove("bplustreecow.txt");
+}
+
+/* buffered puts sit in the non-leaf nodes until flushed down, gets and range
+ * gets must see through them before and after a reopen */
+static void test_buffered(void)
+{
+        static long model[TEST_KEYS];
+        int i, round;
+        bplus_tree *tree = bplus_tree_init_flags("bplustreebuffered.txt", 1024, BPLUS_TREE_BUFFERED);
+        for (round = 0; round < 3; round++) {
+                test_random_puts(tree, model, 30000);
+                test_compare(tree, model);
+                for (i = 0; i < 2000; i++) {
+                        int a = rand() % TEST_KEYS, b = a + rand() % 100, k;
+                        long expect = -1;
+                        for (k = b < TEST_KEYS ? b : TEST_KEYS - 1; k >= a; k--) {
+                                if (model[k]) {
+                                        expect = model[k];
+                                        break;
+                                }
+                        }
+                        long data = bplus_tree_get_range(tree, a, b);
+                        assert(data == expect);
+                        (void) data;
+                        (void) expect;
+                }
+                bplus_tree_deinit(tree);
+                tree = bplus_tree_init("bplustreebuffered.txt", 1024);
+                assert(tree->buffer != NULL);
+                test_compare(tree, model);
+        }
+        bplus_tree_deinit(tree);
+        test_files_remove("bplustreebuffered.txt");
+}
+
+/* rank and select of a counted tree are each other's inverse and agree with
+ * the model, through single puts and a sorted merge with deletes */
+static void test_counted(void)
+{
+        static long model[TEST_KEYS];
+        static long below[TEST_KEYS + 1];
+        bptree_key_t keys[500];
+        bptree_val_t data[500];
+        int i, k, n, round;
+        bplus_tree *tree = bplus_tree_init_flags("bplustreecounted.txt", 1024, BPLUS_TREE_COUNTED);
+        for (round = 0; round < 4; round++) {
+                test_random_puts(tree, model, 20000);
+                for (k = rand() % 100, n = 0; k < TEST_KEYS && n < 500; k += 1 + rand() % 40, n++) {
+                        keys[n] = k;
+                        data[n] = rand() % 2 ? rand() % 100000 + 1 : 0;
+                        model[k] = data[n];
+                }
+                bplus_tree_merge(tree, keys, data, n);
+
+                for (k = 0; k < TEST_KEYS; k++) {
+                        below[k + 1] = below[k] + (model[k] != 0);
+                }
+                for (k = 0; k < TEST_KEYS; k++) {
+                        long rank = bplus_tree_rank(tree, k);
+                        assert(rank == below[k]);
+                        if (model[k]) {
+                                bptree_key_t key;
+                                bptree_val_t val;
+                                int ret = bplus_tree_select(tree, rank, &key, &val);
+                                assert(ret == 0 && key == k && val == model[k]);
+                                (void) ret;
+                        }
+                }
+                for (i = 0; i < 1000; i++) {
+                        int a = rand() % TEST_KEYS, b = a + rand() % 3000;
+                        long count = bplus_tree_count_range(tree, b, a);
+                        assert(count == below[b < TEST_KEYS ? b + 1 : TEST_KEYS] - below[a]);
+                        (void) count;
+                }
+                long ret = bplus_tree_select(tree, below[TEST_KEYS], NULL, NULL);
+                assert(ret == -1);
+                (void) ret;
+
+                bplus_tree_deinit(tree);
+                tree = bplus_tree_init("bplustreecounted.txt", 1024);
+                assert(tree->flags & BPLUS_TREE_COUNTED);
+        }
+        bplus_tree_deinit(tree);
+        test_files_remove("bplustreecounted.txt");
+}
+
+/* delete_range removes exactly [key1, key2] in either order: the keys right
+ * outside stay, ranges past either end and empty ranges are fine, plain and
+ * counted trees alike */
+static void test_delete_range(void)
+{
+        static long model[TEST_KEYS];
+        int flags[] = { 0, BPLUS_TREE_COUNTED };
+        int f, i, k;
+        for (f = 0; f < 2; f++) {
+                bplus_tree *tree = bplus_tree_init_flags("bplustreerange.txt", 1024, flags[f]);
+                memset(model, 0, sizeof(model));
+                for (k = 0; k < TEST_KEYS; k += 2) {
+                        bplus_tree_put(tree, k, k + 1);
+                        model[k] = k + 1;
+                }
+                for (i = 0; i < 200; i++) {
+                        int a, b;
+                        if (i % 20 == 0) {
+                                /* fill some of the holes again */
+                                for (k = 0; k < TEST_KEYS; k += 2) {
+                                        if (model[k] == 0 && rand() % 4 == 0) {
+                                                bplus_tree_put(tree, k, k + 1);
+                                                model[k] = k + 1;
+                                        }
+                                }
+                        }
+                        switch (i % 4) {
+                        case 0:
+                                /* both ends on stored keys */
+                                a = rand() % (TEST_KEYS / 2) * 2;
+                                b = a + rand() % 50 * 2;
+                                break;
+                        case 1:
+                                /* both ends between keys, maybe nothing inside */
+                                a = rand() % (TEST_KEYS / 2) * 2 + 1;
+                                b = a + rand() % 3 * 2;
+                                break;
+                        case 2:
+                                /* past the low end */
+                                a = -10 - rand() % 10;
+                                b = rand() % 20;
+                                break;
+                        default:
+                                /* past the high end, or a wide range */
+                                a = TEST_KEYS - rand() % 40;
+                                b = rand() % 8 ? TEST_KEYS + 10 : a - rand() % (TEST_KEYS / 4);
+                                break;
+                        }
+                        bplus_tree_delete_range(tree, i % 2 ? b : a, i % 2 ? a : b);
+                        int lo = a <= b ? a : b, hi = a <= b ? b : a;
+                        for (k = lo > 0 ? lo : 0; k <= hi && k < TEST_KEYS; k++) {
+                                model[k] = 0;
+                        }
+                        long data = bplus_tree_get(tree, lo - 1);
+                        assert(data == (lo - 1 >= 0 && lo - 1 < TEST_KEYS && model[lo - 1] ? model[lo - 1] : -1));
+                        data = bplus_tree_get(tree, hi + 1);
+                        assert(data == (hi + 1 >= 0 && hi + 1 < TEST_KEYS && model[hi + 1] ? model[hi + 1] : -1));
+                        (void) data;
+                        if (flags[f] & BPLUS_TREE_COUNTED) {
+                                long count = bplus_tree_count_range(tree, lo, hi);
+                                assert(count == 0);
+                                (void) count;
+                        }
+                }
+                test_compare(tree, model);
+                bplus_tree_delete_range(tree, INT_MIN, INT_MAX);
+                memset(model, 0, sizeof(model));
+                test_compare(tree, model);
+                bplus_tree_deinit(tree);
+                test_files_remove("bplustreerange.txt");
+        }
+}
+
 int main(){
 
+    test_finger_reopen();
+    test_cow_snapshot();
+    test_buffered();
+    test_counted();
+    test_delete_range();
+
     bplus_tree *tree;
     tree = bplus_tree_init("bplustreefile.txt", 1024);
 
@@ -1,6 +1,7 @@
 #ifndef _BPLUS_TREE_H
 #define _BPLUS_TREE_H
 
+#include <stdint.h>
 #include <unistd.h>
 
 /* 5 node caches are needed at least for self, left and right sibling, sibling
@@ -123,6 +124,198 @@ typedef struct free_block {
         off_t offset;
 } free_block;
 
+/* blocked bloom filter over all keys of the tree, each key sets its bits in one
+ * 512-bit (cache line) block so a probe touches a single line */
+struct bplus_bloom {
+        uint64_t *bits;
+        /* number of 512-bit blocks */
+        long blocks;
+        /* bits probed per key */
+        int hashes;
+        int bits_per_key;
+        /* keys the filter was sized for, it is rebuilt larger when exceeded */
+        long capacity;
+        /* keys added since last rebuild */
+        long keys;
+        /* keys deleted since last rebuild, their bits are still set */
+        long stale;
+};
+
+enum {
+        BPLUS_REQ_GET,
+        BPLUS_REQ_PUT,
+};
+
+/* an asynchronous get or put, its callback is run by bplus_tree_poll() */
+struct bplus_request {
+        /* BPLUS_REQ_GET or BPLUS_REQ_PUT */
+        int op;
+        bptree_key_t key;
+        /* put data, 0 deletes the key like bplus_tree_put */
+        bptree_val_t data;
+        /* ret is the value (-1 if not found) for get, 0 or -1 for put */
+        void (*callback)(struct bplus_request *req, long ret);
+        void *arg;
+
+        /* private to the tree */
+        struct list_head link;
+        /* block being read into buf */
+        off_t offset;
+        char *buf;
+        /* tree epoch the descent started at */
+        unsigned long epoch;
+        long ret;
+};
+
+/* in-flight request state, see bplustree.cc */
+struct bplus_aio;
+
+/* flags of bplus_tree_init_flags */
+enum {
+        /* bypass the page cache, blocks are cached by the tree only */
+        BPLUS_TREE_DIRECT_IO = 1,
+        /* frame-of-reference packed nodes, about twice the leaf entries per
+         * block. Only honoured for a new tree, an existing one keeps the
+         * format recorded in its boot file */
+        BPLUS_TREE_COMPRESS = 2,
+        /* shadow paging, nodes are mapped to physical blocks and a block a
+         * snapshot can see is never overwritten. Only honoured for a new tree
+         * like BPLUS_TREE_COMPRESS */
+        BPLUS_TREE_COW = 4,
+        /* write-optimized (B-epsilon) nodes: a non-leaf node keeps about the
+         * square root of the usual fanout and buffers puts in the rest of its
+         * block, a full buffer goes one level down in a batch. Puts return 0
+         * as their outcome is only known once they reach a leaf, and empty
+         * leaves are freed instead of merged. Only honoured for a new tree
+         * and not together with BPLUS_TREE_COMPRESS or BPLUS_TREE_COW */
+        BPLUS_TREE_BUFFERED = 8,
+        /* non-leaf nodes keep the number of keys below each child ptr, for
+         * bplus_tree_count_range, bplus_tree_rank and bplus_tree_select in one
+         * descent. Costs some fanout and a write per level on every put. Only
+         * honoured for a new tree and not together with BPLUS_TREE_COMPRESS
+         * or BPLUS_TREE_BUFFERED */
+        BPLUS_TREE_COUNTED = 16,
+};
+
+/* flush state of a BPLUS_TREE_BUFFERED tree, see bplustree.cc */
+struct bplus_buffer;
+
+/* page map and reclaim state of a BPLUS_TREE_COW tree, see bplustree.cc */
+struct bplus_cow;
+
+/* path of the last get, see bplustree.cc */
+struct bplus_finger;
+
+/* a consistent read-only view of a BPLUS_TREE_COW tree. It is taken and freed
+ * by the thread owning the tree, lookups on it need no lock and may run in
+ * any one thread while puts go on */
+struct bplus_snapshot {
+        struct bplus_tree *tree;
+        int fd;
+        int flags;
+        off_t root;
+        /* generation of the tree the snapshot was taken at */
+        unsigned long gen;
+        /* copy of the page map, logical block -> physical offset */
+        off_t *map;
+        long nr;
+        /* block buffer and decoded node of the reader */
+        char *buf;
+        char *node;
+        /* set by bplus_snapshot_release, the owner reclaims it on its next put */
+        int released;
+        struct list_head link;
+};
+
+/* descending cursor over a key range, see bplus_tree_cursor_desc */
+struct bplus_cursor {
+        struct bplus_tree *tree;
+        /* keys still to return */
+        bptree_key_t min;
+        bptree_key_t max;
+        int done;
+        /* copy of the leaf being walked and its entry returned next, NULL for
+         * a BPLUS_TREE_BUFFERED tree which looks every key up from the root */
+        struct bplus_node *leaf;
+        int index;
+        /* tree epoch of the copy, after a put the cursor seeks max again */
+        unsigned long epoch;
+        /* file range last advised for readahead */
+        off_t ra_from;
+        off_t ra_to;
+};
+
+/* fixed-size write-through cache of blocks, CLOCK replacement */
+struct bplus_block_cache {
+        int nr;
+        /* nr blocks of _block_size */
+        char *blocks;
+        /* offset held by each slot, INVALID_OFFSET if empty */
+        off_t *offsets;
+        /* CLOCK reference bits and hand */
+        unsigned char *ref;
+        int hand;
+        /* offset hash buckets and per-slot chain links, -1 terminated */
+        int *buckets;
+        int *chain;
+        int mask;
+};
+
+/* operations timed by the latency histograms */
+enum {
+        BPLUS_STAT_GET,
+        BPLUS_STAT_INSERT,
+        BPLUS_STAT_DELETE,
+        BPLUS_STAT_RANGE,
+        BPLUS_STAT_OPS,
+};
+
+/* log-linear latency buckets, 8 per power of two nanoseconds up to 2^40 */
+#define BPLUS_STAT_SUB_BUCKETS 8
+#define BPLUS_STAT_BUCKETS ((40 - 2) * BPLUS_STAT_SUB_BUCKETS)
+
+/* counters of a tree, plain increments so they can stay on all the time */
+struct bplus_stats {
+        /* synchronous calls, indexed by BPLUS_STAT_* */
+        long ops[BPLUS_STAT_OPS];
+        /* requests through bplus_tree_submit */
+        long aio_gets;
+        long aio_puts;
+        /* gets answered by the bloom filter alone */
+        long bloom_negatives;
+        /* gets that started below the root from the last path */
+        long finger_hits;
+        /* blocks asked for and written, bytes moved by pread/pwrite */
+        long node_reads;
+        long node_writes;
+        long bytes_read;
+        long bytes_written;
+        /* node reads served by the block cache or by the file, every read
+         * is a miss while the cache is disabled */
+        long cache_hits;
+        long cache_misses;
+        long leaf_splits;
+        long non_leaf_splits;
+        long leaf_merges;
+        long non_leaf_merges;
+        long leaf_shifts;
+        long non_leaf_shifts;
+        /* inserts that went to the rightmost leaf without a descent */
+        long appends;
+        /* new nodes taken from the free list or appended to the file */
+        long blocks_reused;
+        long blocks_appended;
+        long blocks_freed;
+        /* writes redirected to a new block because a snapshot sees the old one */
+        long blocks_shadowed;
+        /* batches a full buffer sent one level down, and buffered or merged
+         * puts that reached a leaf */
+        long buffer_flushes;
+        long buffer_applied;
+        /* latency histograms, filled only while bplus_tree_stats_latency is on */
+        long latency[BPLUS_STAT_OPS][BPLUS_STAT_BUCKETS];
+};
+
 struct bplus_tree {
         char *caches;
         /* a flag marks if cache[i] is used */
@@ -131,6 +324,8 @@ struct bplus_tree {
         char filename[1024]; 
         /* current file discriptor */
         int fd;
+        /* BPLUS_TREE_* flags the tree was opened with */
+        int flags;
         /* layer number? */
         int level;
         /* root offset in the file */
@@ -138,14 +333,64 @@ struct bplus_tree {
         off_t file_size;
         /* a list contain free blocks in the file (this block can be use again) */
         struct list_head free_blocks;
+        /* optional key filter for negative lookups, NULL when disabled */
+        struct bplus_bloom *bloom;
+        /* bumped by every put that changed the tree, a request whose descent
+         * spans a change restarts from the root */
+        unsigned long epoch;
+        /* rightmost leaf, a key above all others is inserted there without a
+         * descent. INVALID_OFFSET until an insert reaches it */
+        off_t tail;
+        /* async request engine, NULL until bplus_tree_aio_init */
+        struct bplus_aio *aio;
+        /* block cache, NULL until bplus_tree_cache_enable */
+        struct bplus_block_cache *bcache;
+        /* page map, NULL unless BPLUS_TREE_COW */
+        struct bplus_cow *cow;
+        /* message buffers, NULL unless BPLUS_TREE_BUFFERED */
+        struct bplus_buffer *buffer;
+        /* last get path, NULL until bplus_tree_finger_enable */
+        struct bplus_finger *finger;
+        /* time the synchronous calls into stats.latency */
+        int timing;
+        struct bplus_stats stats;
 };
 
 void bplus_tree_dump(struct bplus_tree *tree);
 long bplus_tree_get(struct bplus_tree *tree, bptree_key_t key);
 int bplus_tree_put(struct bplus_tree *tree, bptree_key_t key, long data);
+int bplus_tree_merge(struct bplus_tree *tree, const bptree_key_t *keys, const bptree_val_t *data, int n);
+int bplus_tree_delete_range(struct bplus_tree *tree, bptree_key_t key1, bptree_key_t key2);
 long bplus_tree_get_range(struct bplus_tree *tree, bptree_key_t key1, bptree_key_t key2);
+long bplus_tree_get_range_desc(struct bplus_tree *tree, bptree_key_t key1, bptree_key_t key2, long limit,
+                               bptree_key_t *keys, bptree_val_t *data);
+long bplus_tree_count_range(struct bplus_tree *tree, bptree_key_t key1, bptree_key_t key2);
+long bplus_tree_rank(struct bplus_tree *tree, bptree_key_t key);
+int bplus_tree_select(struct bplus_tree *tree, long k, bptree_key_t *key, bptree_val_t *data);
+struct bplus_cursor *bplus_tree_cursor_desc(struct bplus_tree *tree, bptree_key_t key1, bptree_key_t key2);
+int bplus_cursor_prev(struct bplus_cursor *cur, bptree_key_t *key, bptree_val_t *data);
+void bplus_cursor_free(struct bplus_cursor *cur);
 struct bplus_tree *bplus_tree_init(char *filename, int block_size);
+struct bplus_tree *bplus_tree_init_flags(char *filename, int block_size, int flags);
 void bplus_tree_deinit(struct bplus_tree *tree);
+int bplus_tree_bloom_enable(struct bplus_tree *tree, int bits_per_key);
+void bplus_tree_bloom_disable(struct bplus_tree *tree);
+int bplus_tree_finger_enable(struct bplus_tree *tree);
+void bplus_tree_finger_disable(struct bplus_tree *tree);
+int bplus_tree_cache_enable(struct bplus_tree *tree, int nr_blocks);
+long bplus_tree_defrag(struct bplus_tree *tree, int levels);
+int bplus_tree_aio_init(struct bplus_tree *tree, int depth);
+int bplus_tree_submit(struct bplus_tree *tree, struct bplus_request *req);
+int bplus_tree_poll(struct bplus_tree *tree, int wait);
+struct bplus_snapshot *bplus_tree_snapshot(struct bplus_tree *tree);
+void bplus_snapshot_release(struct bplus_snapshot *snap);
+long bplus_snapshot_get(struct bplus_snapshot *snap, bptree_key_t key);
+long bplus_snapshot_get_range(struct bplus_snapshot *snap, bptree_key_t key1, bptree_key_t key2);
+void bplus_tree_stats(struct bplus_tree *tree, struct bplus_stats *stats);
+void bplus_tree_stats_reset(struct bplus_tree *tree);
+void bplus_tree_stats_latency(struct bplus_tree *tree, int enable);
+long bplus_stats_percentile(const struct bplus_stats *stats, int op, double p);
+void bplus_tree_stats_dump(struct bplus_tree *tree);
 int bplus_open(char *filename);
 void bplus_close(int fd);
 
@@ -0,0 +1,976 @@
+/*
+ * Disk B+ tree with key/value types and block size fixed at compile time.
+ *
+ * Same algorithms and file layout idea as bplustree.cc, but the node layout
+ * (key/data/child offsets, fanout) is constexpr, so the accessors and search
+ * loops are resolved by the compiler, and every tree object carries its own
+ * geometry instead of the per-process _block_size/_max_order globals.
+ *
+ * Key must be trivially copyable and ordered by operator<, Val trivially
+ * copyable. Composite keys are plain structs with an operator<.
+ */
+
+#ifndef _BPLUS_TREE_HPP
+#define _BPLUS_TREE_HPP
+
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <list>
+#include <type_traits>
+#include <fcntl.h>
+#include <unistd.h>
+
+namespace bplustree{
+
+template<typename Key, typename Val, size_t BlockSize = 4096>
+class BPlusTree{
+  static_assert(std::is_trivially_copyable<Key>::value, "Key is stored as raw bytes");
+  static_assert(std::is_trivially_copyable<Val>::value, "Val is stored as raw bytes");
+  static_assert((BlockSize & (BlockSize - 1)) == 0, "BlockSize must be pow of 2");
+
+  struct Node{
+    off_t self;                       //offset in the file of this node
+    off_t parent;
+    off_t prev;                       //left sibling
+    off_t next;                       //right sibling
+    int type;                         //LEAF or NON_LEAF
+    int children;                     //entries of a leaf, branches of a non-leaf
+  };
+
+  enum { LEAF, NON_LEAF = 1 };
+  enum { LEFT_SIBLING, RIGHT_SIBLING = 1 };
+  /* 5 node caches: self, left and right sibling, sibling of sibling, parent */
+  enum { CACHE_NUM = 5 };
+
+  static constexpr off_t INVALID_OFFSET = 0xdeadbeef;
+
+  static constexpr size_t alignUp(size_t n, size_t a) { return (n + a - 1) / a * a; }
+
+  /* node info + keys + child ptr for non-leaf, node info + keys + data for leaf,
+   * one alignment slack is reserved for the second array */
+  static constexpr size_t KEY_OFFSET = alignUp(sizeof(Node), alignof(Key));
+public:
+  static constexpr int MAX_ORDER =
+      (BlockSize - KEY_OFFSET - alignof(off_t)) / (sizeof(Key) + sizeof(off_t));
+  static constexpr int MAX_ENTRIES =
+      (BlockSize - KEY_OFFSET - alignof(Val)) / (sizeof(Key) + sizeof(Val));
+private:
+  static constexpr size_t SUB_OFFSET = alignUp(KEY_OFFSET + (MAX_ORDER - 1) * sizeof(Key), alignof(off_t));
+  static constexpr size_t DATA_OFFSET = alignUp(KEY_OFFSET + MAX_ENTRIES * sizeof(Key), alignof(Val));
+
+  static_assert(MAX_ORDER > 2, "block size is too small for one node");
+  static_assert(SUB_OFFSET + MAX_ORDER * sizeof(off_t) <= BlockSize, "non-leaf overflows the block");
+  static_assert(DATA_OFFSET + MAX_ENTRIES * sizeof(Val) <= BlockSize, "leaf overflows the block");
+
+  static Key *key(Node *node) { return reinterpret_cast<Key *>(reinterpret_cast<char *>(node) + KEY_OFFSET); }
+  static Val *data(Node *node) { return reinterpret_cast<Val *>(reinterpret_cast<char *>(node) + DATA_OFFSET); }
+  static off_t *sub(Node *node) { return reinterpret_cast<off_t *>(reinterpret_cast<char *>(node) + SUB_OFFSET); }
+  static bool isLeaf(const Node *node) { return node->type == LEAF; }
+
+public:
+  BPlusTree(const char *filename);
+  ~BPlusTree();
+
+  bool get(const Key &k, Val &v);
+  bool insert(const Key &k, const Val &v);
+  bool del(const Key &k);
+  /* call fn(key, val) for every entry in [lo, hi], return the number of entries */
+  template<typename F>
+  size_t range(const Key &lo, const Key &hi, F fn);
+
+  int level() const { return _level; }
+
+private:
+  BPlusTree(const BPlusTree &);
+  BPlusTree &operator=(const BPlusTree &);
+
+  int _keyBinarySearch(Node *node, const Key &target);
+  int _parentKeyIndex(Node *parent, const Key &k);
+
+  Node *_cacheRefer();
+  void _cacheDefer(Node *node);
+  Node *_nodeNew(int type);
+  Node *_nodeFetch(off_t offset);
+  Node *_nodeSeek(off_t offset);
+  void _nodeFlush(Node *node);
+  off_t _newNodeAppend(Node *node);
+  void _nodeDelete(Node *node, Node *left, Node *right);
+  void _subNodeUpdate(Node *parent, int index, Node *sub_node);
+  void _subNodeFlush(Node *parent, off_t sub_offset);
+
+  void _leftNodeAdd(Node *node, Node *left);
+  void _rightNodeAdd(Node *node, Node *right);
+  int _parentNodeBuild(Node *l_ch, Node *r_ch, const Key &k);
+  Key _nonLeafSplitLeft(Node *node, Node *left, Node *l_ch, Node *r_ch, const Key &k, int insert);
+  Key _nonLeafSplitRight1(Node *node, Node *right, Node *l_ch, Node *r_ch, const Key &k, int insert);
+  Key _nonLeafSplitRight2(Node *node, Node *right, Node *l_ch, Node *r_ch, const Key &k, int insert);
+  void _nonLeafSimpleInsert(Node *node, Node *l_ch, Node *r_ch, const Key &k, int insert);
+  int _nonLeafInsert(Node *node, Node *l_ch, Node *r_ch, const Key &k);
+  Key _leafSplitLeft(Node *leaf, Node *left, const Key &k, const Val &v, int insert);
+  Key _leafSplitRight(Node *leaf, Node *right, const Key &k, const Val &v, int insert);
+  void _leafSimpleInsert(Node *leaf, const Key &k, const Val &v, int insert);
+  int _leafInsert(Node *leaf, const Key &k, const Val &v);
+
+  int _siblingSelect(Node *l_sib, Node *r_sib, Node *parent, int i);
+  void _nonLeafShiftFromLeft(Node *node, Node *left, Node *parent, int parent_key_index, int remove);
+  void _nonLeafMergeIntoLeft(Node *node, Node *left, Node *parent, int parent_key_index, int remove);
+  void _nonLeafShiftFromRight(Node *node, Node *right, Node *parent, int parent_key_index);
+  void _nonLeafMergeFromRight(Node *node, Node *right, Node *parent, int parent_key_index);
+  void _nonLeafSimpleRemove(Node *node, int remove);
+  void _nonLeafRemove(Node *node, int remove);
+  void _leafShiftFromLeft(Node *leaf, Node *left, Node *parent, int parent_key_index, int remove);
+  void _leafMergeIntoLeft(Node *leaf, Node *left, int remove);
+  void _leafShiftFromRight(Node *leaf, Node *right, Node *parent, int parent_key_index);
+  void _leafMergeFromRight(Node *leaf, Node *right);
+  void _leafSimpleRemove(Node *leaf, int remove);
+  void _leafRemove(Node *leaf, int remove);
+
+private:
+  char _bootname[1024];
+  int _fd;
+  int _level;
+  off_t _root;
+  off_t _file_size;
+  std::list<off_t> _free_blocks;
+  bool _used[CACHE_NUM];
+  alignas(64) char _caches[CACHE_NUM][BlockSize];
+};
+
+/* binary search target.
+ * If target exist, return its index (non negtive) else return -lowerbound - 1(negtive) */
+template<typename Key, typename Val, size_t BlockSize>
+inline int BPlusTree<Key, Val, BlockSize>::_keyBinarySearch(Node *node, const Key &target) {
+    const Key *arr = key(node);
+    int len = isLeaf(node) ? node->children : node->children - 1;
+    int low = -1;
+    int high = len;
+
+    while (low + 1 < high) {
+        int mid = low + (high - low) / 2;
+        if (arr[mid] < target) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+
+    if (high >= len || target < arr[high]) {
+        return -high - 1;
+    }
+    return high;
+}
+
+/* return the index of last entry <= key */
+template<typename Key, typename Val, size_t BlockSize>
+inline int BPlusTree<Key, Val, BlockSize>::_parentKeyIndex(Node *parent, const Key &k) {
+    int index = _keyBinarySearch(parent, k);
+    return index >= 0 ? index : -index - 2;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+typename BPlusTree<Key, Val, BlockSize>::Node *BPlusTree<Key, Val, BlockSize>::_cacheRefer() {
+    for (int i = 0; i < CACHE_NUM; i++) {
+        if (!_used[i]) {
+            _used[i] = true;
+            return reinterpret_cast<Node *>(_caches[i]);
+        }
+    }
+    /* every cache is held, a walk borrowed more than CACHE_NUM nodes */
+    fprintf(stderr, "Node caches exhausted!\n");
+    abort();
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+inline void BPlusTree<Key, Val, BlockSize>::_cacheDefer(Node *node) {
+    _used[(reinterpret_cast<char *>(node) - _caches[0]) / BlockSize] = false;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+typename BPlusTree<Key, Val, BlockSize>::Node *BPlusTree<Key, Val, BlockSize>::_nodeNew(int type) {
+    Node *node = _cacheRefer();
+    node->self = INVALID_OFFSET;
+    node->parent = INVALID_OFFSET;
+    node->prev = INVALID_OFFSET;
+    node->next = INVALID_OFFSET;
+    node->type = type;
+    node->children = 0;
+    return node;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+typename BPlusTree<Key, Val, BlockSize>::Node *BPlusTree<Key, Val, BlockSize>::_nodeFetch(off_t offset) {
+    if (offset == INVALID_OFFSET) {
+        return NULL;
+    }
+    Node *node = _cacheRefer();
+    ssize_t len = pread(_fd, node, BlockSize, offset);
+    assert(len == (ssize_t) BlockSize);
+    (void) len;
+    return node;
+}
+
+/* unlike fetch, the buffer is not marked used */
+template<typename Key, typename Val, size_t BlockSize>
+typename BPlusTree<Key, Val, BlockSize>::Node *BPlusTree<Key, Val, BlockSize>::_nodeSeek(off_t offset) {
+    if (offset == INVALID_OFFSET) {
+        return NULL;
+    }
+    for (int i = 0; i < CACHE_NUM; i++) {
+        if (!_used[i]) {
+            ssize_t len = pread(_fd, _caches[i], BlockSize, offset);
+            assert(len == (ssize_t) BlockSize);
+            (void) len;
+            return reinterpret_cast<Node *>(_caches[i]);
+        }
+    }
+    /* every cache is held, a walk borrowed more than CACHE_NUM nodes */
+    fprintf(stderr, "Node caches exhausted!\n");
+    abort();
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+inline void BPlusTree<Key, Val, BlockSize>::_nodeFlush(Node *node) {
+    if (node != NULL) {
+        ssize_t len = pwrite(_fd, node, BlockSize, node->self);
+        assert(len == (ssize_t) BlockSize);
+        (void) len;
+        _cacheDefer(node);
+    }
+}
+
+/* free blocks are used first */
+template<typename Key, typename Val, size_t BlockSize>
+off_t BPlusTree<Key, Val, BlockSize>::_newNodeAppend(Node *node) {
+    if (_free_blocks.empty()) {
+        node->self = _file_size;
+        _file_size += BlockSize;
+    } else {
+        node->self = _free_blocks.front();
+        _free_blocks.pop_front();
+    }
+    return node->self;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+void BPlusTree<Key, Val, BlockSize>::_nodeDelete(Node *node, Node *left, Node *right) {
+    if (left != NULL) {
+        if (right != NULL) {
+            left->next = right->self;
+            right->prev = left->self;
+            _nodeFlush(right);
+        } else {
+            left->next = INVALID_OFFSET;
+        }
+        _nodeFlush(left);
+    } else if (right != NULL) {
+        right->prev = INVALID_OFFSET;
+        _nodeFlush(right);
+    }
+
+    assert(node->self != INVALID_OFFSET);
+    _free_blocks.push_back(node->self);
+    _cacheDefer(node);
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+inline void BPlusTree<Key, Val, BlockSize>::_subNodeUpdate(Node *parent, int index, Node *sub_node) {
+    assert(sub_node->self != INVALID_OFFSET);
+    sub(parent)[index] = sub_node->self;
+    sub_node->parent = parent->self;
+    _nodeFlush(sub_node);
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+inline void BPlusTree<Key, Val, BlockSize>::_subNodeFlush(Node *parent, off_t sub_offset) {
+    Node *sub_node = _nodeFetch(sub_offset);
+    assert(sub_node != NULL);
+    sub_node->parent = parent->self;
+    _nodeFlush(sub_node);
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+bool BPlusTree<Key, Val, BlockSize>::get(const Key &k, Val &v) {
+    Node *node = _nodeSeek(_root);
+    while (node != NULL) {
+        int i = _keyBinarySearch(node, k);
+        if (isLeaf(node)) {
+            if (i < 0) {
+                return false;
+            }
+            v = data(node)[i];
+            return true;
+        }
+        node = _nodeSeek(i >= 0 ? sub(node)[i + 1] : sub(node)[-i - 1]);
+    }
+    return false;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+void BPlusTree<Key, Val, BlockSize>::_leftNodeAdd(Node *node, Node *left) {
+    _newNodeAppend(left);
+
+    Node *prev = _nodeFetch(node->prev);
+    if (prev != NULL) {
+        prev->next = left->self;
+        left->prev = prev->self;
+        _nodeFlush(prev);
+    } else {
+        left->prev = INVALID_OFFSET;
+    }
+    left->next = node->self;
+    node->prev = left->self;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+void BPlusTree<Key, Val, BlockSize>::_rightNodeAdd(Node *node, Node *right) {
+    _newNodeAppend(right);
+
+    Node *next = _nodeFetch(node->next);
+    if (next != NULL) {
+        next->prev = right->self;
+        right->next = next->self;
+        _nodeFlush(next);
+    } else {
+        right->next = INVALID_OFFSET;
+    }
+    right->prev = node->self;
+    node->next = right->self;
+}
+
+/* build the parent of l_ch and r_ch */
+template<typename Key, typename Val, size_t BlockSize>
+int BPlusTree<Key, Val, BlockSize>::_parentNodeBuild(Node *l_ch, Node *r_ch, const Key &k) {
+    if (l_ch->parent == INVALID_OFFSET && r_ch->parent == INVALID_OFFSET) {
+        /* new root */
+        Node *parent = _nodeNew(NON_LEAF);
+        key(parent)[0] = k;
+        sub(parent)[0] = l_ch->self;
+        sub(parent)[1] = r_ch->self;
+        parent->children = 2;
+        _root = _newNodeAppend(parent);
+        l_ch->parent = parent->self;
+        r_ch->parent = parent->self;
+        _level++;
+        _nodeFlush(l_ch);
+        _nodeFlush(r_ch);
+        _nodeFlush(parent);
+        return 0;
+    } else if (r_ch->parent == INVALID_OFFSET) {
+        return _nonLeafInsert(_nodeFetch(l_ch->parent), l_ch, r_ch, k);
+    } else {
+        return _nonLeafInsert(_nodeFetch(r_ch->parent), l_ch, r_ch, k);
+    }
+}
+
+/* split a non-leaf, the new key goes to the left half */
+template<typename Key, typename Val, size_t BlockSize>
+Key BPlusTree<Key, Val, BlockSize>::_nonLeafSplitLeft(Node *node, Node *left, Node *l_ch, Node *r_ch,
+                                                      const Key &k, int insert) {
+    int split = (MAX_ORDER + 1) / 2;
+    _leftNodeAdd(node, left);
+
+    int pivot = insert;
+    left->children = split;
+    node->children = MAX_ORDER - split + 1;
+
+    memmove(&key(left)[0], &key(node)[0], pivot * sizeof(Key));
+    memmove(&sub(left)[0], &sub(node)[0], pivot * sizeof(off_t));
+    memmove(&key(left)[pivot + 1], &key(node)[pivot], (split - pivot - 1) * sizeof(Key));
+    memmove(&sub(left)[pivot + 1], &sub(node)[pivot], (split - pivot - 1) * sizeof(off_t));
+
+    for (int i = 0; i < left->children; i++) {
+        if (i != pivot && i != pivot + 1) {
+            _subNodeFlush(left, sub(left)[i]);
+        }
+    }
+
+    key(left)[pivot] = k;
+    if (pivot == split - 1) {
+        _subNodeUpdate(left, pivot, l_ch);
+        _subNodeUpdate(node, 0, r_ch);
+    } else {
+        _subNodeUpdate(left, pivot, l_ch);
+        _subNodeUpdate(left, pivot + 1, r_ch);
+        sub(node)[0] = sub(node)[split - 1];
+    }
+
+    memmove(&key(node)[0], &key(node)[split - 1], (node->children - 1) * sizeof(Key));
+    memmove(&sub(node)[1], &sub(node)[split], (node->children - 1) * sizeof(off_t));
+
+    return key(left)[split - 1];
+}
+
+/* split a non-leaf, the new key is the first one of the right half */
+template<typename Key, typename Val, size_t BlockSize>
+Key BPlusTree<Key, Val, BlockSize>::_nonLeafSplitRight1(Node *node, Node *right, Node *l_ch, Node *r_ch,
+                                                        const Key &k, int /* insert == split */) {
+    int split = (MAX_ORDER + 1) / 2;
+    _rightNodeAdd(node, right);
+
+    int pivot = 0;
+    node->children = split;
+    right->children = MAX_ORDER - split + 1;
+
+    key(right)[0] = k;
+    _subNodeUpdate(right, pivot, l_ch);
+    _subNodeUpdate(right, pivot + 1, r_ch);
+
+    memmove(&key(right)[pivot + 1], &key(node)[split], (right->children - 2) * sizeof(Key));
+    memmove(&sub(right)[pivot + 2], &sub(node)[split + 1], (right->children - 2) * sizeof(off_t));
+
+    for (int i = pivot + 2; i < right->children; i++) {
+        _subNodeFlush(right, sub(right)[i]);
+    }
+
+    return key(node)[split - 1];
+}
+
+/* split a non-leaf, the new key goes into the right half */
+template<typename Key, typename Val, size_t BlockSize>
+Key BPlusTree<Key, Val, BlockSize>::_nonLeafSplitRight2(Node *node, Node *right, Node *l_ch, Node *r_ch,
+                                                        const Key &k, int insert) {
+    int split = (MAX_ORDER + 1) / 2;
+    _rightNodeAdd(node, right);
+
+    int pivot = insert - split - 1;
+    node->children = split + 1;
+    right->children = MAX_ORDER - split;
+
+    memmove(&key(right)[0], &key(node)[split + 1], pivot * sizeof(Key));
+    memmove(&sub(right)[0], &sub(node)[split + 1], pivot * sizeof(off_t));
+
+    key(right)[pivot] = k;
+    _subNodeUpdate(right, pivot, l_ch);
+    _subNodeUpdate(right, pivot + 1, r_ch);
+
+    memmove(&key(right)[pivot + 1], &key(node)[insert], (MAX_ORDER - insert - 1) * sizeof(Key));
+    memmove(&sub(right)[pivot + 2], &sub(node)[insert + 1], (MAX_ORDER - insert - 1) * sizeof(off_t));
+
+    for (int i = 0; i < right->children; i++) {
+        if (i != pivot && i != pivot + 1) {
+            _subNodeFlush(right, sub(right)[i]);
+        }
+    }
+
+    return key(node)[split];
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+void BPlusTree<Key, Val, BlockSize>::_nonLeafSimpleInsert(Node *node, Node *l_ch, Node *r_ch,
+                                                          const Key &k, int insert) {
+    memmove(&key(node)[insert + 1], &key(node)[insert], (node->children - 1 - insert) * sizeof(Key));
+    memmove(&sub(node)[insert + 2], &sub(node)[insert + 1], (node->children - 1 - insert) * sizeof(off_t));
+    key(node)[insert] = k;
+    _subNodeUpdate(node, insert, l_ch);
+    _subNodeUpdate(node, insert + 1, r_ch);
+    node->children++;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+int BPlusTree<Key, Val, BlockSize>::_nonLeafInsert(Node *node, Node *l_ch, Node *r_ch, const Key &k) {
+    int insert = _keyBinarySearch(node, k);
+    assert(insert < 0);
+    insert = -insert - 1;
+
+    if (node->children == MAX_ORDER) {
+        Key split_key;
+        int split = (node->children + 1) / 2;
+        Node *sibling = _nodeNew(NON_LEAF);
+        if (insert < split) {
+            split_key = _nonLeafSplitLeft(node, sibling, l_ch, r_ch, k, insert);
+            return _parentNodeBuild(sibling, node, split_key);
+        } else if (insert == split) {
+            split_key = _nonLeafSplitRight1(node, sibling, l_ch, r_ch, k, insert);
+        } else {
+            split_key = _nonLeafSplitRight2(node, sibling, l_ch, r_ch, k, insert);
+        }
+        return _parentNodeBuild(node, sibling, split_key);
+    }
+
+    _nonLeafSimpleInsert(node, l_ch, r_ch, k, insert);
+    _nodeFlush(node);
+    return 0;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+Key BPlusTree<Key, Val, BlockSize>::_leafSplitLeft(Node *leaf, Node *left, const Key &k, const Val &v, int insert) {
+    int split = (leaf->children + 1) / 2;
+    _leftNodeAdd(leaf, left);
+
+    int pivot = insert;
+    left->children = split;
+    leaf->children = MAX_ENTRIES - split + 1;
+
+    memmove(&key(left)[0], &key(leaf)[0], pivot * sizeof(Key));
+    memmove(&data(left)[0], &data(leaf)[0], pivot * sizeof(Val));
+    key(left)[pivot] = k;
+    data(left)[pivot] = v;
+    memmove(&key(left)[pivot + 1], &key(leaf)[pivot], (split - pivot - 1) * sizeof(Key));
+    memmove(&data(left)[pivot + 1], &data(leaf)[pivot], (split - pivot - 1) * sizeof(Val));
+
+    memmove(&key(leaf)[0], &key(leaf)[split - 1], leaf->children * sizeof(Key));
+    memmove(&data(leaf)[0], &data(leaf)[split - 1], leaf->children * sizeof(Val));
+
+    return key(leaf)[0];
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+Key BPlusTree<Key, Val, BlockSize>::_leafSplitRight(Node *leaf, Node *right, const Key &k, const Val &v, int insert) {
+    int split = (leaf->children + 1) / 2;
+    _rightNodeAdd(leaf, right);
+
+    int pivot = insert - split;
+    leaf->children = split;
+    right->children = MAX_ENTRIES - split + 1;
+
+    memmove(&key(right)[0], &key(leaf)[split], pivot * sizeof(Key));
+    memmove(&data(right)[0], &data(leaf)[split], pivot * sizeof(Val));
+    key(right)[pivot] = k;
+    data(right)[pivot] = v;
+    memmove(&key(right)[pivot + 1], &key(leaf)[insert], (MAX_ENTRIES - insert) * sizeof(Key));
+    memmove(&data(right)[pivot + 1], &data(leaf)[insert], (MAX_ENTRIES - insert) * sizeof(Val));
+
+    return key(right)[0];
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+void BPlusTree<Key, Val, BlockSize>::_leafSimpleInsert(Node *leaf, const Key &k, const Val &v, int insert) {
+    memmove(&key(leaf)[insert + 1], &key(leaf)[insert], (leaf->children - insert) * sizeof(Key));
+    memmove(&data(leaf)[insert + 1], &data(leaf)[insert], (leaf->children - insert) * sizeof(Val));
+    key(leaf)[insert] = k;
+    data(leaf)[insert] = v;
+    leaf->children++;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+int BPlusTree<Key, Val, BlockSize>::_leafInsert(Node *leaf, const Key &k, const Val &v) {
+    int insert = _keyBinarySearch(leaf, k);
+    if (insert >= 0) {
+        return -1;
+    }
+    insert = -insert - 1;
+
+    /* the leaf was only seeked, pin it */
+    _used[(reinterpret_cast<char *>(leaf) - _caches[0]) / BlockSize] = true;
+
+    if (leaf->children == MAX_ENTRIES) {
+        int split = (MAX_ENTRIES + 1) / 2;
+        Node *sibling = _nodeNew(LEAF);
+        if (insert < split) {
+            Key split_key = _leafSplitLeft(leaf, sibling, k, v, insert);
+            return _parentNodeBuild(sibling, leaf, split_key);
+        }
+        Key split_key = _leafSplitRight(leaf, sibling, k, v, insert);
+        return _parentNodeBuild(leaf, sibling, split_key);
+    }
+
+    _leafSimpleInsert(leaf, k, v, insert);
+    _nodeFlush(leaf);
+    return 0;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+bool BPlusTree<Key, Val, BlockSize>::insert(const Key &k, const Val &v) {
+    Node *node = _nodeSeek(_root);
+    while (node != NULL) {
+        if (isLeaf(node)) {
+            return _leafInsert(node, k, v) == 0;
+        }
+        int i = _keyBinarySearch(node, k);
+        node = _nodeSeek(i >= 0 ? sub(node)[i + 1] : sub(node)[-i - 1]);
+    }
+
+    /* new root */
+    Node *root = _nodeNew(LEAF);
+    key(root)[0] = k;
+    data(root)[0] = v;
+    root->children = 1;
+    _root = _newNodeAppend(root);
+    _level = 1;
+    _nodeFlush(root);
+    return true;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+inline int BPlusTree<Key, Val, BlockSize>::_siblingSelect(Node *l_sib, Node *r_sib, Node *parent, int i) {
+    if (i == -1) {
+        return RIGHT_SIBLING;
+    } else if (i == parent->children - 2) {
+        return LEFT_SIBLING;
+    }
+    return l_sib->children >= r_sib->children ? LEFT_SIBLING : RIGHT_SIBLING;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+void BPlusTree<Key, Val, BlockSize>::_nonLeafShiftFromLeft(Node *node, Node *left, Node *parent,
+                                                           int parent_key_index, int remove) {
+    memmove(&key(node)[1], &key(node)[0], remove * sizeof(Key));
+    memmove(&sub(node)[1], &sub(node)[0], (remove + 1) * sizeof(off_t));
+
+    key(node)[0] = key(parent)[parent_key_index];
+    key(parent)[parent_key_index] = key(left)[left->children - 2];
+
+    sub(node)[0] = sub(left)[left->children - 1];
+    _subNodeFlush(node, sub(node)[0]);
+
+    left->children--;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+void BPlusTree<Key, Val, BlockSize>::_nonLeafMergeIntoLeft(Node *node, Node *left, Node *parent,
+                                                           int parent_key_index, int remove) {
+    key(left)[left->children - 1] = key(parent)[parent_key_index];
+
+    memmove(&key(left)[left->children], &key(node)[0], remove * sizeof(Key));
+    memmove(&sub(left)[left->children], &sub(node)[0], (remove + 1) * sizeof(off_t));
+    memmove(&key(left)[left->children + remove], &key(node)[remove + 1],
+            (node->children - remove - 2) * sizeof(Key));
+    memmove(&sub(left)[left->children + remove + 1], &sub(node)[remove + 2],
+            (node->children - remove - 2) * sizeof(off_t));
+
+    for (int i = left->children, j = 0; j < node->children - 1; i++, j++) {
+        _subNodeFlush(left, sub(left)[i]);
+    }
+
+    left->children += node->children - 1;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+void BPlusTree<Key, Val, BlockSize>::_nonLeafShiftFromRight(Node *node, Node *right, Node *parent,
+                                                            int parent_key_index) {
+    key(node)[node->children - 1] = key(parent)[parent_key_index];
+    key(parent)[parent_key_index] = key(right)[0];
+
+    sub(node)[node->children] = sub(right)[0];
+    _subNodeFlush(node, sub(node)[node->children]);
+    node->children++;
+
+    memmove(&key(right)[0], &key(right)[1], (right->children - 2) * sizeof(Key));
+    memmove(&sub(right)[0], &sub(right)[1], (right->children - 1) * sizeof(off_t));
+
+    right->children--;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+void BPlusTree<Key, Val, BlockSize>::_nonLeafMergeFromRight(Node *node, Node *right, Node *parent,
+                                                            int parent_key_index) {
+    key(node)[node->children - 1] = key(parent)[parent_key_index];
+    node->children++;
+
+    memmove(&key(node)[node->children - 1], &key(right)[0], (right->children - 1) * sizeof(Key));
+    memmove(&sub(node)[node->children - 1], &sub(right)[0], right->children * sizeof(off_t));
+
+    for (int i = node->children - 1, j = 0; j < right->children; i++, j++) {
+        _subNodeFlush(node, sub(node)[i]);
+    }
+
+    node->children += right->children - 1;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+inline void BPlusTree<Key, Val, BlockSize>::_nonLeafSimpleRemove(Node *node, int remove) {
+    assert(node->children >= 2);
+    memmove(&key(node)[remove], &key(node)[remove + 1], (node->children - remove - 2) * sizeof(Key));
+    memmove(&sub(node)[remove + 1], &sub(node)[remove + 2], (node->children - remove - 2) * sizeof(off_t));
+    node->children--;
+}
+
+/* remove key(node)[remove] and sub(node)[remove + 1] */
+template<typename Key, typename Val, size_t BlockSize>
+void BPlusTree<Key, Val, BlockSize>::_nonLeafRemove(Node *node, int remove) {
+    if (node->parent == INVALID_OFFSET) {
+        if (node->children == 2) {
+            /* one key left, the first sub-node becomes the root */
+            Node *root = _nodeFetch(sub(node)[0]);
+            root->parent = INVALID_OFFSET;
+            _root = root->self;
+            _level--;
+            _nodeDelete(node, NULL, NULL);
+            _nodeFlush(root);
+        } else {
+            _nonLeafSimpleRemove(node, remove);
+            _nodeFlush(node);
+        }
+    } else if (node->children <= (MAX_ORDER + 1) / 2) {
+        Node *l_sib = _nodeFetch(node->prev);
+        Node *r_sib = _nodeFetch(node->next);
+        Node *parent = _nodeFetch(node->parent);
+
+        int i = _parentKeyIndex(parent, key(node)[0]);
+
+        if (_siblingSelect(l_sib, r_sib, parent, i) == LEFT_SIBLING) {
+            if (l_sib->children > (MAX_ORDER + 1) / 2) {
+                _nonLeafShiftFromLeft(node, l_sib, parent, i, remove);
+                _nodeFlush(node);
+                _nodeFlush(l_sib);
+                _nodeFlush(r_sib);
+                _nodeFlush(parent);
+            } else {
+                _nonLeafMergeIntoLeft(node, l_sib, parent, i, remove);
+                _nodeDelete(node, l_sib, r_sib);
+                _nonLeafRemove(parent, i);
+            }
+        } else {
+            /* remove first in case of overflow while merging */
+            _nonLeafSimpleRemove(node, remove);
+
+            if (r_sib->children > (MAX_ORDER + 1) / 2) {
+                _nonLeafShiftFromRight(node, r_sib, parent, i + 1);
+                _nodeFlush(node);
+                _nodeFlush(l_sib);
+                _nodeFlush(r_sib);
+                _nodeFlush(parent);
+            } else {
+                _nonLeafMergeFromRight(node, r_sib, parent, i + 1);
+                Node *rr_sib = _nodeFetch(r_sib->next);
+                _nodeDelete(r_sib, node, rr_sib);
+                _nodeFlush(l_sib);
+                _nonLeafRemove(parent, i + 1);
+            }
+        }
+    } else {
+        _nonLeafSimpleRemove(node, remove);
+        _nodeFlush(node);
+    }
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+void BPlusTree<Key, Val, BlockSize>::_leafShiftFromLeft(Node *leaf, Node *left, Node *parent,
+                                                        int parent_key_index, int remove) {
+    memmove(&key(leaf)[1], &key(leaf)[0], remove * sizeof(Key));
+    memmove(&data(leaf)[1], &data(leaf)[0], remove * sizeof(Val));
+
+    key(leaf)[0] = key(left)[left->children - 1];
+    data(leaf)[0] = data(left)[left->children - 1];
+    left->children--;
+
+    key(parent)[parent_key_index] = key(leaf)[0];
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+void BPlusTree<Key, Val, BlockSize>::_leafMergeIntoLeft(Node *leaf, Node *left, int remove) {
+    memmove(&key(left)[left->children], &key(leaf)[0], remove * sizeof(Key));
+    memmove(&data(left)[left->children], &data(leaf)[0], remove * sizeof(Val));
+    memmove(&key(left)[left->children + remove], &key(leaf)[remove + 1],
+            (leaf->children - remove - 1) * sizeof(Key));
+    memmove(&data(left)[left->children + remove], &data(leaf)[remove + 1],
+            (leaf->children - remove - 1) * sizeof(Val));
+    left->children += leaf->children - 1;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+void BPlusTree<Key, Val, BlockSize>::_leafShiftFromRight(Node *leaf, Node *right, Node *parent,
+                                                         int parent_key_index) {
+    key(leaf)[leaf->children] = key(right)[0];
+    data(leaf)[leaf->children] = data(right)[0];
+    leaf->children++;
+
+    memmove(&key(right)[0], &key(right)[1], (right->children - 1) * sizeof(Key));
+    memmove(&data(right)[0], &data(right)[1], (right->children - 1) * sizeof(Val));
+    right->children--;
+
+    key(parent)[parent_key_index] = key(right)[0];
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+inline void BPlusTree<Key, Val, BlockSize>::_leafMergeFromRight(Node *leaf, Node *right) {
+    memmove(&key(leaf)[leaf->children], &key(right)[0], right->children * sizeof(Key));
+    memmove(&data(leaf)[leaf->children], &data(right)[0], right->children * sizeof(Val));
+    leaf->children += right->children;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+inline void BPlusTree<Key, Val, BlockSize>::_leafSimpleRemove(Node *leaf, int remove) {
+    memmove(&key(leaf)[remove], &key(leaf)[remove + 1], (leaf->children - remove - 1) * sizeof(Key));
+    memmove(&data(leaf)[remove], &data(leaf)[remove + 1], (leaf->children - remove - 1) * sizeof(Val));
+    leaf->children--;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+void BPlusTree<Key, Val, BlockSize>::_leafRemove(Node *leaf, int remove) {
+    assert(remove >= 0);
+
+    /* the leaf was only seeked, pin it */
+    _used[(reinterpret_cast<char *>(leaf) - _caches[0]) / BlockSize] = true;
+
+    if (leaf->parent == INVALID_OFFSET) {
+        if (leaf->children == 1) {
+            _root = INVALID_OFFSET;
+            _level = 0;
+            _nodeDelete(leaf, NULL, NULL);
+        } else {
+            _leafSimpleRemove(leaf, remove);
+            _nodeFlush(leaf);
+        }
+    } else if (leaf->children <= (MAX_ENTRIES + 1) / 2) {
+        Node *l_sib = _nodeFetch(leaf->prev);
+        Node *r_sib = _nodeFetch(leaf->next);
+        Node *parent = _nodeFetch(leaf->parent);
+
+        int i = _parentKeyIndex(parent, key(leaf)[0]);
+
+        if (_siblingSelect(l_sib, r_sib, parent, i) == LEFT_SIBLING) {
+            if (l_sib->children > (MAX_ENTRIES + 1) / 2) {
+                _leafShiftFromLeft(leaf, l_sib, parent, i, remove);
+                _nodeFlush(leaf);
+                _nodeFlush(l_sib);
+                _nodeFlush(r_sib);
+                _nodeFlush(parent);
+            } else {
+                _leafMergeIntoLeft(leaf, l_sib, remove);
+                _nodeDelete(leaf, l_sib, r_sib);
+                _nonLeafRemove(parent, i);
+            }
+        } else {
+            _leafSimpleRemove(leaf, remove);
+
+            if (r_sib->children > (MAX_ENTRIES + 1) / 2) {
+                _leafShiftFromRight(leaf, r_sib, parent, i + 1);
+                _nodeFlush(leaf);
+                _nodeFlush(l_sib);
+                _nodeFlush(r_sib);
+                _nodeFlush(parent);
+            } else {
+                _leafMergeFromRight(leaf, r_sib);
+                Node *rr_sib = _nodeFetch(r_sib->next);
+                _nodeDelete(r_sib, leaf, rr_sib);
+                _nodeFlush(l_sib);
+                _nonLeafRemove(parent, i + 1);
+            }
+        }
+    } else {
+        _leafSimpleRemove(leaf, remove);
+        _nodeFlush(leaf);
+    }
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+bool BPlusTree<Key, Val, BlockSize>::del(const Key &k) {
+    Node *node = _nodeSeek(_root);
+    while (node != NULL) {
+        int i = _keyBinarySearch(node, k);
+        if (isLeaf(node)) {
+            if (i < 0) {
+                return false;
+            }
+            _leafRemove(node, i);
+            return true;
+        }
+        node = _nodeSeek(i >= 0 ? sub(node)[i + 1] : sub(node)[-i - 1]);
+    }
+    return false;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+template<typename F>
+size_t BPlusTree<Key, Val, BlockSize>::range(const Key &lo, const Key &hi, F fn) {
+    size_t n = 0;
+    Node *node = _nodeSeek(_root);
+    while (node != NULL && !isLeaf(node)) {
+        int i = _keyBinarySearch(node, lo);
+        node = _nodeSeek(i >= 0 ? sub(node)[i + 1] : sub(node)[-i - 1]);
+    }
+    if (node == NULL) {
+        return 0;
+    }
+
+    int i = _keyBinarySearch(node, lo);
+    if (i < 0) {
+        i = -i - 1;
+    }
+    while (node != NULL) {
+        for (; i < node->children; i++) {
+            if (hi < key(node)[i]) {
+                return n;
+            }
+            fn(key(node)[i], data(node)[i]);
+            n++;
+        }
+        node = _nodeSeek(node->next);
+        i = 0;
+    }
+    return n;
+}
+
+/* boot file: root, block size, file size and free blocks, in hex like bplustree.cc */
+static inline off_t _bootLoad(int fd) {
+    char buf[16];
+    if (read(fd, buf, sizeof(buf)) != (ssize_t) sizeof(buf)) {
+        return 0xdeadbeef;
+    }
+    off_t offset = 0;
+    for (size_t i = 0; i < sizeof(buf); i++) {
+        char c = buf[i];
+        offset = offset * 16 + (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+    }
+    return offset;
+}
+
+static inline void _bootStore(int fd, off_t offset) {
+    static const char *hex = "0123456789ABCDEF";
+    char buf[16];
+    for (int i = sizeof(buf) - 1; i >= 0; i--) {
+        buf[i] = hex[offset & 0xf];
+        offset >>= 4;
+    }
+    ssize_t len = write(fd, buf, sizeof(buf));
+    assert(len == (ssize_t) sizeof(buf));
+    (void) len;
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+BPlusTree<Key, Val, BlockSize>::BPlusTree(const char *filename): _level(0),
+                                                                 _root(INVALID_OFFSET),
+                                                                 _file_size(0) {
+    if (strlen(filename) + sizeof(".boot") > sizeof(_bootname)) {
+        fprintf(stderr, "Index file name too long!\n");
+        exit(-1);
+    }
+    memset(_used, 0, sizeof(_used));
+    strcpy(_bootname, filename);
+    strcat(_bootname, ".boot");
+
+    int fd = open(_bootname, O_RDONLY);
+    if (fd >= 0) {
+        _root = _bootLoad(fd);
+        if (_bootLoad(fd) != (off_t) BlockSize) {
+            fprintf(stderr, "%s was built with another block size!\n", filename);
+            exit(-1);
+        }
+        _file_size = _bootLoad(fd);
+        _level = _bootLoad(fd);
+        off_t offset;
+        while ((offset = _bootLoad(fd)) != INVALID_OFFSET) {
+            _free_blocks.push_back(offset);
+        }
+        close(fd);
+    }
+
+    _fd = open(filename, O_CREAT | O_RDWR, 0644);
+    if (_fd < 0) {
+        fprintf(stderr, "Cannot open %s!\n", filename);
+        exit(-1);
+    }
+}
+
+template<typename Key, typename Val, size_t BlockSize>
+BPlusTree<Key, Val, BlockSize>::~BPlusTree() {
+    int fd = open(_bootname, O_CREAT | O_WRONLY | O_TRUNC, 0644);
+    assert(fd >= 0);
+    _bootStore(fd, _root);
+    _bootStore(fd, BlockSize);
+    _bootStore(fd, _file_size);
+    _bootStore(fd, _level);
+    for (std::list<off_t>::iterator it = _free_blocks.begin(); it != _free_blocks.end(); ++it) {
+        _bootStore(fd, *it);
+    }
+    close(fd);
+    close(_fd);
+}
+
+} //namespace bplustree
+
+#endif
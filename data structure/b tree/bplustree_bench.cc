@@ -0,0 +1,391 @@
+/*
+ * Workload driven benchmark of the on-disk B+ tree, YCSB style mixes over a
+ * loaded dataset.
+ *
+ *   g++ -O2 -DNDEBUG bplustree_bench.cc bplustree.cc -o bplustree_bench
+ *   ./bplustree_bench -w all -d zipfian -n 1000000 -p 500000
+ *
+ * workloads (-w):
+ *      read    95% get, 5% update
+ *      update  50% get, 50% update
+ *      scan    95% range scan of up to -l keys, 5% insert
+ *      insert  insert new records only
+ *      churn   get, delete the oldest record, insert a new one, 1/3 each
+ *      all     each of the above on a freshly loaded tree
+ * distributions (-d) of the records read, updated and scanned:
+ *      uniform, zipfian (scrambled, theta -z), sequential
+ *
+ * An update is a delete followed by an insert, the tree has no in-place
+ * update. Keys are hashed record ids unless -O asks for ordered keys.
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <algorithm>
+#include <vector>
+
+#include "bplustree.h"
+
+enum {
+        DIST_UNIFORM,
+        DIST_ZIPFIAN,
+        DIST_SEQUENTIAL,
+};
+
+struct options {
+        const char *workload;
+        int dist;
+        int block_size;
+        long records;
+        long ops;
+        int flags;
+        int cache_blocks;
+        int bloom_bits;
+        double theta;
+        int ordered;
+        int scan_len;
+        const char *filename;
+};
+
+static uint64_t rng_state = 0x853c49e6748fea9bULL;
+
+/* xorshift64*, cheap enough not to show up in the latencies */
+static inline uint64_t rng_next()
+{
+        rng_state ^= rng_state >> 12;
+        rng_state ^= rng_state << 25;
+        rng_state ^= rng_state >> 27;
+        return rng_state * 2685821657736338717ULL;
+}
+
+static inline double rng_double()
+{
+        return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+static inline uint64_t mix64(uint64_t x)
+{
+        x ^= x >> 33;
+        x *= 0xff51afd7ed558ccdULL;
+        x ^= x >> 33;
+        x *= 0xc4ceb9fe1a85ec53ULL;
+        x ^= x >> 33;
+        return x;
+}
+
+/* Gray et al. zipfian generator over [0, n), as used by YCSB */
+struct zipfian {
+        long n;
+        double theta, alpha, zetan, eta, half_pow_theta;
+};
+
+static double zeta(long n, double theta)
+{
+        double sum = 0;
+        for (long i = 1; i <= n; i++) {
+                sum += 1.0 / pow((double) i, theta);
+        }
+        return sum;
+}
+
+static void zipfian_init(struct zipfian *z, long n, double theta)
+{
+        z->n = n;
+        z->theta = theta;
+        z->alpha = 1.0 / (1.0 - theta);
+        z->zetan = zeta(n, theta);
+        z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta(2, theta) / z->zetan);
+        z->half_pow_theta = 1 + pow(0.5, theta);
+}
+
+static long zipfian_next(struct zipfian *z)
+{
+        double u = rng_double();
+        double uz = u * z->zetan;
+        if (uz < 1.0) {
+                return 0;
+        }
+        if (uz < z->half_pow_theta) {
+                return 1;
+        }
+        long r = (long) (z->n * pow(z->eta * u - z->eta + 1, z->alpha));
+        return r < z->n ? r : z->n - 1;
+}
+
+/* picks records out of the live window [first, last) */
+struct chooser {
+        int dist;
+        struct zipfian zipf;
+        long cursor;
+};
+
+static long choose(struct chooser *c, long first, long last)
+{
+        long n = last - first;
+        switch (c->dist) {
+        case DIST_ZIPFIAN:
+                /* scramble the rank so the hot records are spread over the key space */
+                return first + (long) (mix64(zipfian_next(&c->zipf)) % n);
+        case DIST_SEQUENTIAL:
+                if (c->cursor < first || c->cursor >= last) {
+                        c->cursor = first;
+                }
+                return c->cursor++;
+        default:
+                return first + (long) (rng_next() % n);
+        }
+}
+
+static int ordered_keys;
+
+static inline bptree_key_t record_key(long id)
+{
+        /* multiplication by an odd constant is a bijection on 32 bits */
+        return ordered_keys ? (bptree_key_t) id : (bptree_key_t) ((uint32_t) id * 2654435761u);
+}
+
+static inline double now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void remove_files(const char *filename)
+{
+        char path[1100];
+        unlink(filename);
+        snprintf(path, sizeof(path), "%s.boot", filename);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s.bloom", filename);
+        unlink(path);
+}
+
+static void report(const char *name, double seconds, std::vector<uint32_t> &lat,
+                   const struct bplus_stats *before, const struct bplus_stats *after)
+{
+        size_t n = lat.size();
+        if (n == 0) {
+                return;
+        }
+        std::sort(lat.begin(), lat.end());
+        double reads = after->node_reads - before->node_reads;
+        double misses = after->cache_misses - before->cache_misses;
+        double writes = after->node_writes - before->node_writes;
+        double bytes = (after->bytes_read - before->bytes_read) + (after->bytes_written - before->bytes_written);
+        printf("%-8s %10.0f ops/s  p50 %7.2f  p99 %8.2f  p999 %8.2f us  "
+               "reads %5.2f (disk %5.2f)  writes %5.2f  %7.2f KB/op\n",
+               name, n / seconds, lat[n / 2] / 1000.0, lat[n * 99 / 100] / 1000.0,
+               lat[n * 999 / 1000] / 1000.0, reads / n, misses / n, writes / n, bytes / 1024 / n);
+}
+
+/* one operation of the mix, returns the latency in ns */
+static inline uint32_t timed(double start)
+{
+        double ns = (now() - start) * 1e9;
+        return ns < 4e9 ? (uint32_t) ns : 4000000000u;
+}
+
+static void run(const struct options *opt, const char *workload)
+{
+        remove_files(opt->filename);
+        struct bplus_tree *tree = bplus_tree_init_flags((char *) opt->filename, opt->block_size, opt->flags);
+        if (tree == NULL) {
+                exit(1);
+        }
+        if (opt->cache_blocks > 0) {
+                bplus_tree_cache_enable(tree, opt->cache_blocks);
+        }
+        if (opt->bloom_bits > 0) {
+                bplus_tree_bloom_enable(tree, opt->bloom_bits);
+        }
+
+        struct bplus_stats before, after;
+        std::vector<uint32_t> lat;
+        lat.reserve(opt->ops > opt->records ? opt->ops : opt->records);
+
+        /* load in a shuffled order, sequential loads only ever touch the right edge */
+        std::vector<long> order(opt->records);
+        for (long i = 0; i < opt->records; i++) {
+                order[i] = i;
+        }
+        for (long i = opt->records - 1; i > 0; i--) {
+                std::swap(order[i], order[rng_next() % (i + 1)]);
+        }
+        bplus_tree_stats(tree, &before);
+        double t = now();
+        for (long i = 0; i < opt->records; i++) {
+                double s = now();
+                bplus_tree_put(tree, record_key(order[i]), order[i] + 1);
+                lat.push_back(timed(s));
+        }
+        double elapsed = now() - t;
+        bplus_tree_stats(tree, &after);
+        report("load", elapsed, lat, &before, &after);
+        std::vector<long>().swap(order);
+
+        struct chooser c;
+        c.dist = opt->dist;
+        c.cursor = 0;
+        if (opt->dist == DIST_ZIPFIAN) {
+                zipfian_init(&c.zipf, opt->records, opt->theta);
+        }
+
+        /* live records are [first, last) */
+        long first = 0, last = opt->records;
+        long found = 0;
+        lat.clear();
+        bplus_tree_stats(tree, &before);
+        t = now();
+        for (long i = 0; i < opt->ops; i++) {
+                int r = (int) (rng_next() % 100);
+                double s = now();
+                if (!strcmp(workload, "insert")) {
+                        bplus_tree_put(tree, record_key(last), last + 1);
+                        last++;
+                } else if (!strcmp(workload, "churn")) {
+                        if (r < 33) {
+                                found += bplus_tree_get(tree, record_key(choose(&c, first, last))) != -1;
+                        } else if (r < 66 && last - first > 1) {
+                                bplus_tree_put(tree, record_key(first), 0);
+                                first++;
+                        } else {
+                                bplus_tree_put(tree, record_key(last), last + 1);
+                                last++;
+                        }
+                } else if (!strcmp(workload, "scan")) {
+                        if (r < 95) {
+                                long id = choose(&c, first, last);
+                                int len = 1 + (int) (rng_next() % opt->scan_len);
+                                bptree_key_t key = record_key(id);
+                                /* hashed keys are dense enough that a key range of len * 2^32 / n
+                                 * holds about len records */
+                                long span = ordered_keys ? len : (long) len * (4294967296.0 / (last - first));
+                                long hi = (long) key + span;
+                                bplus_tree_get_range(tree, key, hi > INT32_MAX ? INT32_MAX : (bptree_key_t) hi);
+                        } else {
+                                bplus_tree_put(tree, record_key(last), last + 1);
+                                last++;
+                        }
+                } else {
+                        int reads = !strcmp(workload, "read") ? 95 : 50;
+                        long id = choose(&c, first, last);
+                        if (r < reads) {
+                                found += bplus_tree_get(tree, record_key(id)) != -1;
+                        } else {
+                                bplus_tree_put(tree, record_key(id), 0);
+                                bplus_tree_put(tree, record_key(id), (long) (rng_next() >> 2) + 1);
+                        }
+                }
+                lat.push_back(timed(s));
+        }
+        elapsed = now() - t;
+        bplus_tree_stats(tree, &after);
+        report(workload, elapsed, lat, &before, &after);
+
+        bplus_tree_deinit(tree);
+        remove_files(opt->filename);
+}
+
+static void usage(const char *prog)
+{
+        fprintf(stderr,
+                "usage: %s [-w read|update|scan|insert|churn|all] [-d uniform|zipfian|sequential]\n"
+                "          [-b block size] [-n records] [-p ops] [-f init flags] [-c cache blocks]\n"
+                "          [-m bloom bits per key] [-z zipfian theta] [-l max scan length] [-O] [-F file]\n",
+                prog);
+        exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+        struct options opt;
+        opt.workload = "all";
+        opt.dist = DIST_UNIFORM;
+        opt.block_size = 4096;
+        opt.records = 1000000;
+        opt.ops = 1000000;
+        opt.flags = 0;
+        opt.cache_blocks = 0;
+        opt.bloom_bits = 0;
+        opt.theta = 0.99;
+        opt.ordered = 0;
+        opt.scan_len = 100;
+        opt.filename = "bplustree_bench.index";
+
+        int ch;
+        while ((ch = getopt(argc, argv, "w:d:b:n:p:f:c:m:z:l:OF:")) != -1) {
+                switch (ch) {
+                case 'w':
+                        opt.workload = optarg;
+                        break;
+                case 'd':
+                        if (!strcmp(optarg, "uniform")) {
+                                opt.dist = DIST_UNIFORM;
+                        } else if (!strcmp(optarg, "zipfian")) {
+                                opt.dist = DIST_ZIPFIAN;
+                        } else if (!strcmp(optarg, "sequential")) {
+                                opt.dist = DIST_SEQUENTIAL;
+                        } else {
+                                usage(argv[0]);
+                        }
+                        break;
+                case 'b':
+                        opt.block_size = atoi(optarg);
+                        break;
+                case 'n':
+                        opt.records = atol(optarg);
+                        break;
+                case 'p':
+                        opt.ops = atol(optarg);
+                        break;
+                case 'f':
+                        opt.flags = atoi(optarg);
+                        break;
+                case 'c':
+                        opt.cache_blocks = atoi(optarg);
+                        break;
+                case 'm':
+                        opt.bloom_bits = atoi(optarg);
+                        break;
+                case 'z':
+                        opt.theta = atof(optarg);
+                        break;
+                case 'l':
+                        opt.scan_len = atoi(optarg);
+                        break;
+                case 'O':
+                        opt.ordered = 1;
+                        break;
+                case 'F':
+                        opt.filename = optarg;
+                        break;
+                default:
+                        usage(argv[0]);
+                }
+        }
+        if (opt.records < 2 || opt.ops < 1 || opt.scan_len < 1 ||
+            (opt.dist == DIST_ZIPFIAN && (opt.theta <= 0 || opt.theta >= 1))) {
+                usage(argv[0]);
+        }
+        ordered_keys = opt.ordered;
+
+        static const char *all[] = { "read", "update", "scan", "insert", "churn" };
+        int i, n = sizeof(all) / sizeof(all[0]);
+        int matched = 0;
+        for (i = 0; i < n; i++) {
+                if (!strcmp(opt.workload, "all") || !strcmp(opt.workload, all[i])) {
+                        run(&opt, all[i]);
+                        matched = 1;
+                }
+        }
+        if (!matched) {
+                usage(argv[0]);
+        }
+        return 0;
+}
@@ -0,0 +1,216 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+
+#define BTREE_NO_MAIN
+#include "btree.cpp"
+#include "bplustree_memtable.h"
+
+struct bplus_memtable *bplus_memtable_init(struct bplus_tree *tree, int limit)
+{
+        if (limit <= 0) {
+                fprintf(stderr, "Memtable needs room for at least one key!\n");
+                return NULL;
+        }
+
+        struct bplus_memtable *mt = (bplus_memtable *)calloc(1, sizeof(*mt));
+        assert(mt != NULL);
+        mt->tree = tree;
+        mt->limit = limit;
+        mt->mem = new btree::BTree<bplus_memtable_entry>(BPLUS_MEMTABLE_ORDER);
+        mt->keys = (bptree_key_t *)malloc(limit * sizeof(bptree_key_t));
+        mt->data = (bptree_val_t *)malloc(limit * sizeof(bptree_val_t));
+        assert(mt->keys != NULL && mt->data != NULL);
+        return mt;
+}
+
+/* merge what is left into the disk tree, the tree itself stays open */
+void bplus_memtable_deinit(struct bplus_memtable *mt)
+{
+        bplus_memtable_flush(mt);
+        delete mt->mem;
+        free(mt->keys);
+        free(mt->data);
+        free(mt);
+}
+
+/* freeze the memtable, a fresh one takes the next puts, and merge the frozen
+ * one into the disk tree as a single sorted run */
+int bplus_memtable_flush(struct bplus_memtable *mt)
+{
+        if (mt->nr == 0) {
+                return 0;
+        }
+
+        btree::BTree<bplus_memtable_entry> *frozen = mt->mem;
+        mt->mem = new btree::BTree<bplus_memtable_entry>(BPLUS_MEMTABLE_ORDER);
+        mt->nr = 0;
+
+        int n = 0;
+        frozen->visit([mt, &n](const bplus_memtable_entry &e) {
+                mt->keys[n] = e.key;
+                mt->data[n] = e.data;
+                n++;
+        });
+        delete frozen;
+
+        mt->merges++;
+        mt->merged += n;
+        return bplus_tree_merge(mt->tree, mt->keys, mt->data, n);
+}
+
+/* buffer a put, data 0 deletes the key. Returns the merge result when the
+ * put filled the memtable, 0 otherwise */
+int bplus_memtable_put(struct bplus_memtable *mt, bptree_key_t key, bptree_val_t data)
+{
+        bplus_memtable_entry e;
+        e.key = key;
+        e.data = data;
+
+        if (!mt->mem->insert(e)) {
+                /* the newer put replaces the buffered one */
+                mt->mem->del(e);
+                mt->mem->insert(e);
+        } else if (++mt->nr >= mt->limit) {
+                return bplus_memtable_flush(mt);
+        }
+        return 0;
+}
+
+bptree_val_t bplus_memtable_get(struct bplus_memtable *mt, bptree_key_t key)
+{
+        bplus_memtable_entry e;
+        e.key = key;
+        if (mt->mem->search(e)) {
+                return e.data ? e.data : -1;
+        }
+        return bplus_tree_get(mt->tree, key);
+}
+
+/* data of the largest live key in [key1, key2]. The buffered keys of the
+ * range are walked from the top, the disk tree answers for the gap above
+ * each of them and a tombstone moves the search below it */
+bptree_val_t bplus_memtable_get_range(struct bplus_memtable *mt, bptree_key_t key1, bptree_key_t key2)
+{
+        bptree_key_t min = key1 <= key2 ? key1 : key2;
+        bptree_key_t max = min == key1 ? key2 : key1;
+
+        int i, n = 0;
+        mt->mem->visit([mt, min, max, &n](const bplus_memtable_entry &e) {
+                if (e.key >= min && e.key <= max) {
+                        mt->keys[n] = e.key;
+                        mt->data[n] = e.data;
+                        n++;
+                }
+        });
+
+        bptree_key_t hi = max;
+        for (i = n - 1; i >= 0; i--) {
+                if (mt->keys[i] < hi) {
+                        bptree_val_t ret = bplus_tree_get_range(mt->tree, mt->keys[i] + 1, hi);
+                        if (ret != -1) {
+                                return ret;
+                        }
+                }
+                if (mt->data[i]) {
+                        return mt->data[i];
+                }
+                if (mt->keys[i] == min) {
+                        return -1;
+                }
+                hi = mt->keys[i] - 1;
+        }
+        return bplus_tree_get_range(mt->tree, min, hi);
+}
+
+#ifdef _BPLUS_MEMTABLE_DEBUG
+
+/*
+ *   g++ -D_BPLUS_MEMTABLE_DEBUG bplustree_memtable.cc bplustree.cc -o bplustree_memtable
+ */
+
+#include <string.h>
+#include <unistd.h>
+
+#define TEST_KEYS 5000
+
+/* gets and range gets through the memtable agree with model, 0 is missing */
+static void test_compare(struct bplus_memtable *mt, const long *model)
+{
+        int i, k;
+        for (k = -1; k <= TEST_KEYS; k++) {
+                long data = bplus_memtable_get(mt, k);
+                assert(data == (k >= 0 && k < TEST_KEYS && model[k] ? model[k] : -1));
+                (void) data;
+        }
+        for (i = 0; i < 500; i++) {
+                int a = rand() % TEST_KEYS, b = a + rand() % 50;
+                long expect = -1;
+                for (k = b < TEST_KEYS ? b : TEST_KEYS - 1; k >= a; k--) {
+                        if (model[k]) {
+                                expect = model[k];
+                                break;
+                        }
+                }
+                long data = bplus_memtable_get_range(mt, b, a);
+                assert(data == expect);
+                (void) data;
+                (void) expect;
+        }
+}
+
+/* a delete of a key on disk is a tombstone in the memtable: the key is gone
+ * before the flush, after it, and after the disk tree is reopened */
+int main()
+{
+        static long model[TEST_KEYS];
+        int round, i, k;
+        unlink("bplustreememtable.txt");
+        unlink("bplustreememtable.txt.boot");
+        struct bplus_tree *tree = bplus_tree_init((char *) "bplustreememtable.txt", 1024);
+        for (k = 0; k < TEST_KEYS; k += 2) {
+                bplus_tree_put(tree, k, k + 1);
+                model[k] = k + 1;
+        }
+
+        struct bplus_memtable *mt = bplus_memtable_init(tree, 300);
+        for (round = 0; round < 20; round++) {
+                /* deletes of stored keys only reach the disk on a flush */
+                for (i = 0; i < 100; i++) {
+                        k = rand() % (TEST_KEYS / 2) * 2;
+                        bplus_memtable_put(mt, k, 0);
+                        model[k] = 0;
+                }
+                for (i = 0; i < 200; i++) {
+                        k = rand() % TEST_KEYS;
+                        long data = rand() % 3 ? rand() % 100000 + 1 : 0;
+                        bplus_memtable_put(mt, k, data);
+                        model[k] = data;
+                }
+                test_compare(mt, model);
+                if (round % 3 == 0) {
+                        bplus_memtable_flush(mt);
+                        assert(mt->nr == 0);
+                        test_compare(mt, model);
+                        for (k = 0; k < TEST_KEYS; k++) {
+                                long data = bplus_tree_get(tree, k);
+                                assert(data == (model[k] ? model[k] : -1));
+                                (void) data;
+                        }
+                }
+        }
+        bplus_memtable_deinit(mt);
+        bplus_tree_deinit(tree);
+
+        tree = bplus_tree_init((char *) "bplustreememtable.txt", 1024);
+        mt = bplus_memtable_init(tree, 300);
+        test_compare(mt, model);
+        bplus_memtable_deinit(mt);
+        bplus_tree_deinit(tree);
+        unlink("bplustreememtable.txt");
+        unlink("bplustreememtable.txt.boot");
+        printf("memtable test passed\n");
+        return 0;
+}
+
+#endif
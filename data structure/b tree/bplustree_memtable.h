@@ -0,0 +1,54 @@
+#ifndef _BPLUS_TREE_MEMTABLE_H
+#define _BPLUS_TREE_MEMTABLE_H
+
+#include "btree.h"
+#include "bplustree.h"
+
+/* order of the in-memory BTree holding the memtable */
+#define BPLUS_MEMTABLE_ORDER 64
+
+/* a put waiting in the memtable, data 0 is a tombstone. Entries compare by
+ * key only, so BTree::search returns the stored data with the key */
+struct bplus_memtable_entry {
+        bptree_key_t key;
+        bptree_val_t data;
+
+        bool operator<(const bplus_memtable_entry &o) const { return key < o.key; }
+        bool operator<=(const bplus_memtable_entry &o) const { return key <= o.key; }
+        bool operator>(const bplus_memtable_entry &o) const { return key > o.key; }
+        bool operator==(const bplus_memtable_entry &o) const { return key == o.key; }
+};
+
+/*
+ * Write buffer in front of a bplus_tree. Puts go into an in-memory BTree,
+ * the newest put of a key wins and a delete leaves a tombstone. Once limit
+ * keys are buffered the memtable is merged into the disk tree in key order by
+ * bplus_tree_merge, so random puts reach the file as one write per leaf.
+ * Gets look at the memtable first and then at the disk tree.
+ *
+ * Unlike bplus_tree_put, a put replaces the data of a key already stored.
+ * Buffered puts are lost unless bplus_memtable_flush or bplus_memtable_deinit
+ * runs before the disk tree is closed.
+ */
+struct bplus_memtable {
+        struct bplus_tree *tree;
+        btree::BTree<bplus_memtable_entry> *mem;
+        /* keys buffered and the count that triggers a merge */
+        int nr;
+        int limit;
+        /* sorted run handed to bplus_tree_merge, limit entries each */
+        bptree_key_t *keys;
+        bptree_val_t *data;
+        /* merges done and entries written by them */
+        long merges;
+        long merged;
+};
+
+struct bplus_memtable *bplus_memtable_init(struct bplus_tree *tree, int limit);
+void bplus_memtable_deinit(struct bplus_memtable *mt);
+int bplus_memtable_put(struct bplus_memtable *mt, bptree_key_t key, bptree_val_t data);
+bptree_val_t bplus_memtable_get(struct bplus_memtable *mt, bptree_key_t key);
+bptree_val_t bplus_memtable_get_range(struct bplus_memtable *mt, bptree_key_t key1, bptree_key_t key2);
+int bplus_memtable_flush(struct bplus_memtable *mt);
+
+#endif  /* _BPLUS_TREE_MEMTABLE_H */
@@ -0,0 +1,123 @@
+/*
+ * Compare the templated BPlusTree with the int/long build of bplustree.cc
+ * on the same random workload.
+ *
+ *   g++ -O2 -DNDEBUG bplustree_tpl_bench.cc bplustree.cc -o bplustree_tpl_bench
+ *   ./bplustree_tpl_bench [keys]
+ */
+
+#include <cstdio>
+#include <cstdlib>
+#include <stdint.h>
+#include <time.h>
+#include <vector>
+#include <utility>
+
+#include "bplustree.h"
+#include "bplustree.hpp"
+
+static double now()
+{
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void report(const char *name, const char *op, double seconds, size_t n)
+{
+        printf("%-26s %-7s %10.0f ops/s %8.1f ns/op\n", name, op, n / seconds, seconds * 1e9 / n);
+}
+
+static void remove_files(const char *filename)
+{
+        char path[256];
+        unlink(filename);
+        snprintf(path, sizeof(path), "%s.boot", filename);
+        unlink(path);
+        snprintf(path, sizeof(path), "%s.bloom", filename);
+        unlink(path);
+}
+
+static void bench_c(const std::vector<int> &keys)
+{
+        const char *filename = "bench_c.index";
+        remove_files(filename);
+        struct bplus_tree *tree = bplus_tree_init((char *) filename, 4096);
+        size_t i, found = 0;
+
+        double t = now();
+        for (i = 0; i < keys.size(); i++) {
+                bplus_tree_put(tree, keys[i], (long) keys[i] + 1);
+        }
+        report("bplus_tree int/long", "insert", now() - t, keys.size());
+
+        t = now();
+        for (i = 0; i < keys.size(); i++) {
+                found += bplus_tree_get(tree, keys[keys.size() - 1 - i]) != -1;
+        }
+        report("bplus_tree int/long", "get", now() - t, keys.size());
+
+        t = now();
+        for (i = 0; i < keys.size(); i += 2) {
+                bplus_tree_put(tree, keys[i], 0);
+        }
+        report("bplus_tree int/long", "delete", now() - t, keys.size() / 2);
+
+        bplus_tree_deinit(tree);
+        remove_files(filename);
+        if (found != keys.size()) {
+                printf("bplus_tree lost keys: %zu of %zu found\n", found, keys.size());
+        }
+}
+
+template<typename Key>
+static void bench_tpl(const char *name, const std::vector<int> &keys)
+{
+        const char *filename = "bench_tpl.index";
+        remove_files(filename);
+        size_t i, found = 0;
+        {
+                bplustree::BPlusTree<Key, long, 4096> tree(filename);
+
+                double t = now();
+                for (i = 0; i < keys.size(); i++) {
+                        tree.insert((Key) keys[i], (long) keys[i] + 1);
+                }
+                report(name, "insert", now() - t, keys.size());
+
+                t = now();
+                for (i = 0; i < keys.size(); i++) {
+                        long v;
+                        found += tree.get((Key) keys[keys.size() - 1 - i], v);
+                }
+                report(name, "get", now() - t, keys.size());
+
+                t = now();
+                for (i = 0; i < keys.size(); i += 2) {
+                        tree.del((Key) keys[i]);
+                }
+                report(name, "delete", now() - t, keys.size() / 2);
+        }
+        remove_files(filename);
+        if (found != keys.size()) {
+                printf("%s lost keys: %zu of %zu found\n", name, found, keys.size());
+        }
+}
+
+int main(int argc, char *argv[])
+{
+        size_t n = argc > 1 ? strtoul(argv[1], NULL, 10) : 200000;
+        std::vector<int> keys(n);
+        for (size_t i = 0; i < n; i++) {
+                keys[i] = (int) i * 7 + 1;
+        }
+        srand(2021);
+        for (size_t i = n - 1; i > 0; i--) {
+                std::swap(keys[i], keys[rand() % (i + 1)]);
+        }
+
+        bench_c(keys);
+        bench_tpl<int>("BPlusTree<int, long>", keys);
+        bench_tpl<int64_t>("BPlusTree<int64_t, long>", keys);
+        return 0;
+}
@@ -0,0 +1,838 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <fcntl.h>
+
+#include <ctype.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "bplustree_var.h"
+
+enum {
+        INVALID_OFFSET = 0xdeadbeef,
+};
+
+enum {
+        BPLUS_TREE_LEAF,
+        BPLUS_TREE_NON_LEAF = 1,
+};
+
+#define ADDR_STR_WIDTH 16
+
+/* vlen flag of a leaf cell whose value lives in an overflow chain */
+#define BPLUS_VCELL_OVERFLOW 0x80000000u
+
+/* cell headers: klen + vlen for leaves, klen + child for non-leaves */
+#define LEAF_CELL_HDR (sizeof(uint16_t) + sizeof(uint32_t))
+#define NON_LEAF_CELL_HDR (sizeof(uint16_t) + sizeof(off_t))
+
+/* slot directory right after the node header */
+#define slots(node) ((uint16_t *) ((char *) (node) + sizeof(struct bplus_vnode)))
+/* addr of the i-th cell in key order */
+#define cell(node, i) ((char *) (node) + slots(node)[i])
+
+static inline int is_leaf(struct bplus_vnode *node)
+{
+        return node->type == BPLUS_TREE_LEAF;
+}
+
+/* cells are packed, so their fields are accessed through memcpy */
+static inline int cell_klen(const char *c)
+{
+        uint16_t klen;
+        memcpy(&klen, c, sizeof(klen));
+        return klen;
+}
+
+static inline const char *cell_key(struct bplus_vnode *node, const char *c)
+{
+        return c + (is_leaf(node) ? LEAF_CELL_HDR : NON_LEAF_CELL_HDR);
+}
+
+static inline uint32_t cell_vlen(const char *c)
+{
+        uint32_t vlen;
+        memcpy(&vlen, c + sizeof(uint16_t), sizeof(vlen));
+        return vlen;
+}
+
+static inline off_t cell_child(const char *c)
+{
+        off_t child;
+        memcpy(&child, c + sizeof(uint16_t), sizeof(child));
+        return child;
+}
+
+/* first overflow page of a leaf cell with BPLUS_VCELL_OVERFLOW */
+static inline off_t cell_overflow(const char *c)
+{
+        off_t first;
+        memcpy(&first, c + LEAF_CELL_HDR + cell_klen(c), sizeof(first));
+        return first;
+}
+
+static inline int cell_size(struct bplus_vnode *node, const char *c)
+{
+        if (!is_leaf(node)) {
+                return NON_LEAF_CELL_HDR + cell_klen(c);
+        }
+        uint32_t vlen = cell_vlen(c);
+        return LEAF_CELL_HDR + cell_klen(c) + (vlen & BPLUS_VCELL_OVERFLOW ? sizeof(off_t) : vlen);
+}
+
+static int leaf_cell_build(char *c, const void *key, int klen, const void *val, uint32_t vlen)
+{
+        uint16_t k = klen;
+        memcpy(c, &k, sizeof(k));
+        memcpy(c + sizeof(k), &vlen, sizeof(vlen));
+        memcpy(c + LEAF_CELL_HDR, key, klen);
+        if (vlen & BPLUS_VCELL_OVERFLOW) {
+                memcpy(c + LEAF_CELL_HDR + klen, val, sizeof(off_t));
+                return LEAF_CELL_HDR + klen + sizeof(off_t);
+        }
+        memcpy(c + LEAF_CELL_HDR + klen, val, vlen);
+        return LEAF_CELL_HDR + klen + vlen;
+}
+
+static int non_leaf_cell_build(char *c, const void *key, int klen, off_t child)
+{
+        uint16_t k = klen;
+        memcpy(c, &k, sizeof(k));
+        memcpy(c + sizeof(k), &child, sizeof(child));
+        memcpy(c + NON_LEAF_CELL_HDR, key, klen);
+        return NON_LEAF_CELL_HDR + klen;
+}
+
+/* byte string order, a prefix sorts before the longer key */
+static inline int key_cmp(const void *a, int alen, const void *b, int blen)
+{
+        int r = memcmp(a, b, alen < blen ? alen : blen);
+        return r != 0 ? r : alen - blen;
+}
+
+/* index of the first cell >= key, found is set if it equals key */
+static int key_binary_search(struct bplus_vnode *node, const void *key, int klen, int *found)
+{
+        int low = 0;
+        int high = node->count;
+        while (low < high) {
+                int mid = low + (high - low) / 2;
+                const char *c = cell(node, mid);
+                if (key_cmp(cell_key(node, c), cell_klen(c), key, klen) < 0) {
+                        low = mid + 1;
+                } else {
+                        high = mid;
+                }
+        }
+
+        *found = 0;
+        if (low < node->count) {
+                const char *c = cell(node, low);
+                *found = key_cmp(cell_key(node, c), cell_klen(c), key, klen) == 0;
+        }
+        return low;
+}
+
+/* child index of key in a non-leaf, -1 means node->first */
+static inline int child_index(struct bplus_vnode *node, const void *key, int klen)
+{
+        int found;
+        int i = key_binary_search(node, key, klen, &found);
+        return found ? i : i - 1;
+}
+
+static inline off_t child_at(struct bplus_vnode *node, int i)
+{
+        return i < 0 ? node->first : cell_child(cell(node, i));
+}
+
+/* contiguous free bytes between the slot directory and the heap */
+static inline int vnode_free(struct bplus_vnode *node)
+{
+        return node->heap - (int) sizeof(*node) - node->count * (int) sizeof(uint16_t);
+}
+
+/* bytes taken by the header, slots and live cells */
+static inline int vnode_used(struct bplus_vtree *tree, struct bplus_vnode *node)
+{
+        return tree->block_size - vnode_free(node) - node->garbage;
+}
+
+static void vnode_init(struct bplus_vtree *tree, struct bplus_vnode *node, int type)
+{
+        node->self = INVALID_OFFSET;
+        node->prev = INVALID_OFFSET;
+        node->next = INVALID_OFFSET;
+        node->first = INVALID_OFFSET;
+        node->type = type;
+        node->count = 0;
+        node->heap = tree->block_size;
+        node->garbage = 0;
+}
+
+/* lay cells out in dst, the header is copied from hdr which may be dst
+ * itself, the cells must not live in dst */
+static void vnode_fill(struct bplus_vtree *tree, char *dst, struct bplus_vnode *hdr,
+                       char **cells, int *sizes, int n)
+{
+        int i;
+        struct bplus_vnode *node = (struct bplus_vnode *) dst;
+        memmove(node, hdr, sizeof(*node));
+        node->count = n;
+        node->heap = tree->block_size;
+        node->garbage = 0;
+        for (i = 0; i < n; i++) {
+                node->heap -= sizes[i];
+                memcpy(dst + node->heap, cells[i], sizes[i]);
+                slots(node)[i] = node->heap;
+        }
+        assert(vnode_free(node) >= 0);
+}
+
+/* collect the cells of node into tree->cells from index n on */
+static int vnode_gather(struct bplus_vtree *tree, struct bplus_vnode *node, int n)
+{
+        int i;
+        for (i = 0; i < node->count; i++, n++) {
+                tree->cells[n] = cell(node, i);
+                tree->sizes[n] = cell_size(node, tree->cells[n]);
+        }
+        return n;
+}
+
+/* squeeze the garbage out of the heap */
+static void vnode_compact(struct bplus_vtree *tree, struct bplus_vnode *node)
+{
+        int n = vnode_gather(tree, node, 0);
+        vnode_fill(tree, tree->scratch, node, tree->cells, tree->sizes, n);
+        memcpy(node, tree->scratch, tree->block_size);
+}
+
+/* insert a cell at pos, return -1 if it does not fit even after compaction */
+static int vnode_insert(struct bplus_vtree *tree, struct bplus_vnode *node, int pos, const char *c, int size)
+{
+        int need = size + sizeof(uint16_t);
+        if (vnode_free(node) < need) {
+                if (vnode_free(node) + node->garbage < need) {
+                        return -1;
+                }
+                vnode_compact(tree, node);
+        }
+
+        node->heap -= size;
+        memcpy((char *) node + node->heap, c, size);
+        memmove(&slots(node)[pos + 1], &slots(node)[pos], (node->count - pos) * sizeof(uint16_t));
+        slots(node)[pos] = node->heap;
+        node->count++;
+        return 0;
+}
+
+/* drop the cell at pos, its bytes become garbage */
+static void vnode_remove(struct bplus_vnode *node, int pos)
+{
+        node->garbage += cell_size(node, cell(node, pos));
+        memmove(&slots(node)[pos], &slots(node)[pos + 1], (node->count - pos - 1) * sizeof(uint16_t));
+        node->count--;
+}
+
+/* a node that cannot be read or written in full leaves the tree unusable */
+static void vnode_read(struct bplus_vtree *tree, char *buf, off_t offset)
+{
+        if (pread(tree->fd, buf, tree->block_size, offset) != tree->block_size) {
+                fprintf(stderr, "Cannot read block %lld of %s!\n", (long long) offset, tree->filename);
+                abort();
+        }
+}
+
+static void vnode_write(struct bplus_vtree *tree, const char *buf, off_t offset)
+{
+        if (pwrite(tree->fd, buf, tree->block_size, offset) != tree->block_size) {
+                fprintf(stderr, "Cannot write block %lld of %s!\n", (long long) offset, tree->filename);
+                abort();
+        }
+}
+
+/* take a block from the free list or append one to the file */
+static off_t block_alloc(struct bplus_vtree *tree)
+{
+        off_t offset;
+        if (list_empty(&tree->free_blocks)) {
+                offset = tree->file_size;
+                tree->file_size += tree->block_size;
+        } else {
+                struct free_block *block;
+                block = list_first_entry(&tree->free_blocks, struct free_block, link);
+                list_del(&block->link);
+                offset = block->offset;
+                free(block);
+        }
+        return offset;
+}
+
+static void block_free(struct bplus_vtree *tree, off_t offset)
+{
+        struct free_block *block = (free_block*)malloc(sizeof(*block));
+        assert(block != NULL);
+        block->offset = offset;
+        list_add_tail(&block->link, &tree->free_blocks);
+}
+
+/* write a value too large for a page as a chain of overflow pages */
+static off_t overflow_write(struct bplus_vtree *tree, const char *val, long vlen)
+{
+        long cap = tree->block_size - sizeof(struct bplus_voverflow);
+        long pages = (vlen + cap - 1) / cap;
+        off_t next = INVALID_OFFSET;
+        struct bplus_voverflow *page = (struct bplus_voverflow *) tree->scratch;
+
+        /* write backwards so each page knows its successor */
+        while (pages-- > 0) {
+                page->next = next;
+                page->len = vlen - pages * cap < cap ? vlen - pages * cap : cap;
+                memcpy(page + 1, val + pages * cap, page->len);
+                next = block_alloc(tree);
+                vnode_write(tree, tree->scratch, next);
+        }
+        return next;
+}
+
+/* copy up to buflen bytes of an overflow chain */
+static void overflow_read(struct bplus_vtree *tree, off_t offset, char *buf, long buflen)
+{
+        struct bplus_voverflow *page = (struct bplus_voverflow *) tree->scratch;
+        while (offset != INVALID_OFFSET && buflen > 0) {
+                vnode_read(tree, tree->scratch, offset);
+                long len = page->len < buflen ? page->len : buflen;
+                memcpy(buf, page + 1, len);
+                buf += len;
+                buflen -= len;
+                offset = page->next;
+        }
+}
+
+static void overflow_free(struct bplus_vtree *tree, off_t offset)
+{
+        struct bplus_voverflow *page = (struct bplus_voverflow *) tree->scratch;
+        while (offset != INVALID_OFFSET) {
+                vnode_read(tree, tree->scratch, offset);
+                block_free(tree, offset);
+                offset = page->next;
+        }
+}
+
+/* release what a leaf cell owns outside its page */
+static inline void cell_release(struct bplus_vtree *tree, const char *c)
+{
+        if (cell_vlen(c) & BPLUS_VCELL_OVERFLOW) {
+                overflow_free(tree, cell_overflow(c));
+        }
+}
+
+/* read the path from the root to the leaf that may hold key, return the leaf level */
+static int vtree_descend(struct bplus_vtree *tree, const void *key, int klen)
+{
+        int level = 0;
+        off_t offset = tree->root;
+        for (;;) {
+                assert(level < BPLUS_VTREE_MAX_LEVEL);
+                vnode_read(tree, tree->path[level], offset);
+                struct bplus_vnode *node = (struct bplus_vnode *) tree->path[level];
+                if (is_leaf(node)) {
+                        return level;
+                }
+                tree->path_index[level] = child_index(node, key, klen);
+                offset = child_at(node, tree->path_index[level]);
+                level++;
+        }
+}
+
+/* shortest prefix of right that still sorts after left, the leaf split key */
+static int separator_len(const char *left, int llen, const char *right, int rlen)
+{
+        int i = 0;
+        while (i < llen && i < rlen && left[i] == right[i]) {
+                i++;
+        }
+        assert(i < rlen);
+        return i + 1;
+}
+
+/* Split the node at level while inserting the cell in tree->spill at pos.
+ * Cells are divided by bytes, not by count, then the separator is inserted
+ * into the parent, which may split in turn. */
+static void vnode_split_insert(struct bplus_vtree *tree, int level, int pos, int size)
+{
+        int i, n = 0, m, total = 0, acc = 0;
+        struct bplus_vnode *node = (struct bplus_vnode *) tree->path[level];
+        struct bplus_vnode *right = (struct bplus_vnode *) tree->sibling;
+        char *sep = tree->spill + tree->block_size;
+        int sep_size;
+
+        for (i = 0; i <= node->count; i++) {
+                if (i == pos) {
+                        tree->cells[n] = tree->spill;
+                        tree->sizes[n++] = size;
+                }
+                if (i < node->count) {
+                        tree->cells[n] = cell(node, i);
+                        tree->sizes[n] = cell_size(node, tree->cells[n]);
+                        n++;
+                }
+        }
+        for (i = 0; i < n; i++) {
+                total += tree->sizes[i];
+        }
+
+        /* m cells stay left, about half of the bytes */
+        for (m = 0; m < n && acc + tree->sizes[m] / 2 < total / 2; m++) {
+                acc += tree->sizes[m];
+        }
+        if (is_leaf(node)) {
+                m = m < 1 ? 1 : m > n - 1 ? n - 1 : m;
+        } else {
+                m = m < 1 ? 1 : m > n - 2 ? n - 2 : m;
+        }
+
+        vnode_init(tree, right, node->type);
+        right->self = block_alloc(tree);
+        if (is_leaf(node)) {
+                const char *l = tree->cells[m - 1], *r = tree->cells[m];
+                int len = separator_len(cell_key(node, l), cell_klen(l), cell_key(node, r), cell_klen(r));
+                sep_size = non_leaf_cell_build(sep, cell_key(node, r), len, right->self);
+
+                right->prev = node->self;
+                right->next = node->next;
+                vnode_fill(tree, tree->sibling, right, tree->cells + m, tree->sizes + m, n - m);
+        } else {
+                /* the middle cell moves up, its child becomes the right first */
+                const char *mid = tree->cells[m];
+                sep_size = non_leaf_cell_build(sep, cell_key(node, mid), cell_klen(mid), right->self);
+
+                right->first = cell_child(mid);
+                vnode_fill(tree, tree->sibling, right, tree->cells + m + 1, tree->sizes + m + 1, n - m - 1);
+        }
+
+        off_t next = node->next;
+        if (is_leaf(node)) {
+                node->next = right->self;
+        }
+        vnode_fill(tree, tree->scratch, node, tree->cells, tree->sizes, m);
+        memcpy(node, tree->scratch, tree->block_size);
+        vnode_write(tree, tree->sibling, right->self);
+        vnode_write(tree, (char *) node, node->self);
+
+        if (is_leaf(node) && next != INVALID_OFFSET) {
+                struct bplus_vnode *nn = (struct bplus_vnode *) tree->scratch;
+                vnode_read(tree, tree->scratch, next);
+                nn->prev = right->self;
+                vnode_write(tree, tree->scratch, next);
+        }
+
+        memcpy(tree->spill, sep, sep_size);
+        if (level == 0) {
+                /* new root */
+                struct bplus_vnode *root = (struct bplus_vnode *) tree->scratch;
+                vnode_init(tree, root, BPLUS_TREE_NON_LEAF);
+                root->self = block_alloc(tree);
+                root->first = node->self;
+                vnode_insert(tree, root, 0, tree->spill, sep_size);
+                vnode_write(tree, tree->scratch, root->self);
+                tree->root = root->self;
+                tree->level++;
+                return;
+        }
+
+        struct bplus_vnode *parent = (struct bplus_vnode *) tree->path[level - 1];
+        int ppos = tree->path_index[level - 1] + 1;
+        if (vnode_insert(tree, parent, ppos, tree->spill, sep_size) == 0) {
+                vnode_write(tree, (char *) parent, parent->self);
+        } else {
+                vnode_split_insert(tree, level - 1, ppos, sep_size);
+        }
+}
+
+int bplus_vtree_max_key(struct bplus_vtree *tree)
+{
+        return tree->max_cell - LEAF_CELL_HDR - sizeof(off_t);
+}
+
+/* insert key, or replace its value if it exists */
+int bplus_vtree_put(struct bplus_vtree *tree, const void *key, int klen, const void *val, long vlen)
+{
+        int size, found;
+
+        if (klen <= 0 || klen > bplus_vtree_max_key(tree) || vlen < 0 || vlen >= (long) BPLUS_VCELL_OVERFLOW) {
+                return -1;
+        }
+
+        /* build the new cell, large values go to an overflow chain */
+        if ((long) LEAF_CELL_HDR + klen + vlen <= tree->max_cell) {
+                size = leaf_cell_build(tree->spill, key, klen, val, vlen);
+        } else {
+                off_t first = overflow_write(tree, (const char *) val, vlen);
+                size = leaf_cell_build(tree->spill, key, klen, &first, vlen | BPLUS_VCELL_OVERFLOW);
+        }
+
+        if (tree->root == INVALID_OFFSET) {
+                struct bplus_vnode *root = (struct bplus_vnode *) tree->path[0];
+                vnode_init(tree, root, BPLUS_TREE_LEAF);
+                root->self = block_alloc(tree);
+                vnode_insert(tree, root, 0, tree->spill, size);
+                vnode_write(tree, tree->path[0], root->self);
+                tree->root = root->self;
+                tree->level = 1;
+                return 0;
+        }
+
+        int level = vtree_descend(tree, key, klen);
+        struct bplus_vnode *leaf = (struct bplus_vnode *) tree->path[level];
+        int pos = key_binary_search(leaf, key, klen, &found);
+        if (found) {
+                cell_release(tree, cell(leaf, pos));
+                vnode_remove(leaf, pos);
+        }
+
+        if (vnode_insert(tree, leaf, pos, tree->spill, size) == 0) {
+                vnode_write(tree, (char *) leaf, leaf->self);
+        } else {
+                vnode_split_insert(tree, level, pos, size);
+        }
+        return 0;
+}
+
+/* copy up to buflen bytes of the value, return its full length or -1 */
+long bplus_vtree_get(struct bplus_vtree *tree, const void *key, int klen, void *buf, long buflen)
+{
+        int found;
+        if (tree->root == INVALID_OFFSET) {
+                return -1;
+        }
+
+        int level = vtree_descend(tree, key, klen);
+        struct bplus_vnode *leaf = (struct bplus_vnode *) tree->path[level];
+        int pos = key_binary_search(leaf, key, klen, &found);
+        if (!found) {
+                return -1;
+        }
+
+        const char *c = cell(leaf, pos);
+        uint32_t vlen = cell_vlen(c);
+        long len = (long) (vlen & ~BPLUS_VCELL_OVERFLOW);
+        if (vlen & BPLUS_VCELL_OVERFLOW) {
+                overflow_read(tree, cell_overflow(c), (char *) buf, len < buflen ? len : buflen);
+        } else {
+                memcpy(buf, cell_key(leaf, c) + cell_klen(c), len < buflen ? len : buflen);
+        }
+        return len;
+}
+
+/* Merge right into left, the two are adjacent children of parent and
+ * sep_index is the parent cell pointing at right. Return 0 if they do not
+ * fit in one page. */
+static int vnode_merge(struct bplus_vtree *tree, struct bplus_vnode *left, struct bplus_vnode *right,
+                       struct bplus_vnode *parent, int sep_index)
+{
+        int n, sep_size = 0;
+        int need = vnode_used(tree, left) + vnode_used(tree, right) - sizeof(*right);
+        if (!is_leaf(left)) {
+                /* the parent key comes down in front of the right first child */
+                const char *c = cell(parent, sep_index);
+                sep_size = non_leaf_cell_build(tree->spill, cell_key(parent, c), cell_klen(c), right->first);
+                need += sep_size + sizeof(uint16_t);
+        }
+        if (need > tree->block_size) {
+                return 0;
+        }
+
+        n = vnode_gather(tree, left, 0);
+        if (!is_leaf(left)) {
+                tree->cells[n] = tree->spill;
+                tree->sizes[n++] = sep_size;
+        }
+        n = vnode_gather(tree, right, n);
+
+        off_t next = right->next;
+        if (is_leaf(left)) {
+                left->next = next;
+        }
+        vnode_fill(tree, tree->scratch, left, tree->cells, tree->sizes, n);
+        memcpy(left, tree->scratch, tree->block_size);
+
+        if (is_leaf(left) && next != INVALID_OFFSET) {
+                struct bplus_vnode *nn = (struct bplus_vnode *) tree->scratch;
+                vnode_read(tree, tree->scratch, next);
+                nn->prev = left->self;
+                vnode_write(tree, tree->scratch, next);
+        }
+
+        block_free(tree, right->self);
+        vnode_remove(parent, sep_index);
+        return 1;
+}
+
+/* after a removal at level, merge an underfull node with a sibling */
+static void vnode_rebalance(struct bplus_vtree *tree, int level)
+{
+        struct bplus_vnode *node = (struct bplus_vnode *) tree->path[level];
+        struct bplus_vnode *sibling = (struct bplus_vnode *) tree->sibling;
+
+        if (level == 0) {
+                if (node->count > 0) {
+                        vnode_write(tree, (char *) node, node->self);
+                } else if (is_leaf(node)) {
+                        block_free(tree, node->self);
+                        tree->root = INVALID_OFFSET;
+                        tree->level = 0;
+                } else {
+                        /* only the first child is left, it becomes the root */
+                        block_free(tree, node->self);
+                        tree->root = node->first;
+                        tree->level--;
+                }
+                return;
+        }
+
+        if (vnode_used(tree, node) >= tree->block_size / 4) {
+                vnode_write(tree, (char *) node, node->self);
+                return;
+        }
+
+        struct bplus_vnode *parent = (struct bplus_vnode *) tree->path[level - 1];
+        int i = tree->path_index[level - 1];
+
+        if (i + 1 < parent->count) {
+                vnode_read(tree, tree->sibling, child_at(parent, i + 1));
+                if (vnode_merge(tree, node, sibling, parent, i + 1)) {
+                        vnode_write(tree, (char *) node, node->self);
+                        vnode_rebalance(tree, level - 1);
+                        return;
+                }
+        }
+
+        if (i >= 0) {
+                vnode_read(tree, tree->sibling, child_at(parent, i - 1));
+                if (vnode_merge(tree, sibling, node, parent, i)) {
+                        vnode_write(tree, tree->sibling, sibling->self);
+                        vnode_rebalance(tree, level - 1);
+                        return;
+                }
+        }
+
+        vnode_write(tree, (char *) node, node->self);
+}
+
+int bplus_vtree_delete(struct bplus_vtree *tree, const void *key, int klen)
+{
+        int found;
+        if (tree->root == INVALID_OFFSET) {
+                return -1;
+        }
+
+        int level = vtree_descend(tree, key, klen);
+        struct bplus_vnode *leaf = (struct bplus_vnode *) tree->path[level];
+        int pos = key_binary_search(leaf, key, klen, &found);
+        if (!found) {
+                return -1;
+        }
+
+        cell_release(tree, cell(leaf, pos));
+        vnode_remove(leaf, pos);
+        vnode_rebalance(tree, level);
+        return 0;
+}
+
+/* call fn for every key in [lo, hi] in order, return the number of calls.
+ * The tree must not be modified from fn. */
+long bplus_vtree_get_range(struct bplus_vtree *tree, const void *lo, int lolen, const void *hi, int hilen,
+                           bplus_vtree_fn fn, void *arg)
+{
+        int found;
+        long count = 0;
+        if (tree->root == INVALID_OFFSET) {
+                return 0;
+        }
+
+        int level = vtree_descend(tree, lo, lolen);
+        struct bplus_vnode *leaf = (struct bplus_vnode *) tree->path[level];
+        int pos = key_binary_search(leaf, lo, lolen, &found);
+
+        for (;;) {
+                for (; pos < leaf->count; pos++) {
+                        const char *c = cell(leaf, pos);
+                        const char *k = cell_key(leaf, c);
+                        int klen = cell_klen(c);
+                        if (key_cmp(k, klen, hi, hilen) > 0) {
+                                return count;
+                        }
+
+                        int stop;
+                        uint32_t vlen = cell_vlen(c);
+                        if (vlen & BPLUS_VCELL_OVERFLOW) {
+                                long len = (long) (vlen & ~BPLUS_VCELL_OVERFLOW);
+                                char *val = (char *) malloc(len);
+                                assert(val != NULL);
+                                overflow_read(tree, cell_overflow(c), val, len);
+                                stop = fn(k, klen, val, len, arg);
+                                free(val);
+                        } else {
+                                stop = fn(k, klen, k + klen, vlen, arg);
+                        }
+                        count++;
+                        if (stop) {
+                                return count;
+                        }
+                }
+                if (leaf->next == INVALID_OFFSET) {
+                        return count;
+                }
+                vnode_read(tree, tree->path[level], leaf->next);
+                pos = 0;
+        }
+}
+
+/* convert a hex repr str to integer */
+static off_t str_to_hex(char *c, int len)
+{
+        off_t offset = 0;
+        while (len-- > 0) {
+                if (isdigit(*c)) {
+                        offset = offset * 16 + *c - '0';
+                } else if (isxdigit(*c)) {
+                        if (islower(*c)) {
+                                offset = offset * 16 + *c - 'a' + 10;
+                        } else {
+                                offset = offset * 16 + *c - 'A' + 10;
+                        }
+                }
+                c++;
+        }
+        return offset;
+}
+
+static inline void hex_to_str(off_t offset, char *buf, int len)
+{
+        const static char *hex = "0123456789ABCDEF";
+        while (len-- > 0) {
+                buf[len] = hex[offset & 0xf];
+                offset >>= 4;
+        }
+}
+
+static inline off_t offset_load(int fd)
+{
+        char buf[ADDR_STR_WIDTH];
+        ssize_t len = read(fd, buf, sizeof(buf));
+        return len > 0 ? str_to_hex(buf, sizeof(buf)) : (off_t) INVALID_OFFSET;
+}
+
+static inline ssize_t offset_store(int fd, off_t offset)
+{
+        char buf[ADDR_STR_WIDTH];
+        hex_to_str(offset, buf, sizeof(buf));
+        return write(fd, buf, sizeof(buf));
+}
+
+/* init a variable-length tree, block_size is a pow of 2 in [512, 65536] so
+ * slot offsets fit in 16 bits */
+struct bplus_vtree *bplus_vtree_init(char *filename, int block_size)
+{
+        int i;
+        off_t offset;
+        char path[sizeof(((struct bplus_vtree *) 0)->filename) + 8];
+
+        if (strlen(filename) >= sizeof(((struct bplus_vtree *) 0)->filename)) {
+                fprintf(stderr, "Index file name too long!\n");
+                return NULL;
+        }
+
+        if ((block_size & (block_size - 1)) != 0 || block_size < 512 || block_size > 65536) {
+                fprintf(stderr, "Block size must be pow of 2 in [512, 65536]!\n");
+                return NULL;
+        }
+
+        struct bplus_vtree *tree = (bplus_vtree*)calloc(1, sizeof(*tree));
+        assert(tree != NULL);
+        list_init(&tree->free_blocks);
+        strcpy(tree->filename, filename);
+        tree->root = INVALID_OFFSET;
+        tree->block_size = block_size;
+
+        /* load index boot file */
+        snprintf(path, sizeof(path), "%s.boot", filename);
+        int fd = open(path, O_RDONLY);
+        if (fd >= 0) {
+                tree->root = offset_load(fd);
+                tree->block_size = offset_load(fd);
+                tree->file_size = offset_load(fd);
+                tree->level = offset_load(fd);
+                while ((offset = offset_load(fd)) != (off_t) INVALID_OFFSET) {
+                        block_free(tree, offset);
+                }
+                close(fd);
+        }
+
+        /* every page holds at least 4 cells, so a split always has room */
+        tree->max_cell = (tree->block_size - sizeof(struct bplus_vnode)) / 4 - sizeof(uint16_t);
+
+        for (i = 0; i < BPLUS_VTREE_MAX_LEVEL; i++) {
+                tree->path[i] = (char *) malloc(tree->block_size);
+                assert(tree->path[i] != NULL);
+        }
+        tree->sibling = (char *) malloc(tree->block_size);
+        tree->scratch = (char *) malloc(tree->block_size);
+        tree->spill = (char *) malloc(2 * tree->block_size);
+        tree->cells = (char **) malloc(tree->block_size / 4 * sizeof(char *));
+        tree->sizes = (int *) malloc(tree->block_size / 4 * sizeof(int));
+        assert(tree->sibling != NULL && tree->scratch != NULL && tree->spill != NULL);
+        assert(tree->cells != NULL && tree->sizes != NULL);
+
+        tree->fd = open(filename, O_CREAT | O_RDWR, 0644);
+        assert(tree->fd >= 0);
+        return tree;
+}
+
+/* store root offset, blocksize, filesize, level and freeblock offsets */
+void bplus_vtree_deinit(struct bplus_vtree *tree)
+{
+        int i;
+        char path[sizeof(tree->filename) + 8];
+        snprintf(path, sizeof(path), "%s.boot", tree->filename);
+        int fd = open(path, O_CREAT | O_RDWR | O_TRUNC, 0644);
+        assert(fd >= 0);
+
+        int failed = 0;
+        off_t header[] = { tree->root, tree->block_size, tree->file_size, tree->level };
+        for (i = 0; i < (int) (sizeof(header) / sizeof(header[0])); i++) {
+                if (offset_store(fd, header[i]) != ADDR_STR_WIDTH) {
+                        failed = 1;
+                }
+        }
+
+        struct list_head *pos, *n;
+        list_for_each_safe(pos, n, &tree->free_blocks) {
+                list_del(pos);
+                struct free_block *block = list_entry(pos, struct free_block, link);
+                if (offset_store(fd, block->offset) != ADDR_STR_WIDTH) {
+                        failed = 1;
+                }
+                free(block);
+        }
+        close(fd);
+        if (failed) {
+                fprintf(stderr, "Cannot write %s, the tree may not reopen!\n", path);
+        }
+        close(tree->fd);
+
+        for (i = 0; i < BPLUS_VTREE_MAX_LEVEL; i++) {
+                free(tree->path[i]);
+        }
+        free(tree->sibling);
+        free(tree->scratch);
+        free(tree->spill);
+        free(tree->cells);
+        free(tree->sizes);
+        free(tree);
+}
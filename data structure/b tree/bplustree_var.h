@@ -0,0 +1,82 @@
+#ifndef _BPLUS_TREE_VAR_H
+#define _BPLUS_TREE_VAR_H
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include "bplustree.h"
+
+/* deepest tree supported, a page holds at least 4 cells so this is plenty */
+#define BPLUS_VTREE_MAX_LEVEL 24
+
+/*
+ * B+ tree with variable-length keys and values on slotted pages.
+ *
+ * page layout:
+ *      struct bplus_vnode | slot directory (uint16_t offsets) -> free <- cell heap
+ * leaf cell    : uint16_t klen | uint32_t vlen | key | value
+ *                (vlen with BPLUS_VCELL_OVERFLOW set: key | off_t first overflow page)
+ * non-leaf cell: uint16_t klen | off_t child | key
+ *
+ * The child of a non-leaf cell holds keys >= the cell key, node->first holds
+ * the keys below the first cell. Keys compare as byte strings, a prefix sorts
+ * first.
+ */
+typedef struct bplus_vnode {
+        off_t self;
+        /* leaf chain, INVALID for non-leaf nodes */
+        off_t prev;
+        off_t next;
+        /* non-leaf: the leftmost child */
+        off_t first;
+        /* 0 for leaf, 1 for non-leaf */
+        int type;
+        /* number of slots */
+        int count;
+        /* start of the cell heap, it grows down from the end of the block */
+        int heap;
+        /* bytes of deleted cells inside the heap, reclaimed by compaction */
+        int garbage;
+} bplus_vnode;
+
+/* header of a value overflow page, followed by len bytes of the value */
+typedef struct bplus_voverflow {
+        off_t next;
+        long len;
+} bplus_voverflow;
+
+struct bplus_vtree {
+        char filename[1024];
+        int fd;
+        int block_size;
+        /* largest cell kept in a page, 1/4 of the usable space */
+        int max_cell;
+        int level;
+        off_t root;
+        off_t file_size;
+        struct list_head free_blocks;
+        /* one buffer per level of the descent, plus scratch pages */
+        char *path[BPLUS_VTREE_MAX_LEVEL];
+        int path_index[BPLUS_VTREE_MAX_LEVEL];
+        char *sibling;
+        char *scratch;
+        /* new cell being inserted, then the separator pushed up by a split */
+        char *spill;
+        /* cells of a node being split, merged or compacted */
+        char **cells;
+        int *sizes;
+};
+
+/* return the range callback non-zero to stop the scan */
+typedef int (*bplus_vtree_fn)(const void *key, int klen, const void *val, long vlen, void *arg);
+
+struct bplus_vtree *bplus_vtree_init(char *filename, int block_size);
+void bplus_vtree_deinit(struct bplus_vtree *tree);
+int bplus_vtree_max_key(struct bplus_vtree *tree);
+int bplus_vtree_put(struct bplus_vtree *tree, const void *key, int klen, const void *val, long vlen);
+long bplus_vtree_get(struct bplus_vtree *tree, const void *key, int klen, void *buf, long buflen);
+int bplus_vtree_delete(struct bplus_vtree *tree, const void *key, int klen);
+long bplus_vtree_get_range(struct bplus_vtree *tree, const void *lo, int lolen, const void *hi, int hilen,
+                           bplus_vtree_fn fn, void *arg);
+
+#endif  /* _BPLUS_TREE_VAR_H */
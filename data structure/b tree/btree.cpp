@@ -5,6 +5,11 @@
 #include <cstring>
 #include <cstdlib> 
 #include <queue>
+#include <vector>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 namespace btree{
 
@@ -22,7 +27,7 @@ namespace btree{
  * 在结点p中查找关键字k的插入位置i
  */
 template<typename KeyType>
-bool BTree<KeyType>::_searchNode(BTree<KeyType>::BTNode *p, KeyType key, size_t &idx) const {
+bool BTree<KeyType>::_searchNode(BTree<KeyType>::BTNode *p, const KeyType &key, size_t &idx) {
 
     if(p->keynum < 16) {
         for(idx = 0; idx < p->keynum && p->key[idx+1] <= key; ++idx);
@@ -50,10 +55,20 @@ bool BTree<KeyType>::_searchNode(BTree<KeyType>::BTNode *p, KeyType key, size_t
  * 否则特征值sucess = 0, 关键字k的插入位置为pt结点的第idx个
  */
 template<typename KeyType>
-bool BTree<KeyType>::_searchBTree(KeyType key, BTree<KeyType>::BTNode *&p, size_t &idx) const {
+bool BTree<KeyType>::_searchBTree(const KeyType &key, BTree<KeyType>::BTNode *&p, size_t &idx) const {
+    return _searchFrom(root, key, p, idx);
+}
+
+/*
+ * 从结点from向下查找，from的子树须包含key的位置
+ */
+template<typename KeyType>
+bool BTree<KeyType>::_searchFrom(BTree<KeyType>::BTNode *from, const KeyType &key, BTree<KeyType>::BTNode *&p, size_t &idx) const {
     BTNode *p_par = NULL;                         //初始化结点p和结点q,p指向待查结点,q指向p的双亲               
-    p = root;
+    p = from;
+    BTREE_COUNT(searches, 1);
     while(p != NULL){
+        BTREE_COUNT(node_visits, 1);
         if(_searchNode(p, key, idx)) {
             return true;
         } else{                                       //查找失败 
@@ -66,12 +81,97 @@ bool BTree<KeyType>::_searchBTree(KeyType key, BTree<KeyType>::BTNode *&p, size_
     return false;                                     //查找失败
 }
 
+/*
+ * 插入前的查找。BTREE_COW下从根往下把与快照共享的结点复制一份再走，路径上的结点
+ * 都只属于本树且双亲指针正确，之后可以就地修改；否则就是_searchBTree
+ */
+template<typename KeyType>
+bool BTree<KeyType>::_searchPath(const KeyType &key, BTree<KeyType>::BTNode *&p, size_t &idx) {
+#ifdef BTREE_COW
+    BTNode *p_par = NULL;
+    _own(root);
+    p = root;
+    BTREE_COUNT(searches, 1);
+    while(p != NULL){
+        BTREE_COUNT(node_visits, 1);
+        if(_searchNode(p, key, idx))
+            return true;
+        p_par = p;
+        p = p->ptr[idx] != NULL ? _unshare(p, idx) : NULL;
+    }
+    p = p_par;
+    return false;
+#else
+    return _searchBTree(key, p, idx);
+#endif
+}
+
+#ifdef BTREE_COW
+/*
+ * 复制结点p，孩子由两份共同引用，p少一个引用(它原来的引用者改指向副本)
+ */
+template<typename KeyType>
+typename BTree<KeyType>::BTNode *BTree<KeyType>::_clone(BTNode *p) {
+    BTREE_COUNT(copies, 1);
+    BTNode *q = new BTNode(m);
+    for(size_t i = 1; i <= p->keynum; ++i)
+        new(&q->key[i]) KeyType(p->key[i]);
+    q->keynum = p->keynum;
+    memcpy(q->ptr, p->ptr, (p->keynum + 1) * sizeof(BTNode *));
+    for(size_t i = 0; i <= q->keynum; ++i)
+        if(q->ptr[i] != NULL)
+            q->ptr[i]->ref++;
+#ifdef BTREE_RANK
+    q->size = p->size;
+#endif
+    p->ref--;
+    return q;
+}
+#endif
+
+/*
+ * 修改子树的根p之前调用：BTREE_COW下p与快照共享时换成只属于本树的副本，双亲为NULL
+ */
+template<typename KeyType>
+void BTree<KeyType>::_own(BTree<KeyType>::BTNode *&p) {
+#ifdef BTREE_COW
+    if(p != NULL && p->ref > 1)
+        p = _clone(p);
+#else
+    (void) p;
+#endif
+}
+
+/*
+ * 修改p->ptr[idx]之前调用(p须只属于本树)：共享时换成副本，并挂回p下，返回该孩子
+ */
+template<typename KeyType>
+typename BTree<KeyType>::BTNode *BTree<KeyType>::_unshare(BTNode *p, size_t idx) {
+    BTNode *c = p->ptr[idx];
+#ifdef BTREE_COW
+    if(c->ref > 1)
+        c = p->ptr[idx] = _clone(c);
+#endif
+    c->parent = p;
+    return c;
+}
+
 template<typename KeyType>
 bool BTree<KeyType>::search(KeyType &key) {
     
-    BTNode *p; 
+    BTNode *p = root; 
     size_t idx;
-    if(_searchBTree(key, p, idx)) {
+#ifdef BTREE_FINGER
+    if(finger != NULL){                               //首末关键字之间的key必在该结点的子树中
+        for(p = finger; p->parent != NULL && (key < p->key[1] || p->key[p->keynum] < key); p = p->parent)
+            BTREE_COUNT(node_visits, 1);
+    }
+#endif
+    bool found = _searchFrom(p, key, p, idx);
+#ifdef BTREE_FINGER
+    finger = p;
+#endif
+    if(found) {
         key = p->key[idx];
         return true;
     }
@@ -79,14 +179,37 @@ bool BTree<KeyType>::search(KeyType &key) {
 }
 
 /*
- * 将关键字key和结点q分别插入到p->key[idx+1] 和 p->ptr[idx+1]中
+ * 把src开始的n个关键字搬到dst(两段可以重叠)：之后dst处的n个是构造过的对象，src处
+ * 不与dst重叠的部分成为未构造的存储。可平凡复制的关键字直接memmove，否则逐个
+ * 移动构造到新位置再析构旧的，按重叠的方向决定先搬哪一头
+ */
+template<typename KeyType>
+void BTree<KeyType>::_moveKeys(KeyType *dst, KeyType *src, size_t n) {
+    if(std::is_trivially_copyable<KeyType>::value){
+        memmove((void *) dst, (const void *) src, n * sizeof(KeyType));
+    }else if(dst < src){
+        for(size_t i = 0; i < n; ++i){
+            new(dst + i) KeyType(std::move(src[i]));
+            src[i].~KeyType();
+        }
+    }else if(dst > src){
+        for(size_t i = n; i-- > 0; ){
+            new(dst + i) KeyType(std::move(src[i]));
+            src[i].~KeyType();
+        }
+    }
+}
+
+/*
+ * 将关键字key和结点q分别插入到p->key[idx+1] 和 p->ptr[idx+1]中，key被移入
  */
 
 template<typename KeyType>
-void BTree<KeyType>::_insertBTNode(BTree<KeyType>::BTNode *&p, size_t idx, KeyType key, BTNode *q) {
-    memmove(&(p->key[idx + 2]), &(p->key[idx + 1]), (p->keynum - idx) * sizeof(KeyType));
+void BTree<KeyType>::_insertBTNode(BTree<KeyType>::BTNode *&p, size_t idx, KeyType &key, BTNode *q) {
+    BTREE_COUNT(insert_bytes_moved, (p->keynum - idx) * (sizeof(KeyType) + sizeof(BTNode *)));
+    _moveKeys(&(p->key[idx + 2]), &(p->key[idx + 1]), p->keynum - idx);
     memmove(&(p->ptr[idx + 2]), &(p->ptr[idx + 1]), (p->keynum - idx) * sizeof(BTNode *)); 
-    p->key[idx + 1] = key;
+    new(&(p->key[idx + 1])) KeyType(std::move(key));
     p->ptr[idx + 1] = q;
     if(q != NULL) 
         q->parent = p;
@@ -96,13 +219,15 @@ void BTree<KeyType>::_insertBTNode(BTree<KeyType>::BTNode *&p, size_t idx, KeyTy
 
 template<typename KeyType>
 void BTree<KeyType>::_splitBTNode(BTree<KeyType>::BTNode *p, BTree<KeyType>::BTNode *&q) {
-//将结点p分裂成两个结点,前一半保留, 后一半移入结点q
+//将结点p分裂成两个结点,前一半保留, 后一半移入结点q。中间的p->key[s]不再计入p，由调用者移走并析构
 
+    BTREE_COUNT(splits, 1);
+    BTREE_TRACE("split", p);
     size_t s = (m + 1) >> 1;
     q = new BTNode(m);             //给结点q分配空间
 
     q->ptr[0] = p->ptr[s];                            //后一半移入结点q
-    memmove(&(q->key[1]), &(p->key[s + 1]), (m - s) * sizeof(KeyType));
+    _moveKeys(&(q->key[1]), &(p->key[s + 1]), m - s);
     memmove(q->ptr, &(p->ptr[s]), (m - s + 1) * sizeof(BTNode *));
     
 
@@ -114,22 +239,33 @@ void BTree<KeyType>::_splitBTNode(BTree<KeyType>::BTNode *p, BTree<KeyType>::BTN
             q->ptr[i]->parent = q;
 
     p->keynum = s - 1;                                  //结点p的前一半保留,修改结点p的keynum
+    if(p == tail)                                       //最右叶子的后一半成为新的最右叶子
+        tail = q;
+#ifdef BTREE_RANK
+    q->size = q->keynum;
+    for(size_t i = 0; i <= q->keynum; ++i)
+        q->size += _size(q->ptr[i]);
+    p->size -= q->size + 1;                             //p->key[s]上移到双亲
+#endif
 }
 
 
 template<typename KeyType>
-void BTree<KeyType>::_newRoot(KeyType key, BTree<KeyType>::BTNode *p, BTree<KeyType>::BTNode *q) {
-//生成新的根结点t,原p和q为子树指针
+void BTree<KeyType>::_newRoot(KeyType &key, BTree<KeyType>::BTNode *p, BTree<KeyType>::BTNode *q) {
+//生成新的根结点t,原p和q为子树指针，key被移入
     root = new BTNode(m);             //分配空间 
+    new(&(root->key[1])) KeyType(std::move(key));
     root->keynum = 1;
     root->ptr[0] = p;
     root->ptr[1] = q;
-    root->key[1] = key;
     if(p != NULL)                                     //调整结点p和结点q的双亲指针 
         p->parent = root;
     if(q != NULL) 
         q->parent = root;
     root->parent = NULL;
+#ifdef BTREE_RANK
+    root->size = 1 + _size(p) + _size(q);
+#endif
 }
 
 
@@ -137,29 +273,42 @@ void BTree<KeyType>::_newRoot(KeyType key, BTree<KeyType>::BTNode *p, BTree<KeyT
  * 在树t上结点q的key[idx]与key[idx+1]之间插入关键字k。若引起
  * 结点过大,则沿双亲链进行必要的结点分裂调整 */
 template<typename KeyType>
-void BTree<KeyType>::_insertBTree(BTree<KeyType>::BTNode *p, size_t idx, KeyType key) {
-    BTNode *q = NULL;
-    size_t  s;                   //设定需要新结点标志和插入完成标志 
-    if(p == NULL)                                     //t是空树
+void BTree<KeyType>::_insertBTree(BTree<KeyType>::BTNode *p, size_t idx, KeyType &key) {
+    if(p == NULL){                                    //t是空树
         _newRoot(key, NULL, NULL);                     //生成仅含关键字k的根结点t
+        tail = root;
+    }
     else{
-        KeyType x = key;
-        while(1){
-            _insertBTNode(p, idx, x, q);                  //将关键字x和结点q分别插入到p->key[i+1]和p->ptr[i+1]
-            if (p->keynum <= max_keynum) 
-                return; 
-            _splitBTNode(p, q);                   //分裂结点 
-            
-            x = p->key[(m + 1) >> 1];
-            if(p->parent){                      //p不是根，查找x的插入位置
-                p = p->parent;
-                _searchNode(p, x, idx);
-            }else{                                //p是根，需要建一个根，保存关键字x, p,q为两个儿子 
-                _newRoot(x, p, q);
-                return;
-            }
-            
+#ifdef BTREE_RANK
+        for(BTNode *a = p; a != NULL; a = a->parent)       //新关键字计入路径上的每棵子树
+            a->size++;
+#endif
+        _insertBTNode(p, idx, key, NULL);                 //将关键字key插入到p->key[i+1]
+        _splitUp(p);
+    }
+}
+
+
+/*
+ * 结点p过大时分裂，中间关键字插入双亲，沿双亲链直到不再过大，必要时生成新根
+ */
+template<typename KeyType>
+void BTree<KeyType>::_splitUp(BTree<KeyType>::BTNode *p) {
+    BTNode *q;
+    size_t idx;
+    while(p->keynum > max_keynum){
+        _splitBTNode(p, q);                           //分裂结点 
+        KeyType &x = p->key[(m + 1) >> 1];            //中间关键字移入双亲后析构
+        BTNode *par = p->parent;
+        if(par == NULL){                              //p是根，需要建一个根，保存关键字x, p,q为两个儿子 
+            _newRoot(x, p, q);
+            x.~KeyType();
+            return;
         }
+        _searchNode(par, x, idx);                     //p不是根，查找x的插入位置
+        _insertBTNode(par, idx, x, q);
+        x.~KeyType();
+        p = par;
     }
 }
 
@@ -167,8 +316,19 @@ void BTree<KeyType>::_insertBTree(BTree<KeyType>::BTNode *p, size_t idx, KeyType
 template<typename KeyType>
 bool BTree<KeyType>::insert(KeyType key) {
     BTNode *p;
-    size_t idx;
-    if(_searchBTree(key, p, idx)) return false;
+    size_t idx = 0;                                   //空树时查找不设置idx
+#ifndef BTREE_COW
+    if(root != NULL){                                 //递增的关键字不必从根查找，直接追加到最右叶子
+        if(tail == NULL)
+            for(tail = root; tail->ptr[0] != NULL; tail = tail->ptr[tail->keynum]);
+        if(tail->key[tail->keynum] < key){
+            BTREE_COUNT(appends, 1);
+            _insertBTree(tail, tail->keynum, key);
+            return true;
+        }
+    }
+#endif
+    if(_searchPath(key, p, idx)) return false;
     _insertBTree(p, idx, key);
     return true;
 }
@@ -178,7 +338,8 @@ bool BTree<KeyType>::insert(KeyType key) {
  * 从p结点删除key[idx]和它的孩子指针ptr[idx]
  */
 #define _removeChildWithIdx(p, idx) do { \
-    memmove(&(p->key[idx]), &(p->key[idx + 1]), (p->keynum - idx) * sizeof(KeyType));\
+    p->key[idx].~KeyType();\
+    _moveKeys(&(p->key[idx]), &(p->key[idx + 1]), p->keynum - idx);\
     memmove(&(p->ptr[idx]), &(p->ptr[idx + 1]), (p->keynum - idx) * sizeof(BTNode *));\
     p->keynum--; \
  }while(0)
@@ -186,13 +347,15 @@ bool BTree<KeyType>::insert(KeyType key) {
 
 /*
  * 右子树边最小的关键字。左边是小于关键字的，右边是大于等于关键字的。
+ * 与p->key[idx]交换而不是复制，要删的关键字换到最左叶子的key[1]，仍比右子树的都小，
+ * 按它查找正好走到那里。路径即随后删除要走的路径，先取得它们再改
  */
 
 template<typename KeyType>
 inline void BTree<KeyType>::_substitution(BTree<KeyType>::BTNode *p, size_t idx) {
     BTNode *q;
-    for(q = p->ptr[idx]; q->ptr[0] != NULL; q = q->ptr[0]);
-    p->key[idx] = q->key[1];                            //复制关键字值
+    for(q = _unshare(p, idx); q->ptr[0] != NULL; q = _unshare(q, 0));
+    std::swap(p->key[idx], q->key[1]);
 }
 
 /*
@@ -205,17 +368,26 @@ void BTree<KeyType>::_moveRight(BTree<KeyType>::BTNode *p, size_t idx) {
 将左结点aq中的最后一个关键字移入双亲结点p中*/ 
     BTNode *q = p->ptr[idx];
     BTNode *aq = p->ptr[idx - 1];
+    BTREE_COUNT(move_rights, 1);
+    BTREE_TRACE("move_right", p);
 
-    memmove(&(q->key[2]), &(q->key[1]), q->keynum * sizeof(KeyType)); //将右兄弟q中所有关键字向后移动一位
+    _moveKeys(&(q->key[2]), &(q->key[1]), q->keynum); //将右兄弟q中所有关键字向后移动一位
     memmove(&(q->ptr[1]), q->ptr, (q->keynum + 1) * sizeof(BTNode *));
 
      //从双亲结点p移动关键字到右兄弟q中
-    q->key[1] = p->key[idx];
+    new(&(q->key[1])) KeyType(std::move(p->key[idx]));
     q->keynum++;
 
-    p->key[idx] = aq->key[aq->keynum];                  //将左兄弟aq中最后一个关键字移动到双亲结点p中
+    p->key[idx] = std::move(aq->key[aq->keynum]);       //将左兄弟aq中最后一个关键字移动到双亲结点p中
+    aq->key[aq->keynum].~KeyType();
     q->ptr[0] = aq->ptr[aq->keynum];
+    if(q->ptr[0] != NULL)                               //移动的孩子改挂到q下
+        q->ptr[0]->parent = q;
     aq->keynum--;
+#ifdef BTREE_RANK
+    q->size += 1 + _size(q->ptr[0]);
+    aq->size -= 1 + _size(q->ptr[0]);
+#endif
 }
 
 /*
@@ -227,15 +399,24 @@ void BTree<KeyType>::_moveLeft(BTree<KeyType>::BTNode *p, size_t idx) {
 
     BTNode *q = p->ptr[idx];
     BTNode *aq = p->ptr[idx - 1];
+    BTREE_COUNT(move_lefts, 1);
+    BTREE_TRACE("move_left", p);
 
     aq->keynum++;                                   //把双亲结点p中的关键字移动到左兄弟aq中
-    aq->key[aq->keynum] = p->key[idx]; 
+    new(&(aq->key[aq->keynum])) KeyType(std::move(p->key[idx]));
     aq->ptr[aq->keynum] = q->ptr[0];
+    if(aq->ptr[aq->keynum] != NULL)                     //移动的孩子改挂到aq下
+        aq->ptr[aq->keynum]->parent = aq;
+#ifdef BTREE_RANK
+    aq->size += 1 + _size(q->ptr[0]);
+    q->size -= 1 + _size(q->ptr[0]);
+#endif
 
-    p->key[idx] = q->key[1];                            //把右兄弟q中的关键字移动到双亲节点p中
+    p->key[idx] = std::move(q->key[1]);                 //把右兄弟q中的关键字移动到双亲节点p中
+    q->key[1].~KeyType();
 
     q->keynum--;
-    memmove(&(q->key[1]), &(q->key[2]), q->keynum * sizeof(KeyType));       //将右兄弟q中所有关键字向前移动一位
+    _moveKeys(&(q->key[1]), &(q->key[2]), q->keynum);   //将右兄弟q中所有关键字向前移动一位
     memmove(q->ptr, &(q->ptr[1]), (q->keynum + 1) * sizeof(BTNode *));
     
 }
@@ -248,27 +429,38 @@ template<typename KeyType>
 void BTree<KeyType>::_combine(BTree<KeyType>::BTNode *p, size_t idx) {
     BTNode *q = p->ptr[idx];                            
     BTNode *aq = p->ptr[idx - 1];
+    BTREE_COUNT(combines, 1);
+    BTREE_TRACE("combine", p);
 
     aq->keynum++;                                  //将双亲结点的关键字p->key[i]插入到左结点aq     
-    aq->key[aq->keynum] = p->key[idx];
+    new(&(aq->key[aq->keynum])) KeyType(std::move(p->key[idx]));
     aq->ptr[aq->keynum] = q->ptr[0];
     if(aq->ptr[aq->keynum]){
         aq->ptr[aq->keynum]->parent = aq;
     }
 
-    for(size_t j = 1; j <= q->keynum; ++j){                      //将右结点q中的所有关键字插入到左结点aq 
+    _moveKeys(&(aq->key[aq->keynum + 1]), &(q->key[1]), q->keynum);     //将右结点q中的所有关键字插入到左结点aq 
+    for(size_t j = 1; j <= q->keynum; ++j){
         aq->keynum++;
-        aq->key[aq->keynum] = q->key[j];
         aq->ptr[aq->keynum] = q->ptr[j];
         if(q->ptr[j] != NULL)
             aq->ptr[aq->keynum]->parent = aq;
     }
+    q->keynum = 0;                                  //关键字都已移走，析构时不再析构
 
-    for(size_t j = idx; j < p->keynum; ++j){                       //将双亲结点p中的p->key[i]后的所有关键字向前移动一位 
-        p->key[j] = p->key[j + 1];
-        p->ptr[j] = p->ptr[j + 1];
-    }
+    p->key[idx].~KeyType();                         //将双亲结点p中的p->key[i]后的所有关键字向前移动一位 
+    _moveKeys(&(p->key[idx]), &(p->key[idx + 1]), p->keynum - idx);
+    memmove(&(p->ptr[idx]), &(p->ptr[idx + 1]), (p->keynum - idx) * sizeof(BTNode *));
     p->keynum--;                                    //修改双亲结点p的keynum值 
+#ifdef BTREE_RANK
+    aq->size += 1 + q->size;
+#endif
+    if(q == tail)
+        tail = aq;
+#ifdef BTREE_FINGER
+    if(q == finger)
+        finger = aq;
+#endif
     delete q;                                        //释放空右结点q的空间
 }
 
@@ -278,6 +470,10 @@ void BTree<KeyType>::_combine(BTree<KeyType>::BTNode *p, size_t idx) {
 
 template<typename KeyType>
 void BTree<KeyType>::_adjustBTree(BTNode *p, size_t idx){
+    if(idx > 0)                                          //借位或合并会改写的兄弟
+        _unshare(p, idx - 1);
+    if(idx < p->keynum)
+        _unshare(p, idx + 1);
     if(idx == 0){                                        //删除的是最左边关键字
         if(p->ptr[1]->keynum > min_keynum)                   //右结点可以借
             _moveLeft(p, 1);
@@ -302,7 +498,7 @@ void BTree<KeyType>::_adjustBTree(BTNode *p, size_t idx){
  */
 
 template<typename KeyType>
-bool BTree<KeyType>::_btNodeDelete(BTree<KeyType>::BTNode *p, KeyType key) {
+bool BTree<KeyType>::_btNodeDelete(BTree<KeyType>::BTNode *p, const KeyType &key) {
                                   //查找标志 
     if(p == NULL)                                     
         return false;
@@ -312,12 +508,16 @@ bool BTree<KeyType>::_btNodeDelete(BTree<KeyType>::BTNode *p, KeyType key) {
         if(found){                           //查找成功 
             if(p->ptr[idx] != NULL){             //删除的是非叶子结点
                 _substitution(p, idx);                //寻找相邻关键字(右子树中最小的关键字) 
-                _btNodeDelete(p->ptr[idx], p->key[idx]);  //执行删除操作（这里可优化）
+                _btNodeDelete(p->ptr[idx], key);      //key已换到最左叶子
             }else{                                    //叶子节点
                 _removeChildWithIdx(p, idx);                        //从结点p中位置i处删除关键字
             }
         }else
-            found = _btNodeDelete(p->ptr[idx], key);    //沿孩子结点递归查找并删除关键字key
+            found = _btNodeDelete(p->ptr[idx] != NULL ? _unshare(p, idx) : NULL, key);    //沿孩子结点递归查找并删除关键字key
+#ifdef BTREE_RANK
+        if(found)
+            p->size--;
+#endif
 
         if(p->ptr[idx] != NULL && p->ptr[idx]->keynum < min_keynum)               //删除后关键字个数小于min_keynum
                 _adjustBTree(p, idx);                   //调整B树
@@ -331,6 +531,7 @@ bool BTree<KeyType>::_btNodeDelete(BTree<KeyType>::BTNode *p, KeyType key) {
 template<typename KeyType>
 void BTree<KeyType>::del(KeyType key){
 //构建删除框架，执行删除操作  
+    _own(root);
     bool r = _btNodeDelete(root, key);                        //删除关键字k 
 
     if(r && root->keynum == 0){     //当根只有一个key且儿子发生combine时才会发生这种情况  
@@ -340,6 +541,12 @@ void BTree<KeyType>::del(KeyType key){
         if(root){
             root->parent = NULL;
         }
+        if(p == tail)
+            tail = NULL;
+#ifdef BTREE_FINGER
+        if(p == finger)
+            finger = NULL;
+#endif
         delete p;
     }
 }
@@ -348,6 +555,12 @@ void BTree<KeyType>::del(KeyType key){
 template<typename KeyType>
 void BTree<KeyType>::_destroyBTree(BTNode* &p){
     if(p == NULL) return;
+#ifdef BTREE_COW
+    if(--p->ref > 0){                                   //还有别的树或快照引用
+        p = NULL;
+        return;
+    }
+#endif
     //递归释放B树                                   //B树不为空  
     for(size_t i = 0; i <= p->keynum; ++i){                  //递归释放每一个结点 
         _destroyBTree(p->ptr[i]);  
@@ -356,6 +569,689 @@ void BTree<KeyType>::_destroyBTree(BTNode* &p){
     p = NULL;  
 }  
 
+/*
+ * BTREE_COW下共享子树p，多一个引用；否则逐个结点复制，双亲指针指向副本
+ */
+template<typename KeyType>
+typename BTree<KeyType>::BTNode *BTree<KeyType>::_copyBTree(const BTNode *p, BTNode *parent) const {
+    if(p == NULL) return NULL;
+#ifdef BTREE_COW
+    BTNode *q = const_cast<BTNode *>(p);
+    q->ref++;
+    (void) parent;
+#else
+    BTNode *q = new BTNode(m);
+    for(size_t i = 1; i <= p->keynum; ++i)
+        new(&q->key[i]) KeyType(p->key[i]);
+    q->keynum = p->keynum;
+    q->parent = parent;
+    for(size_t i = 0; i <= p->keynum; ++i)
+        q->ptr[i] = _copyBTree(p->ptr[i], q);
+#ifdef BTREE_RANK
+    q->size = p->size;
+#endif
+#endif
+    return q;
+}
+
+template<typename KeyType>
+BTree<KeyType>::BTree(const BTree &other): m(other.m),
+                max_keynum(other.max_keynum),
+                min_keynum(other.min_keynum),
+                root(NULL),
+                tail(NULL){
+#ifdef BTREE_FINGER
+    finger = NULL;
+#endif
+    reset_stats();
+    root = _copyBTree(other.root, NULL);
+}
+
+/*
+ * 先复制再释放原有的，自己赋给自己也不出错
+ */
+template<typename KeyType>
+BTree<KeyType> &BTree<KeyType>::operator=(const BTree &other) {
+    BTNode *p = root;
+    m = other.m;
+    max_keynum = other.max_keynum;
+    min_keynum = other.min_keynum;
+    root = _copyBTree(other.root, NULL);
+    _destroyBTree(p);
+    tail = NULL;
+#ifdef BTREE_FINGER
+    finger = NULL;
+#endif
+    return *this;
+}
+
+#ifdef BTREE_COW
+template<typename KeyType>
+void BTree<KeyType>::snapshot(BTreeSnapshot<KeyType> &snap) const {
+    if(root != NULL)
+        root->ref++;
+    snap.release();
+    snap.root = root;
+}
+
+template<typename KeyType>
+void BTreeSnapshot<KeyType>::release() {
+    BTree<KeyType>::_destroyBTree(root);
+}
+
+template<typename KeyType>
+bool BTreeSnapshot<KeyType>::search(KeyType &key) const {
+    size_t idx;
+    for(BTNode *p = root; p != NULL; p = p->ptr[idx]){
+        if(BTree<KeyType>::_searchNode(p, key, idx)){
+            key = p->key[idx];
+            return true;
+        }
+    }
+    return false;
+}
+
+template<typename KeyType>
+template<typename Visitor>
+void BTreeSnapshot<KeyType>::visit(Visitor fn) const {
+    BTree<KeyType>::_visit(root, fn);
+}
+#endif
+
+
+/*
+ * 连接两棵树：l的关键字都小于mid，r的关键字都大于mid，hl/hr为树高(空树为0，叶子为1)。
+ * 矮的一棵连同mid挂到高的一棵边上高度相同的位置，不足的根先与兄弟借位或合并，
+ * 再沿双亲链分裂，只涉及高度差个结点。mid被移入树中。返回新根(双亲为NULL)，h为新树高
+ */
+template<typename KeyType>
+typename BTree<KeyType>::BTNode *BTree<KeyType>::_join(BTNode *l, size_t hl, KeyType &mid, BTNode *r, size_t hr, size_t &h) {
+    BTNode *p;
+    size_t d;
+    _own(l);
+    _own(r);
+    if(hl == hr){
+        _newRoot(mid, l, r);                          //两棵空树时即为仅含mid的根
+        p = root;
+        h = hl + 1;
+        if(l == NULL)
+            return p;
+        if(l->keynum + r->keynum + 1 <= max_keynum){  //装得下，并成一个结点
+            _combine(p, 1);
+            delete p;
+            l->parent = NULL;
+            h = hl;
+            return l;
+        }
+        while(l->keynum < min_keynum)                 //两个根并排，不足的向另一个借
+            _moveLeft(p, 1);
+        while(r->keynum < min_keynum)
+            _moveRight(p, 1);
+        return p;
+    }
+
+    if(hl > hr){                                      //r挂到l最右边高为hr+1的结点上
+        for(p = l, d = hl; d > hr + 1; --d)
+            p = _unshare(p, p->keynum);
+#ifdef BTREE_RANK
+        for(BTNode *a = p; a != NULL; a = a->parent)
+            a->size += 1 + _size(r);
+#endif
+        _insertBTNode(p, p->keynum, mid, r);
+        if(r != NULL && r->keynum < min_keynum){
+            _unshare(p, p->keynum - 1);
+            if(p->ptr[p->keynum - 1]->keynum + r->keynum + 1 <= max_keynum)
+                _combine(p, p->keynum);
+            else while(r->keynum < min_keynum)
+                _moveRight(p, p->keynum);
+        }
+    }else{                                            //l挂到r最左边高为hl+1的结点上
+        for(p = r, d = hr; d > hl + 1; --d)
+            p = _unshare(p, 0);
+#ifdef BTREE_RANK
+        for(BTNode *a = p; a != NULL; a = a->parent)
+            a->size += 1 + _size(l);
+#endif
+        _moveKeys(&(p->key[2]), &(p->key[1]), p->keynum);
+        memmove(&(p->ptr[1]), p->ptr, (p->keynum + 1) * sizeof(BTNode *));
+        new(&(p->key[1])) KeyType(std::move(mid));
+        p->ptr[0] = l;
+        if(l != NULL)
+            l->parent = p;
+        p->keynum++;
+        if(l != NULL && l->keynum < min_keynum){
+            _unshare(p, 1);
+            if(p->ptr[1]->keynum + l->keynum + 1 <= max_keynum)
+                _combine(p, 1);
+            else while(l->keynum < min_keynum)
+                _moveLeft(p, 1);
+        }
+    }
+    _splitUp(p);
+
+    BTNode *top = hl > hr ? l : r;
+    h = hl > hr ? hl : hr;
+    for(; p->parent != NULL; p = p->parent);
+    if(p != top)                                      //根分裂过
+        h++;
+    return p;
+}
+
+/*
+ * 把以p为根、高为h的子树按key分成两棵：小于key(inclusive时小于等于key)的关键字在l，
+ * 其余在r。沿查找路径自底向上，每层把结点在路径左右两侧的部分分别与下层得到的两棵树连接，
+ * 结点拆开重用，只涉及O(log n)个结点
+ */
+template<typename KeyType>
+void BTree<KeyType>::_split(BTNode *p, size_t h, const KeyType &key, bool inclusive, BTNode *&l, size_t &hl, BTNode *&r, size_t &hr) {
+    if(p == NULL){
+        l = r = NULL;
+        hl = hr = 0;
+        return;
+    }
+    size_t idx;
+    if(_searchNode(p, key, idx) && !inclusive)        //idx为留在左边的关键字个数
+        --idx;
+    BTNode *cl, *cr, *q;
+    size_t hcl, hcr, hq;
+    _split(p->ptr[idx] != NULL ? _unshare(p, idx) : NULL, h - 1, key, inclusive, cl, hcl, cr, hcr);
+
+    //右侧：key[idx+1]作连接关键字，key[idx+2..]和ptr[idx+1..]移入新结点q，只剩一个孩子时q就是该孩子
+    if(idx == p->keynum){
+        r = cr;
+        hr = hcr;
+    }else{
+        size_t n = p->keynum - idx - 1;
+        if(n == 0){
+            q = p->ptr[idx + 1];
+            hq = h - 1;
+        }else{
+            q = new BTNode(m);
+            _moveKeys(&(q->key[1]), &(p->key[idx + 2]), n);
+            memmove(q->ptr, &(p->ptr[idx + 1]), (n + 1) * sizeof(BTNode *));
+            q->keynum = n;
+            for(size_t i = 0; i <= n; ++i)
+                if(q->ptr[i] != NULL)
+                    q->ptr[i]->parent = q;
+#ifdef BTREE_RANK
+            q->size = n;
+            for(size_t i = 0; i <= n; ++i)
+                q->size += _size(q->ptr[i]);
+#endif
+            hq = h;
+        }
+        if(q != NULL)
+            q->parent = NULL;
+        r = _join(cr, hcr, p->key[idx + 1], q, hq, hr);
+        p->key[idx + 1].~KeyType();
+    }
+    p->keynum = idx;                                  //key[idx+1..]已移走
+
+    //左侧：key[idx]作连接关键字，p保留key[1..idx-1]和ptr[0..idx-1]
+    if(idx == 0){
+        delete p;
+        l = cl;
+        hl = hcl;
+        return;
+    }
+    KeyType x(std::move(p->key[idx]));
+    p->key[idx].~KeyType();
+    p->keynum = idx - 1;
+    if(idx == 1){
+        q = p->ptr[0];
+        hq = h - 1;
+        delete p;
+    }else{
+        q = p;
+#ifdef BTREE_RANK
+        q->size = q->keynum;
+        for(size_t i = 0; i <= q->keynum; ++i)
+            q->size += _size(q->ptr[i]);
+#endif
+        hq = h;
+    }
+    if(q != NULL)
+        q->parent = NULL;
+    l = _join(q, hq, x, cl, hcl, hl);
+}
+
+template<typename KeyType>
+void BTree<KeyType>::split_at(KeyType key, BTree &right) {
+    assert(right.m == m);
+    _destroyBTree(right.root);
+    tail = right.tail = NULL;
+#ifdef BTREE_FINGER
+    finger = right.finger = NULL;
+#endif
+    BTNode *l, *r;
+    size_t hl, hr;
+    _own(root);
+    _split(root, _height(root), key, false, l, hl, r, hr);
+    root = l;
+    right.root = r;
+}
+
+/*
+ * 取出右边一棵树的最小关键字作连接关键字，只需一次删除和一次_join
+ */
+template<typename KeyType>
+bool BTree<KeyType>::join(BTree &other) {
+    if(m != other.m)
+        return false;
+    tail = other.tail = NULL;
+#ifdef BTREE_FINGER
+    finger = other.finger = NULL;
+#endif
+    if(other.root == NULL)
+        return true;
+    if(root == NULL){
+        root = other.root;
+        other.root = NULL;
+        return true;
+    }
+
+    const KeyType *lmax, *rmin;
+    BTNode *p;
+    for(p = root; p->ptr[0] != NULL; p = p->ptr[p->keynum]);
+    lmax = &p->key[p->keynum];
+    for(p = other.root; p->ptr[0] != NULL; p = p->ptr[0]);
+    rmin = &p->key[1];
+    BTree *left = this, *right = &other;
+    if(!(*lmax < *rmin)){                             //other在左边
+        for(p = other.root; p->ptr[0] != NULL; p = p->ptr[p->keynum]);
+        lmax = &p->key[p->keynum];
+        for(p = root; p->ptr[0] != NULL; p = p->ptr[0]);
+        rmin = &p->key[1];
+        if(!(*lmax < *rmin))                          //关键字范围交叠
+            return false;
+        left = &other;
+        right = this;
+    }
+
+    KeyType mid(*rmin);                               //删除前取出，之后移入连接处
+    right->del(mid);
+    size_t h;
+    BTNode *l = left->root, *r = right->root;
+    other.root = NULL;
+    root = _join(l, _height(l), mid, r, _height(r), h);
+    return true;
+}
+
+/*
+ * 先后按lo、hi分裂出中间一棵树整棵释放，再连接两边
+ */
+template<typename KeyType>
+void BTree<KeyType>::erase_range(KeyType lo, KeyType hi) {
+    if(hi < lo || root == NULL)
+        return;
+    tail = NULL;
+#ifdef BTREE_FINGER
+    finger = NULL;
+#endif
+    BTNode *l, *mid, *x, *r;
+    size_t hl, hm, hx, hr;
+    _own(root);
+    _split(root, _height(root), lo, false, l, hl, mid, hm);
+    _split(mid, hm, hi, true, x, hx, r, hr);
+    _destroyBTree(x);
+
+    root = l;
+    BTree right(m);
+    right.root = r;
+    join(right);
+}
+
+
+/*
+ * 中序遍历，不打印，key按升序交给fn
+ */
+template<typename KeyType>
+template<typename Visitor>
+void BTree<KeyType>::_visit(const BTNode *p, Visitor &fn) {
+    if(p == NULL) return;
+    for(size_t i = 0; i < p->keynum; ++i){
+        _visit(p->ptr[i], fn);
+        fn(p->key[i + 1]);
+    }
+    _visit(p->ptr[p->keynum], fn);
+}
+
+template<typename KeyType>
+template<typename Visitor>
+void BTree<KeyType>::visit(Visitor fn) const {
+    _visit(root, fn);
+}
+
+
+/*
+ * 统计结点数、关键字数和填充率分布
+ */
+template<typename KeyType>
+void BTree<KeyType>::_collectStats(const BTNode *p, BTreeStats &st) const {
+    if(p == NULL) return;
+    st.nodes++;
+    st.keys += p->keynum;
+    size_t bucket = p->keynum * BTREE_FILL_BUCKETS / max_keynum;
+    st.fill[bucket < BTREE_FILL_BUCKETS ? bucket : BTREE_FILL_BUCKETS - 1]++;
+    if(p->ptr[0] == NULL) return;
+    for(size_t i = 0; i <= p->keynum; ++i)
+        _collectStats(p->ptr[i], st);
+}
+
+/*
+ * 计数快照，树高和填充率分布每次遍历整棵树求得
+ */
+template<typename KeyType>
+BTreeStats BTree<KeyType>::stats() const {
+    BTreeStats st;
+#ifdef BTREE_STATS
+    st = counters;
+#else
+    memset(&st, 0, sizeof(st));
+#endif
+    st.height = 0;
+    st.nodes = 0;
+    st.keys = 0;
+    memset(st.fill, 0, sizeof(st.fill));
+    for(const BTNode *p = root; p != NULL; p = p->ptr[0])
+        st.height++;
+    _collectStats(root, st);
+    return st;
+}
+
+template<typename KeyType>
+void BTree<KeyType>::reset_stats() {
+#ifdef BTREE_STATS
+    memset(&counters, 0, sizeof(counters));
+#endif
+}
+
+
+/*
+ * 先写文件头占位，按升序写出关键字后再补上个数
+ */
+template<typename KeyType>
+bool BTree<KeyType>::save(const char *path) const {
+    static_assert(std::is_trivially_copyable<KeyType>::value, "save writes keys byte by byte");
+    FILE *fp = fopen(path, "wb");
+    if(fp == NULL)
+        return false;
+    BTreeImageHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BTREE_IMAGE_MAGIC, sizeof(h.magic));
+    h.key_size = sizeof(KeyType);
+    h.m = m;
+    bool ok = fwrite(&h, sizeof(h), 1, fp) == 1;
+    visit([fp, &h, &ok](const KeyType &key) {
+        ok = ok && fwrite(&key, sizeof(KeyType), 1, fp) == 1;
+        h.count++;
+    });
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, fp) == 1;
+    return fclose(fp) == 0 && ok;
+}
+
+template<typename KeyType>
+bool BTree<KeyType>::load(const char *path) {
+    BTreeImage<KeyType> img;
+    if(!img.open(path))
+        return false;
+    _destroyBTree(root);
+    tail = NULL;
+#ifdef BTREE_FINGER
+    finger = NULL;
+#endif
+    _build(img.keys(), img.size());
+    return true;
+}
+
+/*
+ * 由n个升序关键字自底向上逐层建树。每层把关键字平均分给最少的结点，相邻结点之间
+ * 留一个关键字作为上一层的关键字，上一层再同样分配，直到只剩一个根。
+ * 结点数取(n+1)/m上取整时每个结点不少于min_keynum个关键字，总共线性时间
+ */
+template<typename KeyType>
+void BTree<KeyType>::_build(const KeyType *keys, size_t n) {
+    std::vector<KeyType> up;
+    std::vector<BTNode *> level;
+    root = NULL;
+    if(n == 0)
+        return;
+    while(true){
+        size_t cnt = (n + m) / m;                       //结点数
+        size_t each = (n - cnt + 1) / cnt, extra = (n - cnt + 1) % cnt;
+        std::vector<KeyType> sep;
+        std::vector<BTNode *> next;
+        sep.reserve(cnt - 1);
+        next.reserve(cnt);
+        size_t k = 0, c = 0;
+        for(size_t i = 0; i < cnt; ++i){
+            BTNode *p = new BTNode(m);
+            p->keynum = each + (i < extra ? 1 : 0);
+            for(size_t j = 1; j <= p->keynum; ++j)
+                new(&p->key[j]) KeyType(keys[k++]);
+            if(!level.empty()){                         //依次接上下一层的结点
+                for(size_t j = 0; j <= p->keynum; ++j){
+                    p->ptr[j] = level[c++];
+                    p->ptr[j]->parent = p;
+                }
+            }
+#ifdef BTREE_RANK
+            p->size = p->keynum;
+            for(size_t j = 0; j <= p->keynum && p->ptr[j] != NULL; ++j)
+                p->size += p->ptr[j]->size;
+#endif
+            next.push_back(p);
+            if(i + 1 < cnt)
+                sep.push_back(keys[k++]);
+        }
+        level.swap(next);
+        if(cnt == 1)
+            break;
+        up.swap(sep);
+        keys = &up[0];
+        n = up.size();
+    }
+    root = level[0];
+}
+
+
+/*
+ * 中序遍历直接按Eytzinger下标写入，不需要中间数组
+ */
+template<typename KeyType>
+void BTree<KeyType>::freeze(FrozenBTree<KeyType> &frozen) const {
+    static_assert(std::is_trivially_copyable<KeyType>::value, "FrozenBTree keeps keys in raw memory");
+    size_t count = 0;
+    visit([&count](const KeyType &) { ++count; });
+    frozen._reserve(count);
+    size_t k = FrozenBTree<KeyType>::_first(count);
+    visit([&frozen, &k, count](const KeyType &key) {
+        frozen.b[k] = key;
+        k = FrozenBTree<KeyType>::_next(k, count);
+    });
+}
+
+
+template<typename KeyType>
+void FrozenBTree<KeyType>::_reserve(size_t count) {
+    static_assert(std::is_trivially_copyable<KeyType>::value, "FrozenBTree keeps keys in raw memory");
+    free(b);
+    b = NULL;
+    n = count;
+    if(posix_memalign((void **) &b, 64, (count + 1) * sizeof(KeyType)) != 0){
+        fprintf(stderr, "out of memory freezing %zu keys\r\n", count);
+        exit(-1);
+    }
+}
+
+/*
+ * 隐式树中序的第一个下标：从根一直往左
+ */
+template<typename KeyType>
+size_t FrozenBTree<KeyType>::_first(size_t count) {
+    size_t k = 1;
+    while(2 * k <= count)
+        k = 2 * k;
+    return k;
+}
+
+/*
+ * 中序的下一个下标：有右子树就到右子树最左，否则上移到第一个从左边上来的祖先
+ */
+template<typename KeyType>
+size_t FrozenBTree<KeyType>::_next(size_t k, size_t count) {
+    if(2 * k + 1 <= count){
+        k = 2 * k + 1;
+        while(2 * k <= count)
+            k = 2 * k;
+        return k;
+    }
+    while(k & 1)
+        k >>= 1;
+    return k >> 1;
+}
+
+template<typename KeyType>
+void FrozenBTree<KeyType>::build(const KeyType *keys, size_t count) {
+    _reserve(count);
+    size_t k = _first(count);
+    for(size_t i = 0; i < count; ++i){
+        b[k] = keys[i];
+        k = _next(k, count);
+    }
+}
+
+/*
+ * 第d层之后的2^d个后代在数组中连续，一个缓存行放L = 64/sizeof(KeyType)个关键字时，
+ * b[k*L]开始的一行就是k往下log2(L)层的全部后代，提前预取它。
+ * 走完后k的二进制去掉末尾的1和其后一个0，得到第一个不小于key的下标(0表示没有)
+ */
+template<typename KeyType>
+bool FrozenBTree<KeyType>::search(KeyType &key) const {
+    const size_t line = sizeof(KeyType) < 64 ? 64 / sizeof(KeyType) : 1;
+    size_t k = 1;
+    while(k <= n){
+        __builtin_prefetch(b + k * line);
+        k = 2 * k + (b[k] < key ? 1 : 0);
+    }
+    k >>= __builtin_ffsll(~k);
+    if(k != 0 && b[k] == key){
+        key = b[k];
+        return true;
+    }
+    return false;
+}
+
+
+template<typename KeyType>
+bool BTreeImage<KeyType>::open(const char *path) {
+    static_assert(std::is_trivially_copyable<KeyType>::value, "the image holds keys byte by byte");
+    close();
+    int fd = ::open(path, O_RDONLY);
+    if(fd < 0)
+        return false;
+    struct stat st;
+    if(fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(BTreeImageHeader)){
+        ::close(fd);
+        return false;
+    }
+    void *addr = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if(addr == MAP_FAILED)
+        return false;
+
+    const BTreeImageHeader *h = (const BTreeImageHeader *) addr;
+    if(memcmp(h->magic, BTREE_IMAGE_MAGIC, sizeof(h->magic)) != 0 || h->key_size != sizeof(KeyType) ||
+       (size_t) st.st_size != sizeof(*h) + h->count * sizeof(KeyType)){
+        munmap(addr, st.st_size);
+        return false;
+    }
+    base = addr;
+    len = st.st_size;
+    n = h->count;
+    data = (const KeyType *) (h + 1);
+    return true;
+}
+
+template<typename KeyType>
+void BTreeImage<KeyType>::close() {
+    if(base != NULL)
+        munmap(base, len);
+    base = NULL;
+    len = n = 0;
+    data = NULL;
+}
+
+template<typename KeyType>
+bool BTreeImage<KeyType>::search(KeyType &key) const {
+    size_t left = 0, right = n;                         //在[left, right)中找第一个不小于key的
+    while(left < right){
+        size_t mid = (left + right) >> 1;
+        if(data[mid] < key)
+            left = mid + 1;
+        else
+            right = mid;
+    }
+    if(left < n && data[left] == key){
+        key = data[left];
+        return true;
+    }
+    return false;
+}
+
+
+#ifdef BTREE_RANK
+/*
+ * 小于key(inclusive时小于等于)的关键字个数，沿查找路径累加左侧子树的计数
+ */
+template<typename KeyType>
+size_t BTree<KeyType>::_rank(const KeyType &key, bool inclusive) const {
+    size_t n = 0, idx;
+    for(const BTNode *p = root; p != NULL; p = p->ptr[idx]){
+        bool found = _searchNode(const_cast<BTNode *>(p), key, idx);
+        for(size_t i = 0; i < idx; ++i)
+            n += _size(p->ptr[i]);
+        if(found)
+            return n + idx - 1 + (inclusive ? 1 : 0);  //p->key[idx] == key,其左侧子树都已计入
+        n += idx;
+    }
+    return n;
+}
+
+template<typename KeyType>
+size_t BTree<KeyType>::rank(KeyType key) const {
+    return _rank(key, false);
+}
+
+/*
+ * 按子树计数逐层跳过左侧的孩子，k从0开始，k不小于关键字总数时返回false
+ */
+template<typename KeyType>
+bool BTree<KeyType>::select(size_t k, KeyType &key) const {
+    const BTNode *p = root;
+    if(k >= _size(p)) return false;
+    while(p != NULL){
+        size_t i = 0;
+        for(; i <= p->keynum; ++i){
+            size_t c = _size(p->ptr[i]);
+            if(k < c) break;                            //在第i棵子树中
+            k -= c;
+            if(i < p->keynum && k-- == 0){
+                key = p->key[i + 1];
+                return true;
+            }
+        }
+        p = p->ptr[i];
+    }
+    return false;
+}
+
+template<typename KeyType>
+size_t BTree<KeyType>::count_range(KeyType lo, KeyType hi) const {
+    if(hi < lo) return 0;
+    return _rank(hi, true) - _rank(lo, false);
+}
+#endif
 
 template<typename KeyType>
 void BTree<KeyType>::traverse() {
@@ -394,7 +1290,173 @@ void BTree<KeyType>::traverse() {
  }
 } //namespace btree
 
-#ifdef DEBUG
+//被其他程序(如btree_bench.cpp)包含时定义BTREE_NO_MAIN，不带测试和main
+#if defined(DEBUG) && !defined(BTREE_NO_MAIN)
+#include <set>
+#include <string>
+
+/*
+ * std::string关键字走逐个移动的路径：插入、删除、分裂、连接和区间删除后与std::set对照
+ */
+void test_string(){
+    btree::BTree<std::string> tree(5), right(5);
+    std::set<std::string> expect;
+    char buf[64];
+    for(int round = 0; round < 20; ++round){
+        for(int i = 0; i < 500; ++i){
+            snprintf(buf, sizeof(buf), "key-%06d-%s", rand() % 5000, "padding past the small string buffer");
+            if(rand() % 3){
+                tree.emplace(buf);
+                expect.insert(buf);
+            }else{
+                tree.del(std::string(buf));
+                expect.erase(buf);
+            }
+        }
+        snprintf(buf, sizeof(buf), "key-%06d", rand() % 5000);
+        std::string mid(buf);
+        tree.split_at(mid, right);
+        size_t n = 0;
+        right.visit([&n, &mid](const std::string &k) { assert(!(k < mid)); ++n; });
+        assert(n == (size_t) std::distance(expect.lower_bound(mid), expect.end()));
+        bool joined = tree.join(right);
+        assert(joined);
+        (void) joined;
+        if(round % 4 == 3){
+            std::string lo = mid, hi = mid + "~";
+            tree.erase_range(lo, hi);
+            expect.erase(expect.lower_bound(lo), expect.upper_bound(hi));
+        }
+
+        std::set<std::string>::iterator it = expect.begin();
+        tree.visit([&it, &expect](const std::string &k) { assert(it != expect.end() && *it == k); ++it; });
+        assert(it == expect.end());
+        for(it = expect.begin(); it != expect.end(); ++it){
+            std::string k = *it;
+            bool found = tree.search(k);
+            assert(found && k == *it);
+            (void) found;
+        }
+    }
+    printf("test_string passed, %zu keys\r\n", expect.size());
+}
+
+/*
+ * save写出的映像：load重建的树和mmap打开的BTreeImage都与std::set对照，空树也要能往返
+ */
+void test_image(){
+    const char *path = "btree_image.bin";
+    btree::BTree<int> tree(7), loaded(5);
+    std::set<int> expect;
+    for(int round = 0; round < 2; ++round){
+        bool saved = tree.save(path);
+        bool ok = loaded.load(path);
+        assert(saved && ok);
+        (void) saved;
+        (void) ok;
+        std::set<int>::iterator it = expect.begin();
+        loaded.visit([&it, &expect](const int &k) { assert(it != expect.end() && *it == k); ++it; });
+        assert(it == expect.end());
+
+        btree::BTreeImage<int> image;
+        bool opened = image.open(path);
+        assert(opened && image.size() == expect.size());
+        (void) opened;
+        for(int k = -1; k <= 50000; ++k){
+            int key = k;
+            bool found = image.search(key);
+            assert(found == (expect.count(k) == 1));
+            (void) found;
+        }
+        image.close();
+
+        for(int i = 0; i < 20000; ++i){
+            int k = rand() % 50000;
+            if(rand() % 4){
+                tree.insert(k);
+                expect.insert(k);
+            }else{
+                tree.del(k);
+                expect.erase(k);
+            }
+        }
+    }
+    remove(path);
+    printf("test_image passed, %zu keys\r\n", expect.size());
+}
+
+/*
+ * freeze得到的FrozenBTree与冻结时的std::set对照，之后再改树也不影响它
+ */
+void test_frozen(){
+    btree::BTree<int> tree(9);
+    btree::FrozenBTree<int> frozen;
+    std::set<int> expect, kept;
+    for(int round = 0; round < 6; ++round){
+        for(int i = 0; i < 3000; ++i){
+            int k = rand() % 10000;
+            if(rand() % 3){
+                tree.insert(k);
+                expect.insert(k);
+            }else{
+                tree.del(k);
+                expect.erase(k);
+            }
+        }
+        //上一轮冻结的关键字不随树变化
+        assert(frozen.size() == kept.size());
+        for(int k = -1; k <= 10000; ++k){
+            int key = k;
+            bool found = frozen.search(key);
+            assert(found == (kept.count(k) == 1));
+            (void) found;
+        }
+        tree.freeze(frozen);
+        kept = expect;
+    }
+    printf("test_frozen passed, %zu keys\r\n", kept.size());
+}
+
+#ifdef BTREE_RANK
+/*
+ * rank与select互逆，count_range与std::set对照
+ */
+void test_rank(){
+    btree::BTree<int> tree(6);
+    std::set<int> expect;
+    for(int round = 0; round < 5; ++round){
+        for(int i = 0; i < 4000; ++i){
+            int k = rand() % 10000;
+            if(rand() % 3){
+                tree.insert(k);
+                expect.insert(k);
+            }else{
+                tree.del(k);
+                expect.erase(k);
+            }
+        }
+        size_t r = 0;
+        for(std::set<int>::iterator it = expect.begin(); it != expect.end(); ++it, ++r){
+            int key = -1;
+            bool found = tree.select(r, key);
+            assert(found && key == *it && tree.rank(key) == r);
+            (void) found;
+        }
+        int key;
+        bool found = tree.select(r, key);
+        assert(!found);
+        (void) found;
+        for(int i = 0; i < 1000; ++i){
+            int lo = rand() % 10000, hi = lo + rand() % 2000;
+            size_t n = std::distance(expect.lower_bound(lo), expect.upper_bound(hi));
+            assert(tree.count_range(lo, hi) == n);
+            (void) n;
+        }
+    }
+    printf("test_rank passed, %zu keys\r\n", expect.size());
+}
+#endif
+
 void test1(){
     btree::BTree<int> tree(50);
     //BTree<int> tree(50);
@@ -488,6 +1550,12 @@ void test2(){
 }
 
 int main(){
+    test_string();
+    test_image();
+    test_frozen();
+#ifdef BTREE_RANK
+    test_rank();
+#endif
     test1();
     return 0;
 }
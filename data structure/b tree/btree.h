@@ -8,73 +8,314 @@
 #include <cstddef>
 #include <cassert>
 #include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <stdint.h>
+#include <new>
+#include <utility>
+#include <type_traits>
 
 #define DEBUG
 
+/*
+ * 编译期插桩：定义BTREE_STATS后统计查找访问的结点数、分裂/合并/借位次数和
+ * _insertBTNode移动的字节数，不定义时没有任何开销。
+ * 定义BTREE_TRACE(event, node)可在分裂/合并/借位时回调，event为事件名字符串。
+ */
+#ifdef BTREE_STATS
+#define BTREE_COUNT(field, n) (counters.field += (n))
+#else
+#define BTREE_COUNT(field, n) ((void) 0)
+#endif
+
+#ifndef BTREE_TRACE
+#define BTREE_TRACE(event, node) ((void) 0)
+#endif
+
+/*
+ * 顺序统计：定义BTREE_RANK后每个结点记录其子树的关键字个数，插入、删除和
+ * 分裂/合并/借位时沿路径维护，rank/select/count_range为O(log n)。
+ */
+
+/*
+ * 手指查找：定义BTREE_FINGER后search记住上次停下的结点，下次从它沿双亲上移到
+ * 首末关键字包住key的结点再向下查找，相邻的查找只访问常数个结点。
+ */
+
+/*
+ * 持久化快照：定义BTREE_COW后结点带引用计数，snapshot()只让快照引用当前的根，O(1)。
+ * 之后的插入、删除、分裂与连接从根往下把与快照共享的结点复制一份再修改，只复制
+ * 经过的路径(和借位、合并用到的兄弟)，快照看到的结点从不被改写；最后一个引用
+ * 放掉时才释放结点。树的拷贝也只是共享根。双亲指针只对本树沿路径新走过的结点
+ * 有效，因此不能与BTREE_FINGER同时使用，追加也不走最右叶子的快速路径
+ */
+#if defined(BTREE_COW) && defined(BTREE_FINGER)
+#error "BTREE_COW and BTREE_FINGER cannot be used together"
+#endif
+
 namespace btree{
 
+#define BTREE_FILL_BUCKETS 10
+
+/*
+ * BTree::save写出的映像：文件头后紧跟count个升序排列的关键字，没有指针，
+ * 可以直接mmap后查找，也可以由BTree::load线性时间重建成树
+ */
+#define BTREE_IMAGE_MAGIC "BTREEIMG"
+
+struct BTreeImageHeader {
+  char magic[8];
+  uint32_t key_size;              //sizeof(KeyType)，与读入方不同时拒绝
+  uint32_t m;                     //保存时树的阶，仅供参考
+  uint64_t count;                 //关键字个数
+};
+
+struct BTreeStats {
+  //以下计数只在定义BTREE_STATS时累加
+  uint64_t searches;              //_searchBTree调用次数(查找和插入)
+  uint64_t node_visits;           //查找中访问的结点数
+  uint64_t splits;
+  uint64_t combines;
+  uint64_t move_lefts;
+  uint64_t move_rights;
+  uint64_t insert_bytes_moved;    //_insertBTNode中memmove的字节数
+  uint64_t appends;               //insert比最大关键字还大、不经查找直接插入最右叶子的次数
+  uint64_t copies;                //BTREE_COW下因与快照共享而复制的结点数
+  //以下由stats()遍历得到
+  size_t height;
+  size_t nodes;
+  size_t keys;
+  size_t fill[BTREE_FILL_BUCKETS];  //fill[i]: keynum/max_keynum落在[i/10, (i+1)/10)的结点数，满结点计入最后一个
+};
+
+template<typename KeyType> class FrozenBTree;
+#ifdef BTREE_COW
+template<typename KeyType> class BTreeSnapshot;
+#endif
+
 template<typename KeyType> 
 class BTree{
   struct BTNode{
     size_t keynum;                     //结点关键字个数
-    KeyType *key;        //关键字数组，key[0]不使用 
+    KeyType *key;        //关键字数组，key[0]不使用，只有key[1..keynum]是构造过的对象
     struct BTNode *parent;            //双亲结点指针
     struct BTNode **ptr;         //孩子结点指针数组 
+#ifdef BTREE_RANK
+    size_t size;                       //子树关键字个数
+#endif
+#ifdef BTREE_COW
+    size_t ref;                        //引用它的双亲、树和快照个数
+#endif
     BTNode(uint32_t m) {
       keynum = 0;
-      key = new KeyType[m + 1];
+#ifdef BTREE_RANK
+      size = 0;
+#endif
+#ifdef BTREE_COW
+      ref = 1;
+#endif
+      key = (KeyType *) ::operator new((m + 1) * sizeof(KeyType));   //不默认构造，插入时再就地构造
       ptr = new BTNode*[m + 1];
       memset(ptr, 0, (m + 1) * sizeof(BTNode*));
       parent = NULL;
     }
     ~BTNode(){
-      delete []key;
+      for(size_t i = 1; i <= keynum; ++i)
+        key[i].~KeyType();
+      ::operator delete(key);
       delete []ptr;
     }
   } ;
 public:
   BTree(uint32_t m): m(m), 
-                root(NULL), 
                 max_keynum(m - 1), 
-                min_keynum((m - 1) >> 1){
+                min_keynum((m - 1) >> 1),
+                root(NULL), 
+                tail(NULL){
     
     if(m < 4){
       fprintf(stderr, "m >= 4 required!!!\r\n");
       exit(-1);
     }
+#ifdef BTREE_FINGER
+    finger = NULL;
+#endif
+    reset_stats();
   }
+  BTree(const BTree &other);                          //BTREE_COW下与other共享结点，否则逐个复制
+  BTree &operator=(const BTree &other);
 
   bool search(KeyType &key);
   bool insert(KeyType key);
+  template<typename... Args> bool emplace(Args&&... args) {   //由args构造关键字再插入，关键字只移动不复制
+    KeyType key(std::forward<Args>(args)...);
+    return insert(std::move(key));
+  }
   void del(KeyType key);
   void traverse();
+  template<typename Visitor> void visit(Visitor fn) const;   //按关键字升序对每个关键字调用fn
+  void split_at(KeyType key, BTree &right);           //不小于key的关键字移入right(right原有的关键字释放，阶须相同)
+  bool join(BTree &other);                            //并入关键字全部小于或全部大于本树的other，other清空；范围交叠或阶不同返回false
+  void erase_range(KeyType lo, KeyType hi);           //删除[lo, hi]内的关键字
+  BTreeStats stats() const;
+  void reset_stats();
+  //以下三个按字节保存关键字，要求KeyType可平凡复制
+  bool save(const char *path) const;                  //写出升序关键字的映像
+  bool load(const char *path);                        //读入save的映像，线性时间重建，原有关键字释放
+  void freeze(FrozenBTree<KeyType> &frozen) const;    //把当前关键字做成只读的FrozenBTree，frozen原有内容释放
+#ifdef BTREE_COW
+  void snapshot(BTreeSnapshot<KeyType> &snap) const;  //snap引用当前版本，O(1)，snap原有的版本释放
+#endif
+#ifdef BTREE_RANK
+  size_t rank(KeyType key) const;                     //小于key的关键字个数
+  bool select(size_t k, KeyType &key) const;          //第k小(从0起)的关键字
+  size_t count_range(KeyType lo, KeyType hi) const;   //[lo, hi]内的关键字个数
+#endif
 
   ~BTree(){
       _destroyBTree(root);
   }
 
 private:
-  bool _searchNode(BTNode *p, KeyType key, size_t &idx) const;
-  bool _searchBTree(KeyType key, BTNode *&p, size_t &idx) const;
-  void _insertBTNode(BTNode *&p, size_t idx, KeyType key, BTNode *q);
+#ifdef BTREE_COW
+  friend class BTreeSnapshot<KeyType>;
+  BTNode *_clone(BTNode *p);
+#endif
+  static bool _searchNode(BTNode *p, const KeyType &key, size_t &idx);
+  bool _searchFrom(BTNode *from, const KeyType &key, BTNode *&p, size_t &idx) const;
+  bool _searchBTree(const KeyType &key, BTNode *&p, size_t &idx) const;
+  bool _searchPath(const KeyType &key, BTNode *&p, size_t &idx);
+  static void _moveKeys(KeyType *dst, KeyType *src, size_t n);
+  void _own(BTNode *&p);
+  BTNode *_unshare(BTNode *p, size_t idx);
+  BTNode *_copyBTree(const BTNode *p, BTNode *parent) const;
+  //以下取KeyType &的参数会被移走
+  void _insertBTNode(BTNode *&p, size_t idx, KeyType &key, BTNode *q);
   void _splitBTNode(BTNode *p, BTNode *&q);
-  void _newRoot(KeyType key,BTNode *p,BTNode *q);
-  void _insertBTree(BTNode *p, size_t idx, KeyType key);
+  void _newRoot(KeyType &key,BTNode *p,BTNode *q);
+  void _insertBTree(BTNode *p, size_t idx, KeyType &key);
+  void _splitUp(BTNode *p);
   void _substitution(BTNode *p, size_t idx);
   void _moveRight(BTNode *p, size_t idx);
   void _moveLeft(BTNode *p, size_t idx);
   void _combine(BTNode *p, size_t idx);
   void _adjustBTree(BTNode *p, size_t idx);
-  bool _btNodeDelete(BTNode *p, KeyType key);
-  void _destroyBTree(BTNode* &p);
+  bool _btNodeDelete(BTNode *p, const KeyType &key);
+  static void _destroyBTree(BTNode* &p);
+  BTNode *_join(BTNode *l, size_t hl, KeyType &mid, BTNode *r, size_t hr, size_t &h);
+  void _split(BTNode *p, size_t h, const KeyType &key, bool inclusive, BTNode *&l, size_t &hl, BTNode *&r, size_t &hr);
+  static size_t _height(const BTNode *p) {
+    size_t h = 0;
+    for(; p != NULL; p = p->ptr[0])
+      h++;
+    return h;
+  }
+  template<typename Visitor> static void _visit(const BTNode *p, Visitor &fn);
+  void _collectStats(const BTNode *p, BTreeStats &st) const;
+  void _build(const KeyType *keys, size_t n);
+#ifdef BTREE_RANK
+  static size_t _size(const BTNode *p) { return p != NULL ? p->size : 0; }
+  size_t _rank(const KeyType &key, bool inclusive) const;
+#endif
 
 private:
   
   uint32_t m;
   uint32_t max_keynum, min_keynum;
   BTNode* root;
+  BTNode* tail;                   //最右叶子，为NULL时由insert重新找
+#ifdef BTREE_FINGER
+  BTNode* finger;                 //上次search停下的结点
+#endif
+#ifdef BTREE_STATS
+  mutable BTreeStats counters;
+#endif
+};
+
+#ifdef BTREE_COW
+/*
+ * BTree::snapshot取得的一个版本，只读。它引用的结点不会再被树改写，查找和遍历
+ * 不加锁，可以在其他线程进行；取得和释放(析构或再次snapshot)须在修改树的线程
+ */
+template<typename KeyType>
+class BTreeSnapshot{
+public:
+  BTreeSnapshot(): root(NULL) {}
+  ~BTreeSnapshot(){
+    release();
+  }
+
+  bool search(KeyType &key) const;
+  template<typename Visitor> void visit(Visitor fn) const;   //按关键字升序对每个关键字调用fn
+  bool empty() const { return root == NULL; }
+  void release();                                     //放掉引用的版本，只有快照引用的结点被释放
+
+private:
+  friend class BTree<KeyType>;
+  typedef typename BTree<KeyType>::BTNode BTNode;
+  BTreeSnapshot(const BTreeSnapshot &);
+  BTreeSnapshot &operator=(const BTreeSnapshot &);
+
+  BTNode *root;
+};
+#endif
+
+/*
+ * 只读打开BTree::save的映像：整个文件mmap进来，查找在升序关键字上二分，
+ * 不建树、不复制关键字
+ */
+template<typename KeyType>
+class BTreeImage{
+public:
+  BTreeImage(): base(NULL), len(0), n(0), data(NULL) {}
+  ~BTreeImage(){
+    close();
+  }
+
+  bool open(const char *path);
+  void close();
+  bool search(KeyType &key) const;
+  size_t size() const { return n; }
+  const KeyType *keys() const { return data; }        //升序，共size()个
+
+private:
+  BTreeImage(const BTreeImage &);
+  BTreeImage &operator=(const BTreeImage &);
+
+  void *base;
+  size_t len;
+  size_t n;
+  const KeyType *data;
+};
+
+/*
+ * BTree::freeze得到的只读快照。关键字按Eytzinger(BFS)顺序放在一个按缓存行对齐的
+ * 数组里：b[k]的左右孩子是b[2k]和b[2k+1]，没有指针，内存约等于关键字本身。
+ * 查找无分支地逐层下降，同时预取几层之后所在的缓存行
+ */
+template<typename KeyType>
+class FrozenBTree{
+public:
+  FrozenBTree(): b(NULL), n(0) {}
+  ~FrozenBTree(){
+    free(b);
+  }
+
+  void build(const KeyType *keys, size_t count);      //由count个升序关键字建立
+  bool search(KeyType &key) const;
+  size_t size() const { return n; }
+  size_t bytes() const { return b != NULL ? (n + 1) * sizeof(KeyType) : 0; }
+
+private:
+  friend class BTree<KeyType>;
+  FrozenBTree(const FrozenBTree &);
+  FrozenBTree &operator=(const FrozenBTree &);
+  void _reserve(size_t count);
+  static size_t _first(size_t count);
+  static size_t _next(size_t k, size_t count);
+
+  KeyType *b;                     //b[1..n]，b[0]不用
+  size_t n;
 };
 
 } //namespace btree
@@ -0,0 +1,319 @@
+/*
+ * Micro-benchmark of btree::BTree against std::set over a sweep of orders
+ * and dataset sizes.
+ *
+ *   g++ -O2 -DNDEBUG btree_bench.cpp -o btree_bench
+ *   ./btree_bench [-n 4096,65536,1048576] [-m 8,16,32,64,128,256] [-t int,u64,str,std]
+ *
+ * For each key type, size and order it times insert, search, in-order
+ * traversal and del of n shuffled keys. It reports ns/op, cache misses/op
+ * from perf counters when the kernel allows them, and heap bytes per key.
+ * Once per size it also times freeze and search on the FrozenBTree.
+ * Built with -DBTREE_STATS it also prints the tree shape and the search,
+ * split and memmove counters after the inserts.
+ *
+ * The str case uses a 16 byte fixed-width key so the same keys can be
+ * frozen: FrozenBTree only holds trivially copyable keys. The std case runs
+ * the same strings as std::string, which BTree moves key by key instead of
+ * with memmove, and has no Frozen row.
+ */
+
+#define BTREE_NO_MAIN
+#include "btree.cpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <malloc.h>
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+/* a 16 byte string key, compared like strcmp */
+struct FixedKey {
+    char s[16];
+    bool operator<(const FixedKey &o) const { return memcmp(s, o.s, sizeof(s)) < 0; }
+    bool operator<=(const FixedKey &o) const { return memcmp(s, o.s, sizeof(s)) <= 0; }
+    bool operator>(const FixedKey &o) const { return memcmp(s, o.s, sizeof(s)) > 0; }
+    bool operator==(const FixedKey &o) const { return memcmp(s, o.s, sizeof(s)) == 0; }
+};
+
+template<typename Key> static Key make_key(uint64_t v);
+
+template<> int make_key<int>(uint64_t v) { return (int) v; }
+template<> uint64_t make_key<uint64_t>(uint64_t v) { return v * 0x9e3779b97f4a7c15ULL; }
+template<> FixedKey make_key<FixedKey>(uint64_t v) {
+    FixedKey k;
+    snprintf(k.s, sizeof(k.s), "key%012llu", (unsigned long long) (v * 2654435761ULL % 1000000000000ULL));
+    return k;
+}
+template<> std::string make_key<std::string>(uint64_t v) {
+    FixedKey k = make_key<FixedKey>(v);
+    return std::string(k.s, strlen(k.s));
+}
+
+static double now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static size_t heap_used() {
+    struct mallinfo2 mi = mallinfo2();
+    return mi.uordblks + mi.hblkhd;
+}
+
+/* hardware cache misses of this thread, -1 where perf events are not allowed */
+static int perf_fd = -1;
+
+static void perf_init() {
+#ifdef __linux__
+    struct perf_event_attr pe;
+    memset(&pe, 0, sizeof(pe));
+    pe.type = PERF_TYPE_HARDWARE;
+    pe.size = sizeof(pe);
+    pe.config = PERF_COUNT_HW_CACHE_MISSES;
+    pe.disabled = 1;
+    pe.exclude_kernel = 1;
+    pe.exclude_hv = 1;
+    perf_fd = syscall(__NR_perf_event_open, &pe, 0, -1, -1, 0);
+#endif
+}
+
+static void perf_start() {
+#ifdef __linux__
+    if(perf_fd >= 0){
+        ioctl(perf_fd, PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+static long long perf_stop() {
+    long long count = -1;
+#ifdef __linux__
+    if(perf_fd >= 0){
+        ioctl(perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+        if(read(perf_fd, &count, sizeof(count)) != sizeof(count))
+            count = -1;
+    }
+#endif
+    return count;
+}
+
+struct Timer {
+    double t;
+    void start() { perf_start(); t = now(); }
+    void stop(const char *type, const char *impl, size_t n, const char *op, size_t ops) {
+        double s = now() - t;
+        long long misses = perf_stop();
+        printf("%-4s %-10s n=%-9zu %-8s %8.1f ns/op", type, impl, n, op, s * 1e9 / ops);
+        if(misses >= 0)
+            printf("  %6.2f misses/op", (double) misses / ops);
+        printf("\n");
+    }
+};
+
+static volatile size_t sink;
+
+template<typename Key>
+static void bench_btree(const char *type, const std::vector<Key> &keys, const std::vector<Key> &probe, uint32_t m) {
+    char impl[32];
+    snprintf(impl, sizeof(impl), "BTree(%u)", m);
+    size_t n = keys.size(), found = 0, visited = 0;
+    Timer t;
+
+    size_t heap = heap_used();
+    btree::BTree<Key> *tree = new btree::BTree<Key>(m);
+    t.start();
+    for(size_t i = 0; i < n; ++i)
+        tree->insert(keys[i]);
+    t.stop(type, impl, n, "insert", n);
+    size_t bytes = heap_used() - heap;
+
+#ifdef BTREE_STATS
+    btree::BTreeStats st = tree->stats();
+    printf("%-4s %-10s n=%-9zu %-8s height %zu nodes %zu fill %.0f%% visits/search %.2f splits %llu moved %.1f bytes/insert\n",
+           type, impl, n, "shape", st.height, st.nodes, 100.0 * st.keys / (st.nodes * (m - 1)),
+           (double) st.node_visits / st.searches, (unsigned long long) st.splits,
+           (double) st.insert_bytes_moved / n);
+#endif
+
+    t.start();
+    for(size_t i = 0; i < n; ++i){
+        Key k = probe[i];
+        found += tree->search(k);
+    }
+    t.stop(type, impl, n, "search", n);
+
+    t.start();
+    tree->visit([&visited](const Key &) { ++visited; });
+    t.stop(type, impl, n, "traverse", n);
+
+    t.start();
+    for(size_t i = 0; i < n; ++i)
+        tree->del(probe[i]);
+    t.stop(type, impl, n, "del", n);
+    delete tree;
+
+    printf("%-4s %-10s n=%-9zu %-8s %8.1f bytes/key\n", type, impl, n, "memory", (double) bytes / n);
+    if(found != n || visited != n)
+        printf("BTree(%u) lost keys: found %zu visited %zu of %zu\n", m, found, visited, n);
+    sink = found + visited;
+}
+
+template<typename Key>
+static void bench_set(const char *type, const std::vector<Key> &keys, const std::vector<Key> &probe) {
+    const char *impl = "std::set";
+    size_t n = keys.size(), found = 0, visited = 0;
+    Timer t;
+
+    size_t heap = heap_used();
+    std::set<Key> *set = new std::set<Key>();
+    t.start();
+    for(size_t i = 0; i < n; ++i)
+        set->insert(keys[i]);
+    t.stop(type, impl, n, "insert", n);
+    size_t bytes = heap_used() - heap;
+
+    t.start();
+    for(size_t i = 0; i < n; ++i)
+        found += set->find(probe[i]) != set->end();
+    t.stop(type, impl, n, "search", n);
+
+    t.start();
+    for(typename std::set<Key>::const_iterator it = set->begin(); it != set->end(); ++it)
+        ++visited;
+    t.stop(type, impl, n, "traverse", n);
+
+    t.start();
+    for(size_t i = 0; i < n; ++i)
+        set->erase(probe[i]);
+    t.stop(type, impl, n, "del", n);
+    delete set;
+
+    printf("%-4s %-10s n=%-9zu %-8s %8.1f bytes/key\n", type, impl, n, "memory", (double) bytes / n);
+    sink = found + visited;
+}
+
+template<typename Key>
+static void bench_frozen(const char *, const std::vector<Key> &, const std::vector<Key> &, std::false_type) {
+}
+
+template<typename Key>
+static void bench_frozen(const char *type, const std::vector<Key> &keys, const std::vector<Key> &probe, std::true_type) {
+    const char *impl = "Frozen";
+    size_t n = keys.size(), found = 0;
+    Timer t;
+
+    btree::BTree<Key> *tree = new btree::BTree<Key>(64);
+    for(size_t i = 0; i < n; ++i)
+        tree->insert(keys[i]);
+    btree::FrozenBTree<Key> frozen;
+    t.start();
+    tree->freeze(frozen);
+    t.stop(type, impl, n, "freeze", n);
+    delete tree;
+
+    t.start();
+    for(size_t i = 0; i < n; ++i){
+        Key k = probe[i];
+        found += frozen.search(k);
+    }
+    t.stop(type, impl, n, "search", n);
+
+    printf("%-4s %-10s n=%-9zu %-8s %8.1f bytes/key\n", type, impl, n, "memory", (double) frozen.bytes() / n);
+    if(found != n)
+        printf("Frozen lost keys: found %zu of %zu\n", found, n);
+    sink = found;
+}
+
+template<typename Key>
+static void bench_type(const char *type, const std::vector<size_t> &sizes, const std::vector<uint32_t> &orders) {
+    for(size_t s = 0; s < sizes.size(); ++s){
+        size_t n = sizes[s];
+        std::vector<Key> keys(n), probe(n);
+        for(size_t i = 0; i < n; ++i)
+            keys[i] = make_key<Key>(i + 1);
+        srand(2021);
+        for(size_t i = n - 1; i > 0; --i)
+            std::swap(keys[i], keys[rand() % (i + 1)]);
+        probe = keys;
+        for(size_t i = n - 1; i > 0; --i)
+            std::swap(probe[i], probe[rand() % (i + 1)]);
+
+        bench_set<Key>(type, keys, probe);
+        bench_frozen<Key>(type, keys, probe, std::is_trivially_copyable<Key>());
+        for(size_t j = 0; j < orders.size(); ++j)
+            bench_btree<Key>(type, keys, probe, orders[j]);
+        printf("\n");
+    }
+}
+
+template<typename T>
+static std::vector<T> parse_list(const char *arg) {
+    std::vector<T> v;
+    std::string s(arg);
+    size_t pos = 0;
+    while(pos < s.size()){
+        size_t comma = s.find(',', pos);
+        if(comma == std::string::npos)
+            comma = s.size();
+        v.push_back((T) strtoull(s.substr(pos, comma - pos).c_str(), NULL, 10));
+        pos = comma + 1;
+    }
+    return v;
+}
+
+int main(int argc, char *argv[]) {
+    std::vector<size_t> sizes = parse_list<size_t>("4096,65536,1048576");
+    std::vector<uint32_t> orders = parse_list<uint32_t>("8,16,32,64,128,256");
+    std::string types = "int,u64,str,std";
+
+    int ch;
+    while((ch = getopt(argc, argv, "n:m:t:")) != -1){
+        switch(ch){
+        case 'n':
+            sizes = parse_list<size_t>(optarg);
+            break;
+        case 'm':
+            orders = parse_list<uint32_t>(optarg);
+            break;
+        case 't':
+            types = optarg;
+            break;
+        default:
+            fprintf(stderr, "usage: %s [-n sizes] [-m orders] [-t int,u64,str,std]\n", argv[0]);
+            return 1;
+        }
+    }
+    for(size_t i = 0; i < orders.size(); ++i){
+        if(orders[i] < 4){
+            fprintf(stderr, "m >= 4 required!!!\n");
+            return 1;
+        }
+    }
+
+    perf_init();
+    if(perf_fd < 0)
+        printf("perf events unavailable, cache misses not reported\n");
+
+    if(types.find("int") != std::string::npos)
+        bench_type<int>("int", sizes, orders);
+    if(types.find("u64") != std::string::npos)
+        bench_type<uint64_t>("u64", sizes, orders);
+    if(types.find("str") != std::string::npos)
+        bench_type<FixedKey>("str", sizes, orders);
+    if(types.find("std") != std::string::npos)
+        bench_type<std::string>("std", sizes, orders);
+    return 0;
+}